@@ -0,0 +1,640 @@
+/*
+ * udplogger-bench - Load generator for measuring udplogger's throughput.
+ *
+ * Sends synthetic netconsole traffic from many loopback senders to a running
+ * udplogger and reports sustained packets/sec, lines/sec, loss and CPU usage.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "udplogger-binlog.h"
+
+/* Structure for one synthetic sender. */
+static struct host {
+	int fd; /* Socket bound to a distinct loopback address. */
+	char addr_str[24]; /* "ip:port" as udplogger writes in lines. */
+	unsigned int seq; /* Sequence number for extended headers. */
+	char *pending; /* Second half of a split line, if any. */
+	int pending_len; /* Valid bytes in @pending . */
+} *hosts = NULL;
+
+/* Number of senders. */
+static int num_hosts = 16;
+/* Seconds to send. */
+static int duration = 10;
+/* Packets per second (0 for unlimited). */
+static int rate = 0;
+/* Minimal and maximal line length. */
+static int min_len = 40;
+static int max_len = 200;
+/* Use exponential rather than uniform line length distribution? */
+static _Bool exp_dist = 0;
+/* Lines per datagram. */
+static int batch = 1;
+/* Percentage of lines split across two datagrams. */
+static int split_pct = 0;
+/* Send extended netconsole headers? */
+static _Bool extended = 0;
+/* Max payload per fragment of extended messages (0 for no fragmentation). */
+static int frag_size = 0;
+/* udplogger's pid for CPU accounting (0 for unknown). */
+static int target_pid = 0;
+/* udplogger's log directory for counting written lines (NULL for unknown). */
+static const char *log_dir = NULL;
+/* Seconds to wait before counting written lines. */
+static int settle = 2;
+
+/* Statistics. */
+static unsigned long long sent_packets = 0;
+static unsigned long long sent_lines = 0;
+static unsigned long long sent_bytes = 0;
+static unsigned long long send_errors = 0;
+
+/**
+ * now_ns - Get monotonic time.
+ *
+ * Returns current time in nanoseconds.
+ */
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * line_length - Pick the length of the next line.
+ *
+ * Returns length in bytes, including the trailing newline.
+ */
+static int line_length(void)
+{
+	int len;
+	if (max_len <= min_len)
+		return min_len;
+	if (exp_dist) {
+		/* Mostly short lines with a long tail, like kernel messages. */
+		const double mean = (max_len - min_len) / 4.0;
+		const double u = (random() + 1.0) / (RAND_MAX + 2.0);
+		len = min_len - (int) (mean * log(u));
+		if (len > max_len)
+			len = max_len;
+	} else {
+		len = min_len + random() % (max_len - min_len + 1);
+	}
+	return len;
+}
+
+/**
+ * fill_line - Build one line of text.
+ *
+ * @buf:  Buffer to write to.
+ * @len:  Length of the line, including the trailing newline.
+ * @host: Index of the sender.
+ * @seq:  Sequence number.
+ *
+ * Returns nothing.
+ */
+static void fill_line(char *buf, const int len, const int host,
+		      const unsigned int seq)
+{
+	int pos = snprintf(buf, len, "bench host %d seq %u ", host, seq);
+	if (pos > len - 1)
+		pos = len - 1;
+	memset(buf + pos, 'x', len - 1 - pos);
+	buf[len - 1] = '\n';
+}
+
+/**
+ * send_packet - Send one datagram and account it.
+ *
+ * @ptr: Pointer to "struct host".
+ * @buf: Data to send.
+ * @len: Length of @buf .
+ *
+ * Returns nothing.
+ */
+static void send_packet(struct host *ptr, const char *buf, const int len)
+{
+	while (send(ptr->fd, buf, len, 0) == -1) {
+		if (errno == EINTR)
+			continue;
+		send_errors++;
+		return;
+	}
+	sent_packets++;
+	sent_bytes += len;
+}
+
+/**
+ * send_extended - Send one message with extended netconsole headers.
+ *
+ * @ptr:  Pointer to "struct host".
+ * @text: Message text, including the trailing newline.
+ * @len:  Length of @text .
+ *
+ * Returns nothing.
+ *
+ * Messages longer than @frag_size are fragmented the way netconsole does,
+ * with "ncfrag=<offset>/<total>" in every fragment's header.
+ */
+static void send_extended(struct host *ptr, const char *text, const int len)
+{
+	static char buf[65536];
+	const unsigned long long usec = now_ns() / 1000;
+	const unsigned int seq = ptr->seq++;
+	int hlen;
+	int off;
+	if (!frag_size || len <= frag_size) {
+		hlen = snprintf(buf, sizeof(buf), "6,%u,%llu,-;", seq, usec);
+		memcpy(buf + hlen, text, len);
+		send_packet(ptr, buf, hlen + len);
+		return;
+	}
+	for (off = 0; off < len; off += frag_size) {
+		const int chunk = len - off < frag_size ? len - off : frag_size;
+		hlen = snprintf(buf, sizeof(buf), "6,%u,%llu,-,ncfrag=%d/%d;",
+				seq, usec, off, len);
+		memcpy(buf + hlen, text + off, chunk);
+		send_packet(ptr, buf, hlen + chunk);
+	}
+}
+
+/**
+ * send_round - Send one datagram's worth of lines from a sender.
+ *
+ * @index: Index of the sender.
+ *
+ * Returns nothing.
+ */
+static void send_round(const int index)
+{
+	static char buf[65536];
+	struct host *ptr = &hosts[index];
+	int pos = 0;
+	int i;
+	/* Finish the line split in the previous round first. */
+	if (ptr->pending_len) {
+		send_packet(ptr, ptr->pending, ptr->pending_len);
+		ptr->pending_len = 0;
+		return;
+	}
+	for (i = 0; i < batch; i++) {
+		const int len = line_length();
+		if (pos + len > sizeof(buf))
+			break;
+		fill_line(buf + pos, len, index, ptr->seq);
+		sent_lines++;
+		if (extended) {
+			send_extended(ptr, buf + pos, len);
+			continue;
+		}
+		pos += len;
+	}
+	if (extended)
+		return;
+	/* Split the last line and send its remainder in the next round. */
+	if (split_pct && random() % 100 < split_pct && pos > 1) {
+		const int cut = pos - 1 - random() % (pos / 2 > 1 ? pos / 2 : 1);
+		ptr->pending_len = pos - cut;
+		memcpy(ptr->pending, buf + cut, ptr->pending_len);
+		pos = cut;
+	}
+	ptr->seq++;
+	send_packet(ptr, buf, pos);
+}
+
+/**
+ * read_cpu_ticks - Read CPU time consumed by a process.
+ *
+ * @pid: Process ID.
+ *
+ * Returns user + system time in clock ticks, 0 on failure.
+ */
+static unsigned long long read_cpu_ticks(const int pid)
+{
+	char path[64];
+	char buf[1024];
+	unsigned long long utime = 0;
+	unsigned long long stime = 0;
+	FILE *fp;
+	char *cp;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	memset(buf, 0, sizeof(buf));
+	if (!fgets(buf, sizeof(buf) - 1, fp))
+		buf[0] = '\0';
+	fclose(fp);
+	/* Skip "pid (comm)" because comm may contain spaces. */
+	cp = strrchr(buf, ')');
+	if (!cp || sscanf(cp + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+			  "%*u %llu %llu", &utime, &stime) != 2)
+		return 0;
+	return utime + stime;
+}
+
+/**
+ * read_udp_drops - Read the kernel's UDP receive error counters.
+ *
+ * Returns InErrors (which includes RcvbufErrors) of all UDP sockets.
+ */
+static unsigned long long read_udp_drops(void)
+{
+	char names[1024];
+	char values[1024];
+	unsigned long long drops = 0;
+	FILE *fp = fopen("/proc/net/snmp", "r");
+	if (!fp)
+		return 0;
+	while (fgets(names, sizeof(names), fp) &&
+	       fgets(values, sizeof(values), fp)) {
+		char *n;
+		char *v;
+		char *np;
+		char *vp;
+		if (strncmp(names, "Udp: ", 5))
+			continue;
+		n = strtok_r(names + 5, " \n", &np);
+		v = strtok_r(values + 5, " \n", &vp);
+		while (n && v) {
+			if (!strcmp(n, "InErrors"))
+				drops += strtoull(v, NULL, 10);
+			n = strtok_r(NULL, " \n", &np);
+			v = strtok_r(NULL, " \n", &vp);
+		}
+		break;
+	}
+	fclose(fp);
+	return drops;
+}
+
+/* Our senders' "ip:port" in ascending order, for looking up lines. */
+static const char **senders = NULL;
+
+/**
+ * compare_sender - Compare two senders for qsort() and bsearch().
+ *
+ * @a: Pointer to "const char *".
+ * @b: Pointer to "const char *".
+ *
+ * Returns as strcmp() does.
+ */
+static int compare_sender(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/**
+ * is_our_sender - Check whether a line was sent by one of our senders.
+ *
+ * @sender: Sender's "ip:port", not terminated.
+ * @len:    Length of @sender .
+ *
+ * Returns true if so, false otherwise.
+ */
+static _Bool is_our_sender(const char *sender, const int len)
+{
+	char buf[24];
+	const char *key = buf;
+	if (len <= 0 || len >= sizeof(buf))
+		return 0;
+	memcpy(buf, sender, len);
+	buf[len] = '\0';
+	return bsearch(&key, senders, num_hosts, sizeof(*senders),
+		       compare_sender) != NULL;
+}
+
+/**
+ * count_file_lines - Count our senders' lines in one log file.
+ *
+ * @path: Path to a "*.log" or "*.bin" file.
+ *
+ * Returns number of lines in @path sent by our senders.
+ *
+ * Text lines hold the sender after the date and the time, JSON records in
+ * "sender", and binary log files are decoded, for their records have no
+ * newlines.
+ */
+static unsigned long long count_file_lines(const char *path)
+{
+	unsigned long long lines = 0;
+	const int path_len = strlen(path);
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+	if (!strcmp(path + path_len - 4, ".bin")) {
+		struct binlog_reader reader;
+		struct binlog_record record;
+		if (binlog_open(&reader, path))
+			return 0;
+		while (binlog_next(&reader, &record))
+			if (is_our_sender(record.sender, record.sender_len))
+				lines++;
+		binlog_close(&reader);
+		return lines;
+	}
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while ((len = getline(&line, &size, fp)) > 0) {
+		const char *sender;
+		const char *end;
+		if (*line == '{') {
+			sender = strstr(line, "\"sender\":\"");
+			if (!sender)
+				continue;
+			sender += 10;
+			end = strchr(sender, '"');
+		} else {
+			/* Skip "$date $time ". */
+			sender = strchr(line, ' ');
+			sender = sender ? strchr(sender + 1, ' ') : NULL;
+			if (!sender)
+				continue;
+			sender++;
+			end = strchr(sender, ' ');
+		}
+		if (end && is_our_sender(sender, end - sender))
+			lines++;
+	}
+	free(line);
+	fclose(fp);
+	return lines;
+}
+
+/**
+ * count_logged_lines - Count lines udplogger wrote for our senders.
+ *
+ * Returns number of our senders' lines found in "*.log" and "*.bin" files
+ * under @log_dir .
+ *
+ * Every sender directory is searched, for udplogger may name directories
+ * by identity (names= or resolve=1) rather than by "ip:port", and lines
+ * are told apart by their sender instead.
+ */
+static unsigned long long count_logged_lines(void)
+{
+	unsigned long long lines = 0;
+	struct dirent *top_ent;
+	DIR *top;
+	int i;
+	if (!senders) {
+		senders = calloc(num_hosts, sizeof(*senders));
+		if (!senders)
+			return 0;
+		for (i = 0; i < num_hosts; i++)
+			senders[i] = hosts[i].addr_str;
+		qsort(senders, num_hosts, sizeof(*senders), compare_sender);
+	}
+	top = opendir(log_dir);
+	if (!top)
+		return 0;
+	while ((top_ent = readdir(top)) != NULL) {
+		char path[4096];
+		struct dirent *ent;
+		DIR *dir;
+		if (top_ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", log_dir,
+			 top_ent->d_name);
+		dir = opendir(path);
+		if (!dir)
+			continue;
+		while ((ent = readdir(dir)) != NULL) {
+			const int name_len = strlen(ent->d_name);
+			/* Indexes and filters are not lines. */
+			if (ent->d_name[0] == '.' || name_len < 4 ||
+			    (strcmp(ent->d_name + name_len - 4, ".log") &&
+			     strcmp(ent->d_name + name_len - 4, ".bin")))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s/%s", log_dir,
+				 top_ent->d_name, ent->d_name);
+			lines += count_file_lines(path);
+		}
+		closedir(dir);
+	}
+	closedir(top);
+	return lines;
+}
+
+/**
+ * usage - Print usage and exit.
+ *
+ * @name: Program's name.
+ *
+ * This function does not return.
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "udplogger load generator\n\n"
+		"Usage:\n  %s [ip=$udplogger_ip] [port=$udplogger_port] "
+		"[hosts=$senders] [duration=$seconds] [rate=$packets_per_sec] "
+		"[min=$min_line_len] [max=$max_line_len] [dist=uniform|exp] "
+		"[batch=$lines_per_packet] [split=$percent] [ext=0|1] "
+		"[frag=$fragment_size] [pid=$udplogger_pid] "
+		"[dir=$udplogger_log_dir] [settle=$seconds]\n\n"
+		"Senders use distinct 127.0.0.0/8 addresses. rate=0 sends as "
+		"fast as possible.\nsplit= is the percentage of packets whose "
+		"last line is completed by the next packet.\next=1 sends "
+		"extended netconsole headers, fragmented by frag= bytes.\n"
+		"pid= enables CPU accounting and dir= enables counting written "
+		"lines after waiting settle= seconds\n(and sending SIGUSR1 to "
+		"pid= so that udplogger flushes its log files).\n", name);
+	exit(1);
+}
+
+/**
+ * do_init - Initialization function.
+ *
+ * @argc: Number of arguments.
+ * @argv: Arguments.
+ *
+ * Returns nothing.
+ */
+static void do_init(int argc, char *argv[])
+{
+	struct sockaddr_in addr = { };
+	int i;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(6666);
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (!strncmp(arg, "ip=", 3))
+			addr.sin_addr.s_addr = inet_addr(arg + 3);
+		else if (!strncmp(arg, "port=", 5))
+			addr.sin_port = htons(atoi(arg + 5));
+		else if (!strncmp(arg, "hosts=", 6))
+			num_hosts = atoi(arg + 6);
+		else if (!strncmp(arg, "duration=", 9))
+			duration = atoi(arg + 9);
+		else if (!strncmp(arg, "rate=", 5))
+			rate = atoi(arg + 5);
+		else if (!strncmp(arg, "min=", 4))
+			min_len = atoi(arg + 4);
+		else if (!strncmp(arg, "max=", 4))
+			max_len = atoi(arg + 4);
+		else if (!strcmp(arg, "dist=exp"))
+			exp_dist = 1;
+		else if (!strcmp(arg, "dist=uniform"))
+			exp_dist = 0;
+		else if (!strncmp(arg, "batch=", 6))
+			batch = atoi(arg + 6);
+		else if (!strncmp(arg, "split=", 6))
+			split_pct = atoi(arg + 6);
+		else if (!strncmp(arg, "ext=", 4))
+			extended = atoi(arg + 4) != 0;
+		else if (!strncmp(arg, "frag=", 5))
+			frag_size = atoi(arg + 5);
+		else if (!strncmp(arg, "pid=", 4))
+			target_pid = atoi(arg + 4);
+		else if (!strncmp(arg, "dir=", 4))
+			log_dir = arg + 4;
+		else if (!strncmp(arg, "settle=", 7))
+			settle = atoi(arg + 7);
+		else
+			usage(argv[0]);
+	}
+	/* Sanity check. */
+	if (num_hosts < 1)
+		num_hosts = 1;
+	if (num_hosts > 65536)
+		num_hosts = 65536;
+	if (duration < 1)
+		duration = 1;
+	if (rate < 0)
+		rate = 0;
+	if (min_len < 32)
+		min_len = 32;
+	if (max_len > 60000)
+		max_len = 60000;
+	if (max_len < min_len)
+		max_len = min_len;
+	if (batch < 1)
+		batch = 1;
+	if (split_pct < 0)
+		split_pct = 0;
+	if (split_pct > 100)
+		split_pct = 100;
+	if (frag_size && frag_size < 64)
+		frag_size = 64;
+	if (settle < 0)
+		settle = 0;
+	hosts = calloc(num_hosts, sizeof(*hosts));
+	if (!hosts) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	/* Create one socket per sender, each from its own source address. */
+	for (i = 0; i < num_hosts; i++) {
+		struct host *ptr = &hosts[i];
+		struct sockaddr_in src = { };
+		socklen_t size = sizeof(src);
+		src.sin_family = AF_INET;
+		src.sin_addr.s_addr = htonl(0x7f000002 + i);
+		ptr->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		ptr->pending = malloc(65536);
+		if (ptr->fd == -1 || !ptr->pending ||
+		    bind(ptr->fd, (struct sockaddr *) &src, sizeof(src)) ||
+		    getsockname(ptr->fd, (struct sockaddr *) &src, &size) ||
+		    connect(ptr->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			fprintf(stderr, "Can't create sender %d .\n", i);
+			exit(1);
+		}
+		snprintf(ptr->addr_str, sizeof(ptr->addr_str) - 1, "%s:%u",
+			 inet_ntoa(src.sin_addr), htons(src.sin_port));
+	}
+	printf("Options: ip=%s port=%u hosts=%u duration=%u rate=%u min=%u "
+	       "max=%u dist=%s batch=%u split=%u ext=%u frag=%u\n",
+	       inet_ntoa(addr.sin_addr), htons(addr.sin_port), num_hosts,
+	       duration, rate, min_len, max_len, exp_dist ? "exp" : "uniform",
+	       batch, split_pct, extended, frag_size);
+}
+
+/**
+ * do_main - Send traffic and report results.
+ *
+ * Returns nothing.
+ */
+static void do_main(void)
+{
+	const unsigned long long drops_start = read_udp_drops();
+	const unsigned long long cpu_start =
+		target_pid ? read_cpu_ticks(target_pid) : 0;
+	const unsigned long long start = now_ns();
+	const unsigned long long end = start + duration * 1000000000ull;
+	unsigned long long now = start;
+	unsigned long long cpu_ticks = 0;
+	double elapsed;
+	int index = 0;
+	while (now < end) {
+		/* Send in slices of 1ms so that the rate limit stays smooth. */
+		const unsigned long long slice_end = now + 1000000;
+		unsigned long long due = -1;
+		if (rate) {
+			due = (now - start) / 1000 * rate / 1000000 + 1;
+			if (sent_packets >= due) {
+				struct timespec ts = { 0, 100000 };
+				nanosleep(&ts, NULL);
+				now = now_ns();
+				continue;
+			}
+		}
+		do {
+			send_round(index);
+			if (++index == num_hosts)
+				index = 0;
+		} while (sent_packets < due &&
+			 ((sent_packets & 63) || now_ns() < slice_end));
+		now = now_ns();
+	}
+	elapsed = (now - start) / 1e9;
+	/* Complete split lines so that nothing is left pending. */
+	for (index = 0; index < num_hosts; index++)
+		if (hosts[index].pending_len)
+			send_round(index);
+	if (target_pid)
+		cpu_ticks = read_cpu_ticks(target_pid) - cpu_start;
+	printf("Sent: %llu packets, %llu lines, %llu bytes in %.2f seconds "
+	       "(%llu send errors)\n", sent_packets, sent_lines, sent_bytes,
+	       elapsed, send_errors);
+	printf("Rate: %.0f packets/sec, %.0f lines/sec, %.2f MB/sec\n",
+	       sent_packets / elapsed, sent_lines / elapsed,
+	       sent_bytes / elapsed / 1048576);
+	printf("Kernel UDP receive errors: %llu\n",
+	       read_udp_drops() - drops_start);
+	if (target_pid) {
+		const double cpu = (double) cpu_ticks / sysconf(_SC_CLK_TCK);
+		printf("CPU: %.2f seconds (%.3f seconds per million lines)\n",
+		       cpu, sent_lines ? cpu * 1000000 / sent_lines : 0);
+	}
+	if (log_dir) {
+		unsigned long long logged;
+		sleep(settle);
+		/* Ask udplogger to pass its stdio buffers to the kernel. */
+		if (target_pid && !kill(target_pid, SIGUSR1))
+			usleep(100000);
+		logged = count_logged_lines();
+		printf("Logged: %llu lines (loss %.3f%%)\n", logged,
+		       sent_lines && logged < sent_lines ?
+		       100.0 * (sent_lines - logged) / sent_lines : 0.0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	do_init(argc, argv);
+	do_main();
+	return 0;
+}
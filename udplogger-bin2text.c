@@ -0,0 +1,72 @@
+/*
+ * udplogger-bin2text - Convert udplogger's binary log files to text.
+ *
+ * Prints lines of "$date.bin" files written with format=bin in the format
+ * of "$date.log" files, "YYYY-MM-DD HH:MM:SS $addr $text".
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "udplogger-binlog.h"
+
+/**
+ * convert - Print lines of one file.
+ *
+ * @path: Path to the file.
+ *
+ * Returns 0 on success, 1 otherwise.
+ */
+static int convert(const char *path)
+{
+	struct binlog_reader reader;
+	struct binlog_record record;
+	int64_t last_time = -1;
+	char stamp[24] = { };
+	if (binlog_open(&reader, path)) {
+		fprintf(stderr, "Can't open %s .\n", path);
+		return 1;
+	}
+	while (binlog_next(&reader, &record)) {
+		if (record.time != last_time) {
+			const time_t t = record.time;
+			struct tm tm;
+			localtime_r(&t, &tm);
+			snprintf(stamp, sizeof(stamp), "%04u-%02u-%02u "
+				 "%02u:%02u:%02u ", tm.tm_year + 1900,
+				 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+				 tm.tm_min, tm.tm_sec);
+			last_time = record.time;
+		}
+		fputs(stamp, stdout);
+		fwrite(record.sender, 1, record.sender_len, stdout);
+		putchar(' ');
+		fwrite(record.text, 1, record.len, stdout);
+		putchar('\n');
+	}
+	binlog_close(&reader);
+	if (reader.bad_blocks) {
+		fprintf(stderr, "%s: skipped %llu corrupted blocks.\n", path,
+			reader.bad_blocks);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static char buf[1048576];
+	int ret = 0;
+	int i;
+	if (argc < 2) {
+		fprintf(stderr, "udplogger binary log converter\n\n"
+			"Usage:\n  %s $file.bin [$file.bin ...]\n\n"
+			"Lines are printed to stdout in the text format.\n",
+			argv[0]);
+		return 1;
+	}
+	setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+	for (i = 1; i < argc; i++)
+		ret |= convert(argv[i]);
+	return ret;
+}
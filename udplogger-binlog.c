@@ -0,0 +1,178 @@
+/*
+ * udplogger-binlog.c - Reader of udplogger's binary record log files.
+ *
+ * See udplogger-binlog.h for the format. Blocks whose checksum doesn't
+ * match are skipped, and reading resumes at the next block magic.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "udplogger-binlog.h"
+
+/**
+ * get_varint - Decode a varint.
+ *
+ * @pos: Pointer to the position to decode at, advanced past the varint.
+ * @end: End of the data.
+ * @num: Pointer to store the number.
+ *
+ * Returns 0 on success, -1 if the varint is truncated or too long.
+ */
+static int get_varint(const unsigned char **pos, const unsigned char *end,
+		      uint64_t *num)
+{
+	const unsigned char *cp = *pos;
+	uint64_t value = 0;
+	int shift;
+	for (shift = 0; shift < 64 && cp < end; shift += 7) {
+		const unsigned char c = *cp++;
+		value |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*pos = cp;
+			*num = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * binlog_open - Open a binary log file for reading.
+ *
+ * @reader: Pointer to "struct binlog_reader".
+ * @path:   Path to the file.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int binlog_open(struct binlog_reader *reader, const char *path)
+{
+	struct stat buf;
+	void *map = NULL;
+	const int fd = open(path, O_RDONLY);
+	memset(reader, 0, sizeof(*reader));
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &buf)) {
+		close(fd);
+		return -1;
+	}
+	if (buf.st_size) {
+		map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(map, buf.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	reader->map = map;
+	reader->size = buf.st_size;
+	return 0;
+}
+
+/**
+ * next_block - Move to the next valid block.
+ *
+ * @reader: Pointer to "struct binlog_reader".
+ *
+ * Returns 1 if found, 0 at the end of the file.
+ */
+static int next_block(struct binlog_reader *reader)
+{
+	struct binlog_block block;
+	while (reader->next + sizeof(block) <= reader->size) {
+		const unsigned char *cp = reader->map + reader->next;
+		const unsigned char *found;
+		memcpy(&block, cp, sizeof(block));
+		if (!memcmp(block.magic, BINLOG_MAGIC, sizeof(block.magic)) &&
+		    block.len <= reader->size - reader->next - sizeof(block) &&
+		    crc32(0, cp + sizeof(block), block.len) == block.crc) {
+			reader->pos = cp + sizeof(block);
+			reader->end = reader->pos + block.len;
+			reader->next += sizeof(block) + block.len;
+			reader->time = block.time;
+			memset(reader->sender_lens, 0,
+			       sizeof(reader->sender_lens));
+			return 1;
+		}
+		/* Resynchronize at the next magic. */
+		reader->bad_blocks++;
+		found = memmem(cp + 1, reader->size - reader->next - 1,
+			       BINLOG_MAGIC, sizeof(block.magic));
+		reader->next = found ? found - reader->map : reader->size;
+	}
+	return 0;
+}
+
+/**
+ * binlog_next - Read the next line.
+ *
+ * @reader: Pointer to "struct binlog_reader".
+ * @record: Pointer to "struct binlog_record" to store the line, valid until
+ *          binlog_close() is called.
+ *
+ * Returns 1 if a line was read, 0 at the end of the file.
+ */
+int binlog_next(struct binlog_reader *reader, struct binlog_record *record)
+{
+	while (1) {
+		uint64_t tag;
+		uint64_t num;
+		uint64_t len;
+		unsigned int id;
+		if (reader->pos == reader->end) {
+			if (!next_block(reader))
+				return 0;
+			continue;
+		}
+		if (get_varint(&reader->pos, reader->end, &tag))
+			goto bad;
+		if (tag >> 1 >= BINLOG_MAX_SENDERS)
+			goto bad;
+		id = tag >> 1;
+		if (tag & 1) {
+			if (get_varint(&reader->pos, reader->end, &len) ||
+			    len > reader->end - reader->pos)
+				goto bad;
+			reader->senders[id] = (const char *) reader->pos;
+			reader->sender_lens[id] = len;
+			reader->pos += len;
+			continue;
+		}
+		if (!reader->sender_lens[id] ||
+		    get_varint(&reader->pos, reader->end, &num) ||
+		    get_varint(&reader->pos, reader->end, &len) ||
+		    len > reader->end - reader->pos)
+			goto bad;
+		reader->time += (int64_t) (num >> 1) ^ -(int64_t) (num & 1);
+		record->time = reader->time;
+		record->sender = reader->senders[id];
+		record->sender_len = reader->sender_lens[id];
+		record->text = (const char *) reader->pos;
+		record->len = len;
+		reader->pos += len;
+		return 1;
+bad:
+		/* The checksum matched, so the writer was broken. */
+		reader->bad_blocks++;
+		reader->pos = reader->end;
+	}
+}
+
+/**
+ * binlog_close - Close a binary log file.
+ *
+ * @reader: Pointer to "struct binlog_reader".
+ *
+ * Returns nothing.
+ */
+void binlog_close(struct binlog_reader *reader)
+{
+	if (reader->map)
+		munmap((void *) reader->map, reader->size);
+	reader->map = NULL;
+}
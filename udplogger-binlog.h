@@ -0,0 +1,99 @@
+/*
+ * udplogger-binlog.h - Binary record log format and its reader.
+ *
+ * With format=bin, "$addr/$date.bin" is written instead of "$date.log". It
+ * is a sequence of blocks, each a "struct binlog_block" followed by records
+ * which can be decoded without reading other blocks. Integers in headers
+ * are in the host's byte order, like the time index. Blocks are about 4KB,
+ * but a longer line gets a block of its own.
+ *
+ * Records are a varint tag followed by
+ *
+ *   tag = $id << 1 | 1: varint length and the sender's name, defining $id
+ *                       for the rest of the block.
+ *   tag = $id << 1:     varint zigzag delta of the time from the previous
+ *                       line (or the block's time), varint length and the
+ *                       text of a line from sender $id, without newline.
+ *
+ * Varints hold 7 bits per byte, least significant first, with the high bit
+ * set on all but the last byte.
+ */
+#ifndef UDPLOGGER_BINLOG_H
+#define UDPLOGGER_BINLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Magic at the beginning of each block. */
+#define BINLOG_MAGIC "ULB1"
+/* Max senders defined in a block. */
+#define BINLOG_MAX_SENDERS 256
+
+/* Header of a block. */
+struct binlog_block {
+	char magic[4]; /* BINLOG_MAGIC . */
+	uint32_t len; /* Bytes of records following the header. */
+	uint32_t crc; /* CRC-32 of the records. */
+	uint32_t records; /* Number of lines in the records. */
+	int64_t time; /* Time the first line's delta is relative to. */
+};
+
+/* One line read from a binary log file. */
+struct binlog_record {
+	int64_t time; /* Time the line was received. */
+	const char *sender; /* Name of the sender, not terminated. */
+	int sender_len; /* Length of @sender . */
+	const char *text; /* Text of the line without newline. */
+	int len; /* Length of @text . */
+};
+
+/* State of reading a binary log file. */
+struct binlog_reader {
+	const unsigned char *map; /* The mapped file. */
+	size_t size; /* Length of @map . */
+	size_t next; /* Offset of the next block. */
+	const unsigned char *pos; /* Next record in the current block. */
+	const unsigned char *end; /* End of the current block. */
+	int64_t time; /* Time of the previous line. */
+	/* Senders defined in the current block. */
+	const char *senders[BINLOG_MAX_SENDERS];
+	int sender_lens[BINLOG_MAX_SENDERS];
+	unsigned long long bad_blocks; /* Blocks skipped as corrupted. */
+};
+
+int binlog_open(struct binlog_reader *reader, const char *path);
+int binlog_next(struct binlog_reader *reader, struct binlog_record *record);
+void binlog_close(struct binlog_reader *reader);
+
+/**
+ * binlog_put_varint - Encode a varint.
+ *
+ * @buf: Buffer with at least 10 bytes of room.
+ * @num: Number to encode.
+ *
+ * Returns the number of bytes written.
+ */
+static inline int binlog_put_varint(unsigned char *buf, uint64_t num)
+{
+	int len = 0;
+	while (num >= 0x80) {
+		buf[len++] = num | 0x80;
+		num >>= 7;
+	}
+	buf[len++] = num;
+	return len;
+}
+
+/**
+ * binlog_zigzag - Map a signed number to an unsigned one, small to small.
+ *
+ * @num: Number to map.
+ *
+ * Returns the mapped number.
+ */
+static inline uint64_t binlog_zigzag(const int64_t num)
+{
+	return ((uint64_t) num << 1) ^ (uint64_t) (num >> 63);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * udplogger-index.h - Format of the indexes written next to log files.
+ *
+ * "$addr/$date.idx" holds one record per second which has lines in
+ * "$addr/$date.log", in ascending order of time, telling where the first
+ * line stamped with that second starts.
+ *
+ * "$addr/$date.bloom" holds a bloom filter of tokens in the text of lines
+ * in "$addr/$date.log", written when the log file is closed. A token is a
+ * maximal run of token characters at least BLOOM_MIN_TOKEN long. The filter
+ * is valid only while the log file has the size recorded in it.
+ */
+#ifndef UDPLOGGER_INDEX_H
+#define UDPLOGGER_INDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Record in "$date.idx". */
+struct index_record {
+	int64_t time; /* Seconds since the Epoch. */
+	int64_t offset; /* Offset in "$date.log". */
+};
+
+/*
+ * Lines of "$date.log" are either "$stamp $addr $text" or, if written with
+ * format=json, NDJSON records beginning with JSON_STAMP_PREFIX "$stamp".
+ * $stamp is "YYYY-MM-DD HH:MM:SS" in the local time.
+ */
+#define JSON_STAMP_PREFIX "{\"time\":\""
+
+/* Magic at the beginning of "$date.bloom". */
+#define BLOOM_MAGIC "ulbloom1"
+/* Number of bits set per token. */
+#define BLOOM_HASHES 4
+/* Tokens shorter than this are not added. */
+#define BLOOM_MIN_TOKEN 3
+/* Header of "$date.bloom", followed by @bits / 8 bytes. */
+struct bloom_header {
+	char magic[8]; /* BLOOM_MAGIC . */
+	uint32_t bits; /* Size of the filter in bits, a power of 2. */
+	uint32_t hashes; /* BLOOM_HASHES . */
+	uint64_t size; /* Size of "$date.log" the filter covers. */
+};
+
+/**
+ * bloom_token_char - Check whether a byte is part of tokens.
+ *
+ * @c: Byte to check.
+ *
+ * Returns nonzero if @c is an alphanumeric, '_' or a non-ASCII byte.
+ */
+static inline int bloom_token_char(const unsigned char c)
+{
+	static const uint64_t map[4] = {
+		0x03ff000000000000ull, 0x07fffffe87fffffeull, ~0ull, ~0ull
+	};
+	return (map[c >> 6] >> (c & 63)) & 1;
+}
+
+/**
+ * bloom_hash - Calculate the hash of a token.
+ *
+ * @token: Token.
+ * @len:   Length of @token .
+ *
+ * Returns the hash.
+ *
+ * Tokens are hashed a word at a time, for hashing a byte at a time would
+ * cost more than writing the lines. Words are read in the host's byte
+ * order, like the rest of the file.
+ */
+static inline uint64_t bloom_hash(const char *token, int len)
+{
+	uint64_t hash = 0xcbf29ce484222325ull ^ len;
+	uint64_t word;
+	for (; len >= 8; token += 8, len -= 8) {
+		memcpy(&word, token, 8);
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+		hash ^= hash >> 32;
+	}
+	if (len) {
+		word = 0;
+		memcpy(&word, token, len);
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+		hash ^= hash >> 32;
+	}
+	hash *= 0xbf58476d1ce4e5b9ull;
+	return hash ^ (hash >> 31);
+}
+
+/**
+ * bloom_bit - Calculate one of the bits for a token.
+ *
+ * @hash: Hash of the token.
+ * @i:    Which of BLOOM_HASHES bits.
+ * @bits: Size of the filter in bits.
+ *
+ * Returns the index of the bit.
+ */
+static inline uint32_t bloom_bit(const uint64_t hash, const uint32_t i,
+				 const uint32_t bits)
+{
+	return (uint32_t) (hash + i * ((hash >> 32) | 1)) & (bits - 1);
+}
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * udplogger-microbench - Microbenchmark for udplogger's line writing path.
+ *
+ * Feeds prepared datagrams to receive_data() and write_logfile() of
+ * udplogger.c, with the log file replaced by an in-memory sink, and reports
+ * ns/line and bytes/sec without networking or disk noise.
+ */
+#define _GNU_SOURCE
+#define main udplogger_main
+#include "udplogger.c"
+#undef main
+
+/* Bytes written to the sink. */
+static unsigned long long sink_bytes = 0;
+/* Newlines written to the sink. */
+static unsigned long long sink_lines = 0;
+/* Count lines in the sink (costs a memchr pass of its own)? */
+static _Bool count_lines = 0;
+
+/* Prepared datagrams. */
+static char *data = NULL;
+static int *data_len = NULL;
+static int num_data = 0;
+/* Allocated and used bytes in @data . */
+static int data_capacity = 0;
+static int data_used = 0;
+/* Total bytes in @data . */
+static unsigned long long data_bytes = 0;
+/* Lines in @data . */
+static unsigned long long data_lines = 0;
+
+/* Seconds to run each case. */
+static double seconds = 1;
+
+/**
+ * sink_write - Write callback of the in-memory sink.
+ *
+ * @cookie: Unused.
+ * @buf:    Data to write.
+ * @size:   Length of @buf .
+ *
+ * Returns @size .
+ */
+static ssize_t sink_write(void *cookie, const char *buf, size_t size)
+{
+	sink_bytes += size;
+	if (count_lines) {
+		const char *end = buf + size;
+		while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+			sink_lines++;
+			buf++;
+		}
+	}
+	return size;
+}
+
+/**
+ * add_datagram - Append one datagram to the prepared input.
+ *
+ * @buf: Payload.
+ * @len: Length of @buf .
+ *
+ * Returns nothing.
+ */
+static void add_datagram(const char *buf, const int len)
+{
+	if (num_data % 1024 == 0) {
+		data_len = realloc(data_len, sizeof(int) * (num_data + 1024));
+		if (!data_len)
+			exit(1);
+	}
+	if (data_used + len > data_capacity) {
+		data_capacity = (data_used + len) * 2;
+		data = realloc(data, data_capacity);
+		if (!data)
+			exit(1);
+	}
+	memcpy(data + data_used, buf, len);
+	data_len[num_data++] = len;
+	data_used += len;
+	data_bytes += len;
+}
+
+/**
+ * make_line - Build one line of text.
+ *
+ * @buf: Buffer to write to.
+ * @len: Length of the line, including the trailing newline.
+ *
+ * Returns nothing.
+ */
+static void make_line(char *buf, const int len)
+{
+	static unsigned int seq = 0;
+	int pos = snprintf(buf, len, "[%5u.%06u] ", seq / 1000000,
+			   seq % 1000000);
+	seq++;
+	if (pos > len - 1)
+		pos = len - 1;
+	while (pos < len - 1) {
+		buf[pos] = 'a' + pos % 26;
+		pos++;
+	}
+	buf[len - 1] = '\n';
+	data_lines++;
+}
+
+/**
+ * prepare - Prepare input for a case.
+ *
+ * @name: Name of the case.
+ *
+ * Returns nothing.
+ *
+ * "tiny"  packs many 8 to 40 byte lines into each 1400 byte datagram.
+ * "short" sends one 60 to 120 byte line per datagram, like netconsole.
+ * "split" cuts every 60 to 120 byte line into two or three datagrams.
+ * "long"  sends lines slightly shorter than wbuf= in 1400 byte datagrams.
+ * "over"  sends lines longer than wbuf= so that they are force-written.
+ */
+static void prepare(const char *name)
+{
+	static char line[1048576 + 4096];
+	int total = 0;
+	num_data = 0;
+	data_used = 0;
+	data_bytes = 0;
+	data_lines = 0;
+	srandom(1);
+	/* Prepare about 4MB of input, replayed until time is up. */
+	while (total < 4 * 1048576) {
+		int len;
+		int pos = 0;
+		if (!strcmp(name, "tiny")) {
+			while (pos < 1400 - 40) {
+				len = 8 + random() % 33;
+				make_line(line + pos, len);
+				pos += len;
+			}
+			add_datagram(line, pos);
+			total += pos;
+			continue;
+		}
+		if (!strcmp(name, "short") || !strcmp(name, "split"))
+			len = 60 + random() % 61;
+		else if (!strcmp(name, "long"))
+			len = wbuf_size - 1 - random() % 64;
+		else
+			len = wbuf_size + 1 + random() % 4096;
+		make_line(line, len);
+		total += len;
+		if (!strcmp(name, "short")) {
+			add_datagram(line, len);
+			continue;
+		}
+		if (!strcmp(name, "split")) {
+			while (pos < len) {
+				int chunk = 1 + random() % (len / 2);
+				if (chunk > len - pos)
+					chunk = len - pos;
+				add_datagram(line + pos, chunk);
+				pos += chunk;
+			}
+			continue;
+		}
+		while (pos < len) {
+			const int chunk = len - pos < 1400 ? len - pos : 1400;
+			add_datagram(line + pos, chunk);
+			pos += chunk;
+		}
+	}
+}
+
+/**
+ * run_case - Run one case and report the result.
+ *
+ * @name: Name of the case.
+ *
+ * Returns nothing.
+ */
+static void run_case(const char *name)
+{
+	static cookie_io_functions_t sink_funcs = { .write = sink_write };
+	struct sockaddr_in addr = { };
+	unsigned long long rounds = 0;
+	struct timespec start;
+	struct timespec end;
+	struct client *ptr;
+	double elapsed;
+	time_t now;
+	prepare(name);
+	/* A client whose log file is already open for today. */
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(0x0a000001);
+	addr.sin_port = htons(6666);
+	ptr = find_client(&addr);
+	now = time(NULL);
+	ptr->dir->log.tm = *localtime(&now);
+	ptr->dir->log.day = day_start(&ptr->dir->log.tm, 0);
+	ptr->avail = 0;
+	ptr->dir->log.fp = fopencookie(NULL, "w", sink_funcs);
+	ptr->dir->log.binary = log_format == FORMAT_BIN;
+	/* Tokens are added to a filter as they are for a new log file. */
+	ptr->dir->log.bloom = bloom_bytes ? calloc(1, bloom_bytes) : NULL;
+	if (!ptr->dir->log.fp || (bloom_bytes && !ptr->dir->log.bloom))
+		exit(1);
+	sink_bytes = 0;
+	sink_lines = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		const char *cp = data;
+		int i;
+		for (i = 0; i < num_data; i++) {
+			receive_data(ptr, cp, data_len[i], now);
+			cp += data_len[i];
+		}
+		rounds++;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	} while (elapsed < seconds);
+	flush_logfile(&ptr->dir->log);
+	printf("%-6s %10.1f ns/line %9.1f MB/sec in %8.1f MB/sec out "
+	       "%12llu lines", name, elapsed * 1e9 / (data_lines * rounds),
+	       data_bytes * rounds / elapsed / 1048576,
+	       sink_bytes / elapsed / 1048576, data_lines * rounds);
+	if (count_lines)
+		printf(" (%llu written)", sink_lines);
+	printf("\n");
+	fclose(ptr->dir->log.fp);
+	ptr->dir->log.fp = NULL;
+	bloom_drop(&ptr->dir->log);
+}
+
+/**
+ * bench_usage - Print usage and exit.
+ *
+ * @name: Program's name.
+ *
+ * This function does not return.
+ */
+static void bench_usage(const char *name)
+{
+	fprintf(stderr, "udplogger microbenchmark\n\n"
+		"Usage:\n  %s [case=tiny|short|split|long|over|all] "
+		"[wbuf=$write_buffer_size] [seconds=$seconds_per_case] "
+		"[verify=0|1] [bloom=$filter_bytes]\n  "
+		"[format=text|json|bin] [rules=$rules_file] [dedup=0|1]\n  "
+		"[urgent=$level]\n\n"
+		"verify=1 counts lines written to the sink, which adds a "
+		"memchr pass to the measurement.\nLines routed by rules are "
+		"written to real files in the current directory.\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char * const cases[] = {
+		"tiny", "short", "split", "long", "over", NULL
+	};
+	const char *name = "all";
+	int i;
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (!strncmp(arg, "case=", 5))
+			name = arg + 5;
+		else if (!strncmp(arg, "wbuf=", 5))
+			wbuf_size = atoi(arg + 5);
+		else if (!strncmp(arg, "seconds=", 8))
+			seconds = atof(arg + 8);
+		else if (!strncmp(arg, "verify=", 7))
+			count_lines = atoi(arg + 7) != 0;
+		else if (!strncmp(arg, "bloom=", 6))
+			bloom_bytes = atoi(arg + 6);
+		else if (!strcmp(arg, "format=text"))
+			log_format = FORMAT_TEXT;
+		else if (!strcmp(arg, "format=json"))
+			log_format = FORMAT_JSON;
+		else if (!strcmp(arg, "format=bin"))
+			log_format = FORMAT_BIN;
+		else if (!strncmp(arg, "dedup=", 6))
+			dedup_lines = atoi(arg + 6) != 0;
+		else if (!strncmp(arg, "urgent=", 7))
+			urgent_level = atoi(arg + 7);
+		else if (!strncmp(arg, "rules=", 6)) {
+			rules = load_rules(arg + 6);
+			if (!rules)
+				exit(1);
+		} else
+			bench_usage(argv[0]);
+	}
+	/* Sanity check. */
+	if (wbuf_size < 1024)
+		wbuf_size = 1024;
+	if (wbuf_size > 1048576)
+		wbuf_size = 1048576;
+	if (bloom_bytes < 0 || bloom_bytes & (bloom_bytes - 1))
+		bench_usage(argv[0]);
+	if (seconds <= 0)
+		seconds = 1;
+	for (i = 0; cases[i]; i++)
+		if (!strcmp(name, "all") || !strcmp(name, cases[i]))
+			run_case(cases[i]);
+	return 0;
+}
@@ -0,0 +1,752 @@
+/*
+ * udplogger-query - Print lines of a time range from udplogger's log files.
+ *
+ * Searches day files of many senders in parallel, optionally for lines
+ * containing a pattern, and prints the results merged in timestamp order.
+ * The range is processed in slices of time so that output starts early and
+ * memory stays bounded however large the range is.
+ *
+ * The time index written next to each day file locates a slice without
+ * reading the day file from the top. Day files without the index are
+ * located by binary search over their lines, whose timestamps ascend.
+ * Lines may be text or NDJSON records written with format=json.
+ *
+ * When searching for a pattern, day files whose token filter lacks any of
+ * the pattern's whole tokens are skipped without being read.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "udplogger-index.h"
+
+/* Length of "YYYY-MM-DD HH:MM:SS". */
+#define STAMP_LEN 19
+/* Max worker threads. */
+#define MAX_THREADS 256
+/* Max tokens of the pattern looked up in token filters. */
+#define MAX_TOKENS 16
+
+/* Structure for searching one day file for one slice. */
+struct job {
+	const char *sender; /* Directory of the sender. */
+	char date[16]; /* "YYYY-MM-DD" of the day file. */
+	char *out; /* Matching lines. */
+	size_t out_len; /* Valid bytes in @out . */
+	size_t out_size; /* Allocated bytes in @out . */
+	size_t merged; /* Bytes in @out already printed. */
+};
+
+/* Directories of senders to search. */
+static char **senders = NULL;
+static int num_senders = 0;
+/* Range to print, inclusive. */
+static time_t from_time = 0;
+static time_t to_time = 0;
+/* Substring to search for, NULL for all lines. */
+static const char *pattern = NULL;
+static size_t pattern_len = 0;
+/* Match the pattern only at token boundaries? */
+static _Bool whole_words = 0;
+/* Hashes of tokens every matching line has. */
+static uint64_t tokens[MAX_TOKENS];
+static int num_tokens = 0;
+/* Number of worker threads. */
+static int num_threads = 0;
+/* Seconds per slice. */
+static int slice_seconds = 3600;
+/* Report what was read to stderr? */
+static _Bool verbose = 0;
+
+/* Jobs of the current slice. */
+static struct job *jobs = NULL;
+static int num_jobs = 0;
+/* Index of the next job to take. */
+static int next_job = 0;
+/* Slice being searched, as "YYYY-MM-DD HH:MM:SS" and as time_t. */
+static char slice_from_str[STAMP_LEN + 1];
+static char slice_to_str[STAMP_LEN + 1];
+static time_t slice_from = 0;
+static time_t slice_to = 0;
+
+/* Bytes of day files read. */
+static unsigned long long read_bytes = 0;
+/* Day files skipped by their token filters. */
+static unsigned long long skipped_files = 0;
+/* Lines printed. */
+static unsigned long long printed_lines = 0;
+/* Protects @next_job, @read_bytes and @skipped_files . */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * format_time - Format time as "YYYY-MM-DD HH:MM:SS" in the local time.
+ *
+ * @t:   Time to format.
+ * @buf: Buffer to store STAMP_LEN + 1 bytes.
+ *
+ * Returns nothing.
+ */
+static void format_time(const time_t t, char *buf)
+{
+	struct tm tm;
+	localtime_r(&t, &tm);
+	snprintf(buf, STAMP_LEN + 1, "%04u-%02u-%02u %02u:%02u:%02u",
+		 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+		 tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * parse_time - Parse "YYYY-MM-DD[ HH:MM:SS]" as the local time.
+ *
+ * @str:  String to parse.
+ * @last: True to fill the omitted time with 23:59:59, false with 00:00:00.
+ *
+ * Returns the time on success, -1 otherwise.
+ */
+static time_t parse_time(const char *str, const _Bool last)
+{
+	struct tm tm = { };
+	int n = sscanf(str, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		       &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (n == 3) {
+		tm.tm_hour = last ? 23 : 0;
+		tm.tm_min = last ? 59 : 0;
+		tm.tm_sec = last ? 59 : 0;
+	} else if (n != 6) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/**
+ * map_file - Map a whole file for reading.
+ *
+ * @path: Path to the file.
+ * @size: Pointer to store the size of the file.
+ *
+ * Returns the mapped address, NULL if missing or empty.
+ */
+static char *map_file(const char *path, size_t *size)
+{
+	struct stat buf;
+	char *map;
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &buf) || !buf.st_size) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size = buf.st_size;
+	return map;
+}
+
+/**
+ * stamp_offset - Find where the stamp of a line is.
+ *
+ * @line: Line, either text or an NDJSON record.
+ *
+ * Returns the offset of the stamp in @line .
+ */
+static inline size_t stamp_offset(const char *line)
+{
+	return *line == '{' ? sizeof(JSON_STAMP_PREFIX) - 1 : 0;
+}
+
+/**
+ * find_record - Find the first index record later than given time.
+ *
+ * @recs: Index records, in ascending order of time.
+ * @num:  Number of elements in @recs .
+ * @time: Time to compare.
+ *
+ * Returns the index of the record, @num if none.
+ */
+static size_t find_record(const struct index_record *recs, size_t num,
+			  const time_t time)
+{
+	size_t lo = 0;
+	while (num) {
+		const size_t half = num / 2;
+		if (recs[lo + half].time <= time) {
+			lo += half + 1;
+			num -= half + 1;
+		} else {
+			num = half;
+		}
+	}
+	return lo;
+}
+
+/**
+ * find_line - Find the first line stamped later than given time.
+ *
+ * @log:   Day file.
+ * @size:  Length of @log .
+ * @stamp: "YYYY-MM-DD HH:MM:SS" to compare.
+ *
+ * Returns the offset of the line, @size if none.
+ *
+ * Binary search over lines, for day files without the time index.
+ */
+static size_t find_line(const char *log, const size_t size,
+			const char *stamp)
+{
+	size_t lo = 0;
+	size_t hi = size;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		/* Start of the line holding @mid, but not before @lo . */
+		const char *prev = mid > lo ?
+			memrchr(log + lo, '\n', mid - lo) : NULL;
+		const size_t line = prev ? prev - log + 1 : lo;
+		const char *eol = memchr(log + line, '\n', size - line);
+		const size_t next = eol ? eol - log + 1 : size;
+		const size_t skip = stamp_offset(log + line);
+		if (next - line > skip + STAMP_LEN &&
+		    memcmp(log + line + skip, stamp, STAMP_LEN) <= 0)
+			lo = next;
+		else
+			hi = line;
+	}
+	return lo;
+}
+
+/**
+ * job_append - Save a matching line.
+ *
+ * @job:  Pointer to "struct job".
+ * @data: Line to save.
+ * @len:  Length of @data .
+ *
+ * Returns nothing.
+ */
+static void job_append(struct job *job, const char *data, const size_t len)
+{
+	if (job->out_len + len > job->out_size) {
+		size_t size = job->out_size ? job->out_size : 65536;
+		while (size < job->out_len + len)
+			size *= 2;
+		job->out = realloc(job->out, size);
+		if (!job->out) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		job->out_size = size;
+	}
+	memcpy(job->out + job->out_len, data, len);
+	job->out_len += len;
+}
+
+/**
+ * in_slice - Check whether a line is stamped within the slice.
+ *
+ * @line: Line.
+ * @len:  Length of @line, including the newline.
+ *
+ * Returns true if so, false otherwise.
+ */
+static inline _Bool in_slice(const char *line, const size_t len)
+{
+	const size_t skip = stamp_offset(line);
+	return len > skip + STAMP_LEN &&
+		memcmp(line + skip, slice_from_str, STAMP_LEN) >= 0 &&
+		memcmp(line + skip, slice_to_str, STAMP_LEN) <= 0;
+}
+
+/**
+ * lacks_tokens - Check a day file's token filter for the pattern's tokens.
+ *
+ * @job: Pointer to "struct job".
+ * @log_size: Size of the day file.
+ *
+ * Returns true if the filter is valid and lacks some token, false otherwise.
+ */
+static _Bool lacks_tokens(const struct job *job, const size_t log_size)
+{
+	char path[4096];
+	const struct bloom_header *header;
+	const unsigned char *bloom;
+	size_t size = 0;
+	_Bool lacks = 0;
+	int i;
+	if (!num_tokens)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s.bloom", job->sender, job->date);
+	header = (const struct bloom_header *) map_file(path, &size);
+	if (!header)
+		return 0;
+	bloom = (const unsigned char *) (header + 1);
+	/* A filter for other contents or of unknown format tells nothing. */
+	if (size >= sizeof(*header) &&
+	    !memcmp(header->magic, BLOOM_MAGIC, sizeof(header->magic)) &&
+	    header->hashes == BLOOM_HASHES && header->bits >= 8 &&
+	    !(header->bits & (header->bits - 1)) &&
+	    size - sizeof(*header) >= header->bits / 8 &&
+	    header->size == log_size) {
+		for (i = 0; i < num_tokens && !lacks; i++) {
+			uint32_t j;
+			for (j = 0; j < BLOOM_HASHES; j++) {
+				const uint32_t bit =
+					bloom_bit(tokens[i], j, header->bits);
+				if (!(bloom[bit >> 3] & (1 << (bit & 7)))) {
+					lacks = 1;
+					break;
+				}
+			}
+		}
+	}
+	munmap((void *) header, size);
+	return lacks;
+}
+
+/**
+ * at_boundary - Check whether a match of the pattern is a whole word.
+ *
+ * @start: Start of the day file.
+ * @hit:   The match.
+ * @end:   End of the searched range.
+ *
+ * Returns true if the match is not within a longer token, false otherwise.
+ */
+static inline _Bool at_boundary(const char *start, const char *hit,
+				const char *end)
+{
+	return (hit == start || !bloom_token_char(hit[-1]) ||
+		!bloom_token_char(pattern[0])) &&
+		(hit + pattern_len == end ||
+		 !bloom_token_char(hit[pattern_len]) ||
+		 !bloom_token_char(pattern[pattern_len - 1]));
+}
+
+/**
+ * search_file - Search one day file for the slice.
+ *
+ * @job: Pointer to "struct job".
+ *
+ * Returns nothing.
+ */
+static void search_file(struct job *job)
+{
+	char path[4096];
+	const struct index_record *recs;
+	size_t log_size = 0;
+	size_t idx_size = 0;
+	size_t start;
+	size_t end;
+	size_t pos;
+	char *log;
+	snprintf(path, sizeof(path), "%s/%s.log", job->sender, job->date);
+	log = map_file(path, &log_size);
+	if (!log)
+		return;
+	if (lacks_tokens(job, log_size)) {
+		munmap(log, log_size);
+		pthread_mutex_lock(&lock);
+		skipped_files++;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s.idx", job->sender, job->date);
+	recs = (const struct index_record *) map_file(path, &idx_size);
+	if (recs) {
+		const size_t num = idx_size / sizeof(*recs);
+		size_t i = find_record(recs, num, slice_from - 1);
+		/*
+		 * Start from the second before the slice, for the second
+		 * the slice starts in might have no record yet.
+		 */
+		start = i ? recs[i - 1].offset : 0;
+		i = find_record(recs, num, slice_to);
+		end = i < num ? recs[i].offset : log_size;
+		if (start > log_size)
+			start = 0;
+		if (end > log_size || end < start)
+			end = log_size;
+		munmap((void *) recs, idx_size);
+	} else {
+		char stamp[STAMP_LEN + 1];
+		format_time(slice_from - 1, stamp);
+		start = find_line(log, log_size, stamp);
+		end = find_line(log, log_size, slice_to_str);
+	}
+	pthread_mutex_lock(&lock);
+	read_bytes += end - start;
+	pthread_mutex_unlock(&lock);
+	pos = start;
+	while (pos < end) {
+		const char *line = log + pos;
+		const char *eol;
+		size_t next;
+		if (pattern) {
+			/* Jump to the line holding the next match. */
+			const char *hit = memmem(line, end - pos, pattern,
+						 pattern_len);
+			while (whole_words && hit &&
+			       !at_boundary(log, hit, log + end))
+				hit = memmem(hit + 1, log + end - hit - 1,
+					     pattern, pattern_len);
+			if (!hit)
+				break;
+			line = memrchr(line, '\n', hit - line);
+			line = line ? line + 1 : log + pos;
+		}
+		eol = memchr(line, '\n', log + end - line);
+		next = eol ? eol - log + 1 : end;
+		if (in_slice(line, log + next - line))
+			job_append(job, line, log + next - line);
+		pos = next;
+	}
+	munmap(log, log_size);
+}
+
+/**
+ * worker - Take jobs until none is left.
+ *
+ * @unused: Unused.
+ *
+ * Returns NULL.
+ */
+static void *worker(void *unused)
+{
+	while (1) {
+		int i;
+		pthread_mutex_lock(&lock);
+		i = next_job++;
+		pthread_mutex_unlock(&lock);
+		if (i >= num_jobs)
+			break;
+		search_file(&jobs[i]);
+	}
+	return NULL;
+}
+
+/**
+ * job_before - Compare the next lines of two jobs.
+ *
+ * @a: Index of a job in @jobs .
+ * @b: Index of a job in @jobs .
+ *
+ * Returns true if @a's next line goes first, false otherwise.
+ */
+static inline _Bool job_before(const int a, const int b)
+{
+	const char *line_a = jobs[a].out + jobs[a].merged;
+	const char *line_b = jobs[b].out + jobs[b].merged;
+	const int c = memcmp(line_a + stamp_offset(line_a),
+			     line_b + stamp_offset(line_b), STAMP_LEN);
+	return c < 0 || (!c && a < b);
+}
+
+/**
+ * merge_jobs - Print lines of all jobs in timestamp order.
+ *
+ * Returns nothing.
+ *
+ * Each job's lines are in timestamp order already. A binary heap picks the
+ * job with the earliest next line, with ties going to the earlier job.
+ */
+static void merge_jobs(void)
+{
+	static int *heap = NULL;
+	int count = 0;
+	int i;
+	if (!heap) {
+		heap = malloc(sizeof(int) * num_senders * 2);
+		if (!heap)
+			exit(1);
+	}
+	for (i = 0; i < num_jobs; i++) {
+		int j;
+		if (!jobs[i].out_len)
+			continue;
+		for (j = count++; j && job_before(i, heap[(j - 1) / 2]);
+		     j = (j - 1) / 2)
+			heap[j] = heap[(j - 1) / 2];
+		heap[j] = i;
+	}
+	while (count) {
+		struct job *job = &jobs[heap[0]];
+		const char *line = job->out + job->merged;
+		const char *eol = memchr(line, '\n', job->out_len - job->merged);
+		const size_t len = eol - line + 1;
+		int top = heap[0];
+		int j = 0;
+		fwrite(line, 1, len, stdout);
+		printed_lines++;
+		job->merged += len;
+		if (job->merged == job->out_len && !--count)
+			break;
+		if (job->merged == job->out_len)
+			top = heap[count];
+		while (1) {
+			int child = j * 2 + 1;
+			if (child >= count)
+				break;
+			if (child + 1 < count &&
+			    job_before(heap[child + 1], heap[child]))
+				child++;
+			if (!job_before(heap[child], top))
+				break;
+			heap[j] = heap[child];
+			j = child;
+		}
+		heap[j] = top;
+	}
+}
+
+/**
+ * search_slice - Search all senders for one slice and print the result.
+ *
+ * Returns nothing.
+ */
+static void search_slice(void)
+{
+	pthread_t threads[MAX_THREADS];
+	time_t day = slice_from;
+	int days = 0;
+	int i;
+	format_time(slice_from, slice_from_str);
+	format_time(slice_to, slice_to_str);
+	/* A slice covers one day, or two if it crosses midnight. */
+	num_jobs = 0;
+	while (days++ < 2) {
+		struct tm tm;
+		char date[16];
+		localtime_r(&day, &tm);
+		snprintf(date, sizeof(date), "%04u-%02u-%02u",
+			 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+		if (strncmp(date, slice_to_str, 10) > 0)
+			break;
+		for (i = 0; i < num_senders; i++) {
+			struct job *job = &jobs[num_jobs++];
+			job->sender = senders[i];
+			strcpy(job->date, date);
+			job->out_len = 0;
+			job->merged = 0;
+		}
+		/* Step by noon of the next day, for days aren't always 24h. */
+		tm.tm_mday++;
+		tm.tm_hour = 12;
+		tm.tm_min = 0;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		day = mktime(&tm);
+	}
+	next_job = 0;
+	for (i = 1; i < num_threads && i < num_jobs; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL))
+			break;
+	worker(NULL);
+	while (--i > 0)
+		pthread_join(threads[i], NULL);
+	merge_jobs();
+}
+
+/**
+ * find_tokens - Find tokens every line matching the pattern has.
+ *
+ * Returns nothing.
+ *
+ * Tokens at the ends of the pattern might be parts of longer tokens in
+ * lines, unless matching whole words only.
+ */
+static void find_tokens(void)
+{
+	size_t i = 0;
+	while (i < pattern_len && num_tokens < MAX_TOKENS) {
+		size_t start;
+		while (i < pattern_len && !bloom_token_char(pattern[i]))
+			i++;
+		start = i;
+		while (i < pattern_len && bloom_token_char(pattern[i]))
+			i++;
+		if (i - start < BLOOM_MIN_TOKEN ||
+		    (!whole_words && (!start || i == pattern_len)))
+			continue;
+		tokens[num_tokens++] = bloom_hash(pattern + start, i - start);
+	}
+}
+
+/**
+ * add_sender - Add a sender's directory to search.
+ *
+ * @path: Path to the directory.
+ *
+ * Returns nothing.
+ */
+static void add_sender(const char *path)
+{
+	senders = realloc(senders, sizeof(char *) * (num_senders + 1));
+	if (!senders || !(senders[num_senders++] = strdup(path))) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+}
+
+/**
+ * add_dir - Add directories of senders to search.
+ *
+ * @dir: A sender's directory, or a log directory holding them.
+ *
+ * Returns nothing.
+ */
+static void add_dir(const char *dir)
+{
+	struct dirent **list;
+	_Bool is_sender = 0;
+	const int n = scandir(dir, &list, NULL, alphasort);
+	int i;
+	if (n < 0) {
+		fprintf(stderr, "Can't open %s .\n", dir);
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		const char *name = list[i]->d_name;
+		const int len = strlen(name);
+		if (len > 4 && !strcmp(name + len - 4, ".log"))
+			is_sender = 1;
+	}
+	if (is_sender)
+		add_sender(dir);
+	for (i = 0; i < n; i++) {
+		char path[4096];
+		struct stat buf;
+		snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+		if (!is_sender && *list[i]->d_name != '.' && !stat(path, &buf) &&
+		    S_ISDIR(buf.st_mode))
+			add_sender(path);
+		free(list[i]);
+	}
+	free(list);
+}
+
+/**
+ * usage - Print usage and exit.
+ *
+ * @name: Program's name.
+ *
+ * This function does not return.
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "udplogger log query\n\n"
+		"Usage:\n  %s dir=$dir [dir=$dir ...] from=$time [to=$time] "
+		"[pattern=$string] [words=0|1] [threads=$threads] "
+		"[slice=$seconds] [verbose=0|1]\n\n"
+		"$dir is a log directory, or a directory like "
+		"$log_dir/$ip:$port for one sender.\n"
+		"$time is \"YYYY-MM-DD HH:MM:SS\" or \"YYYY-MM-DD\" in the "
+		"local time. to= defaults to now.\n"
+		"Only lines containing $string are printed if pattern= is "
+		"given, only as a whole\nword if words=1. Day files whose "
+		"token filter shows they lack words of $string\nare skipped."
+		"\n$threads defaults to the number of CPUs. Lines are "
+		"merged in timestamp order\nfor every $seconds (default 3600), "
+		"which bounds memory usage.\n", name);
+	exit(1);
+}
+
+/**
+ * do_init - Initialization function.
+ *
+ * @argc: Number of arguments.
+ * @argv: Arguments.
+ *
+ * Returns nothing.
+ */
+static void do_init(int argc, char *argv[])
+{
+	const char *from = NULL;
+	const char *to = NULL;
+	int i;
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (!strncmp(arg, "dir=", 4))
+			add_dir(arg + 4);
+		else if (!strncmp(arg, "from=", 5))
+			from = arg + 5;
+		else if (!strncmp(arg, "to=", 3))
+			to = arg + 3;
+		else if (!strncmp(arg, "pattern=", 8))
+			pattern = arg + 8;
+		else if (!strncmp(arg, "words=", 6))
+			whole_words = atoi(arg + 6) != 0;
+		else if (!strncmp(arg, "threads=", 8))
+			num_threads = atoi(arg + 8);
+		else if (!strncmp(arg, "slice=", 6))
+			slice_seconds = atoi(arg + 6);
+		else if (!strncmp(arg, "verbose=", 8))
+			verbose = atoi(arg + 8) != 0;
+		else
+			usage(argv[0]);
+	}
+	if (!num_senders || !from)
+		usage(argv[0]);
+	from_time = parse_time(from, 0);
+	to_time = to ? parse_time(to, 1) : time(NULL);
+	if (from_time == -1 || to_time == -1 || from_time > to_time)
+		usage(argv[0]);
+	if (pattern) {
+		pattern_len = strlen(pattern);
+		if (!pattern_len)
+			pattern = NULL;
+		else
+			find_tokens();
+	}
+	/* Sanity check. */
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+	if (num_threads > MAX_THREADS)
+		num_threads = MAX_THREADS;
+	if (slice_seconds < 60)
+		slice_seconds = 60;
+	if (slice_seconds > 86400)
+		slice_seconds = 86400;
+	/* A slice spans two days at most. */
+	jobs = calloc(num_senders * 2, sizeof(*jobs));
+	if (!jobs) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static char buf[1048576];
+	int i;
+	do_init(argc, argv);
+	setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+	for (slice_from = from_time; slice_from <= to_time;
+	     slice_from = slice_to + 1) {
+		slice_to = slice_from + slice_seconds - 1;
+		if (slice_to > to_time)
+			slice_to = to_time;
+		search_slice();
+	}
+	fflush(stdout);
+	for (i = 0; i < num_senders * 2; i++)
+		free(jobs[i].out);
+	if (verbose)
+		fprintf(stderr, "Searched %d senders with %d threads. Skipped "
+			"%llu day file searches by filter. Read %llu bytes, "
+			"printed %llu lines\n", num_senders, num_threads,
+			skipped_files, read_bytes, printed_lines);
+	return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * udplogger-replay - Replay captured netconsole traffic to udplogger.
+ *
+ * Reads a pcap file, picks IPv4 UDP datagrams and re-sends their payloads to
+ * udplogger at the original timing, at a scaled rate or as fast as possible.
+ * Each original sender gets its own socket bound to a loopback address so
+ * that udplogger sees as many distinct clients as the capture had.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* Structure for one original sender. */
+static struct source {
+	struct sockaddr_in orig; /* Address and port in the capture. */
+	int fd; /* Socket bound to the replaying address. */
+} *sources = NULL;
+
+/* Number of original senders seen. */
+static int num_sources = 0;
+/* Name of the pcap file. */
+static const char *pcap_file = NULL;
+/* Where to send. */
+static struct sockaddr_in target = { };
+/* Replay only datagrams sent to this port (0 for all UDP). */
+static int filter_port = 6666;
+/* Speed factor (1 for original timing, 0 for as fast as possible). */
+static double speed = 1;
+/* Number of times to replay the capture. */
+static int loops = 1;
+/* Bind the original addresses rather than mapping them into 127.0.0.0/8? */
+static _Bool keep_addr = 0;
+/* Keep the original source ports? */
+static _Bool keep_port = 1;
+
+/* Statistics. */
+static unsigned long long sent_packets = 0;
+static unsigned long long sent_bytes = 0;
+static unsigned long long skipped_packets = 0;
+static unsigned long long send_errors = 0;
+
+/* pcap file header. */
+struct pcap_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+/* pcap record header. */
+struct pcap_rec {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* Link types we understand. */
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW_OLD   12
+#define LINKTYPE_RAW      101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+/**
+ * swap32 - Convert byte order if the capture was written by the other endian.
+ *
+ * @v:       Value to convert.
+ * @swapped: True if byte order differs.
+ *
+ * Returns converted value.
+ */
+static uint32_t swap32(const uint32_t v, const _Bool swapped)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * now_ns - Get monotonic time.
+ *
+ * Returns current time in nanoseconds.
+ */
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * sleep_until - Sleep until given monotonic time.
+ *
+ * @ns: Time in nanoseconds.
+ *
+ * Returns nothing.
+ */
+static void sleep_until(const unsigned long long ns)
+{
+	struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR);
+}
+
+/**
+ * find_source - Find or create the socket replaying given sender.
+ *
+ * @addr: Pointer to "struct sockaddr_in" in the capture.
+ *
+ * Returns "struct source" on success, NULL otherwise.
+ *
+ * Unless keep_addr is set, a.b.c.d is mapped to 127.b.c.d, which Linux
+ * routes over the loopback interface without configuring aliases.
+ */
+static struct source *find_source(const struct sockaddr_in *addr)
+{
+	struct sockaddr_in local = *addr;
+	struct source *ptr;
+	int i;
+	for (i = 0; i < num_sources; i++)
+		if (sources[i].orig.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    sources[i].orig.sin_port == addr->sin_port)
+			return &sources[i];
+	ptr = realloc(sources, sizeof(*ptr) * (num_sources + 1));
+	if (!ptr)
+		return NULL;
+	sources = ptr;
+	ptr = &sources[num_sources];
+	ptr->orig = *addr;
+	if (!keep_addr)
+		local.sin_addr.s_addr = htonl(0x7f000000 |
+					      (ntohl(addr->sin_addr.s_addr) &
+					       0xffffff));
+	if (!keep_port)
+		local.sin_port = 0;
+	ptr->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ptr->fd == -1)
+		return NULL;
+	if (bind(ptr->fd, (struct sockaddr *) &local, sizeof(local))) {
+		/* Port already taken by another mapping; use any port. */
+		local.sin_port = 0;
+		if (bind(ptr->fd, (struct sockaddr *) &local, sizeof(local))) {
+			fprintf(stderr, "Can't bind to %s . Add it to the "
+				"loopback interface or use addr=map .\n",
+				inet_ntoa(local.sin_addr));
+			exit(1);
+		}
+	}
+	if (connect(ptr->fd, (struct sockaddr *) &target, sizeof(target))) {
+		close(ptr->fd);
+		return NULL;
+	}
+	num_sources++;
+	return ptr;
+}
+
+/**
+ * parse_packet - Find the UDP payload in a captured frame.
+ *
+ * @data:     Captured frame.
+ * @len:      Length of @data .
+ * @linktype: Link type of the capture.
+ * @src:      Pointer to "struct sockaddr_in" to store the sender.
+ * @payload:  Pointer to store the start of the payload.
+ *
+ * Returns length of the payload, -1 if not a datagram we replay.
+ */
+static int parse_packet(const unsigned char *data, int len,
+			const uint32_t linktype, struct sockaddr_in *src,
+			const unsigned char **payload)
+{
+	unsigned int proto = 0x0800;
+	unsigned int ihl;
+	unsigned int ulen;
+	switch (linktype) {
+	case LINKTYPE_NULL:
+		if (len < 4)
+			return -1;
+		/* AF_INET is 2 on every platform, in either byte order. */
+		if (!(data[0] == 2 && !data[3]) && !(data[3] == 2 && !data[0]))
+			return -1;
+		data += 4;
+		len -= 4;
+		break;
+	case LINKTYPE_ETHERNET:
+		if (len < 14)
+			return -1;
+		proto = data[12] << 8 | data[13];
+		data += 14;
+		len -= 14;
+		/* Skip 802.1Q tags. */
+		while (proto == 0x8100 && len >= 4) {
+			proto = data[2] << 8 | data[3];
+			data += 4;
+			len -= 4;
+		}
+		break;
+	case LINKTYPE_RAW_OLD:
+	case LINKTYPE_RAW:
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		proto = data[14] << 8 | data[15];
+		data += 16;
+		len -= 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		proto = data[0] << 8 | data[1];
+		data += 20;
+		len -= 20;
+		break;
+	default:
+		return -1;
+	}
+	/* IPv4, UDP, not fragmented. */
+	if (proto != 0x0800 || len < 20 || (data[0] >> 4) != 4 ||
+	    data[9] != 17 || ((data[6] << 8 | data[7]) & 0x3fff))
+		return -1;
+	ihl = (data[0] & 15) * 4;
+	if (ihl < 20 || len < ihl + 8)
+		return -1;
+	memset(src, 0, sizeof(*src));
+	src->sin_family = AF_INET;
+	memcpy(&src->sin_addr.s_addr, data + 12, 4);
+	data += ihl;
+	len -= ihl;
+	memcpy(&src->sin_port, data, 2);
+	if (filter_port && (data[2] << 8 | data[3]) != filter_port)
+		return -1;
+	ulen = data[4] << 8 | data[5];
+	if (ulen < 8 || ulen > len)
+		return -1;
+	*payload = data + 8;
+	return ulen - 8;
+}
+
+/**
+ * replay - Replay the capture once.
+ *
+ * Returns nothing.
+ */
+static void replay(void)
+{
+	static unsigned char buf[262144];
+	struct pcap_hdr hdr;
+	struct pcap_rec rec;
+	unsigned long long first_ts = 0;
+	unsigned long long start = 0;
+	unsigned int frac_ns;
+	_Bool swapped;
+	FILE *fp = fopen(pcap_file, "r");
+	if (!fp || fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+		fprintf(stderr, "Can't read %s .\n", pcap_file);
+		exit(1);
+	}
+	switch (hdr.magic) {
+	case 0xa1b2c3d4:
+	case 0xd4c3b2a1:
+		frac_ns = 1000;
+		break;
+	case 0xa1b23c4d:
+	case 0x4d3cb2a1:
+		frac_ns = 1;
+		break;
+	default:
+		fprintf(stderr, "%s is not a pcap file (pcapng is not "
+			"supported).\n", pcap_file);
+		exit(1);
+	}
+	swapped = hdr.magic == 0xd4c3b2a1 || hdr.magic == 0x4d3cb2a1;
+	hdr.linktype = swap32(hdr.linktype, swapped) & 0xffff;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		const unsigned int len = swap32(rec.incl_len, swapped);
+		const unsigned long long ts =
+			swap32(rec.ts_sec, swapped) * 1000000000ull +
+			swap32(rec.ts_frac, swapped) * frac_ns;
+		const unsigned char *payload;
+		struct sockaddr_in src;
+		struct source *ptr;
+		int plen;
+		if (len > sizeof(buf) || fread(buf, len, 1, fp) != 1)
+			break;
+		plen = parse_packet(buf, len, hdr.linktype, &src, &payload);
+		if (plen < 0) {
+			skipped_packets++;
+			continue;
+		}
+		ptr = find_source(&src);
+		if (!ptr) {
+			send_errors++;
+			continue;
+		}
+		/* Keep the original spacing, scaled by @speed . */
+		if (!start) {
+			start = now_ns();
+			first_ts = ts;
+		} else if (speed > 0 && ts > first_ts) {
+			sleep_until(start + (ts - first_ts) / speed);
+		}
+		if (send(ptr->fd, payload, plen, 0) == -1) {
+			send_errors++;
+			continue;
+		}
+		sent_packets++;
+		sent_bytes += plen;
+	}
+	fclose(fp);
+}
+
+/**
+ * usage - Print usage and exit.
+ *
+ * @name: Program's name.
+ *
+ * This function does not return.
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "netconsole traffic replayer\n\n"
+		"Usage:\n  %s pcap=$capture_file [ip=$udplogger_ip] "
+		"[port=$udplogger_port] [dport=$captured_port] [speed=$factor] "
+		"[loop=$count] [addr=map|keep] [sport=keep|any]\n\n"
+		"speed=1 keeps the original timing, speed=2 replays twice as "
+		"fast and speed=0 replays as fast as possible.\ndport=0 "
+		"replays every UDP datagram in the capture.\naddr=map replays "
+		"a.b.c.d from 127.b.c.d and addr=keep binds a.b.c.d itself, "
+		"which must be\nconfigured on the loopback interface.\n", name);
+	exit(1);
+}
+
+/**
+ * do_init - Initialization function.
+ *
+ * @argc: Number of arguments.
+ * @argv: Arguments.
+ *
+ * Returns nothing.
+ */
+static void do_init(int argc, char *argv[])
+{
+	int i;
+	target.sin_family = AF_INET;
+	target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	target.sin_port = htons(6666);
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (!strncmp(arg, "pcap=", 5))
+			pcap_file = arg + 5;
+		else if (!strncmp(arg, "ip=", 3))
+			target.sin_addr.s_addr = inet_addr(arg + 3);
+		else if (!strncmp(arg, "port=", 5))
+			target.sin_port = htons(atoi(arg + 5));
+		else if (!strncmp(arg, "dport=", 6))
+			filter_port = atoi(arg + 6);
+		else if (!strncmp(arg, "speed=", 6))
+			speed = atof(arg + 6);
+		else if (!strncmp(arg, "loop=", 5))
+			loops = atoi(arg + 5);
+		else if (!strcmp(arg, "addr=map"))
+			keep_addr = 0;
+		else if (!strcmp(arg, "addr=keep"))
+			keep_addr = 1;
+		else if (!strcmp(arg, "sport=keep"))
+			keep_port = 1;
+		else if (!strcmp(arg, "sport=any"))
+			keep_port = 0;
+		else
+			usage(argv[0]);
+	}
+	if (!pcap_file)
+		usage(argv[0]);
+	/* Sanity check. */
+	if (speed < 0)
+		speed = 0;
+	if (loops < 1)
+		loops = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long start;
+	double elapsed;
+	int i;
+	do_init(argc, argv);
+	start = now_ns();
+	for (i = 0; i < loops; i++)
+		replay();
+	elapsed = (now_ns() - start) / 1e9;
+	printf("Replayed %llu packets (%llu bytes) from %d senders in %.2f "
+	       "seconds (%.0f packets/sec), skipped %llu, %llu send errors\n",
+	       sent_packets, sent_bytes, num_sources, elapsed,
+	       elapsed > 0 ? sent_packets / elapsed : 0, skipped_packets,
+	       send_errors);
+	return 0;
+}
@@ -3,27 +3,149 @@
  *
  *    Written by Tetsuo Handa <penguin-kernel@I-love.SAKURA.ne.jp>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <netdb.h>
+#include <regex.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "udplogger-index.h"
+#include "udplogger-binlog.h"
 #define round_up(size) ((((size) + 4095u) / 4096u) * 4096u)
 
+/* Structure for tracking a day's log file. */
+struct logfile {
+	FILE *fp; /* Handle for the log file, NULL if not opened. */
+	FILE *idx_fp; /* Handle for the time index, NULL if not opened. */
+	struct tm tm; /* Date of the log file. */
+	time_t day; /* Start of @tm in local time, 0 to open again. */
+	unsigned long long size; /* Bytes in the log file. */
+	time_t indexed; /* Latest time recorded in the time index. */
+	char path[128]; /* Path of the log file. */
+	int dir_fd; /* Descriptor of the directory holding the log file. */
+	unsigned char *bloom; /* Filter of tokens in lines, NULL if none. */
+	_Bool binary; /* Is the log file in the binary format? */
+	unsigned char *block; /* Block being built, NULL if none. */
+	int block_len; /* Bytes of records in @block . */
+	unsigned int block_records; /* Lines in @block . */
+	time_t block_time; /* Time of the first line in @block . */
+	time_t block_last; /* Time of the last line in @block . */
+	const char *block_sender; /* Sender defined as 0 in @block . */
+};
+
 /* Structure for tracking partially received data. */
-static struct client {
+struct client {
 	struct sockaddr_in addr; /* Sender's IPv4 address and port. */
 	char *buffer; /* Buffer for holding received data. */
 	int avail; /* Valid bytes in @buffer . */
+	int size; /* Allocated bytes in @buffer . */
 	char addr_str[24]; /* String representation of @addr . */
 	time_t stamp; /* Timestamp of receiving the first byte in @buffer . */
-    FILE *log_fp; /* Handle for today's log file. */
-    /* Previous time. */
-    struct tm last_tm;
-} *clients = NULL;
+	time_t last_seen; /* Timestamp of receiving the latest data. */
+	unsigned int dropped; /* Bytes dropped since the last write. */
+	unsigned int tokens; /* Lines which may be written under rate= . */
+	time_t refilled; /* Time @tokens was last refilled. */
+	unsigned int suppressed; /* Lines over rate= not told yet. */
+	unsigned long long last_hash; /* Hash of the last line written. */
+	time_t last_written; /* Time the last line was written. */
+	unsigned int repeated; /* Repeats of the last line not told yet. */
+	unsigned int *sampled; /* Lines matching each sample= rule, or NULL. */
+	time_t urgent_until; /* Lines received before this time are urgent. */
+	struct logdir *dir; /* Directory of the log files. */
+	struct client *hash_next; /* Next client in the same hash bucket. */
+	struct client *lru_prev; /* Previous client in @lru_head list. */
+	struct client *lru_next; /* Next client in @lru_head list. */
+	struct client_slab *slab; /* Slab this record belongs to. */
+	int timer_index; /* 1 + index in @timer_heap, 0 if not queued. */
+	struct queued_datagram *queue_head; /* Datagrams not processed yet. */
+	struct queued_datagram *queue_tail; /* Last of @queue_head list. */
+	unsigned int queued; /* Bytes in @queue_head list. */
+	int deficit; /* Bytes serve_queues() may process in this round. */
+	struct client *active_next; /* Next client in @active_head list. */
+	_Bool in_use; /* True if this record is allocated. */
+};
+
+/* Max length of a sender's identity. */
+#define IDENTITY_MAX 63
+
+/* Log files in a directory, shared by clients with the same identity. */
+struct logdir {
+	char name[IDENTITY_MAX + 1]; /* Name of the directory. */
+	_Bool identity; /* Named by identity rather than by "ip:port"? */
+	int refs; /* Number of clients using this. */
+	int fd; /* Descriptor of the directory, -1 if not opened yet. */
+	struct logfile log; /* Today's log file. */
+	struct logfile next; /* Tomorrow's log file opened ahead, if any. */
+	struct logfile *routes; /* Log files of routes, NULL if not used. */
+	struct logdir *hash_next; /* Next in the same hash bucket. */
+};
+
+/* Datagram received under overload, waiting in its client's queue. */
+struct queued_datagram {
+	struct queued_datagram *next; /* Next datagram from the same client. */
+	time_t stamp; /* Timestamp of receiving @data . */
+	int len; /* Length of @data . */
+	char data[]; /* Payload. */
+};
+
+/* Number of "struct client" per a slab. */
+#define CLIENTS_PER_SLAB 64
+
+/* Slab of "struct client" which never moves while it is in use. */
+struct client_slab {
+	struct client_slab *next; /* Next slab in @slabs . */
+	int used; /* Number of records in use. */
+	struct client objs[CLIENTS_PER_SLAB];
+};
+
+/* List of slabs. */
+static struct client_slab *slabs = NULL;
+
+/* Iterate over all clients in use. */
+#define for_each_client(slab, ptr)					\
+	for (slab = slabs; slab; slab = slab->next)			\
+		for (ptr = slab->objs; ptr < slab->objs + CLIENTS_PER_SLAB; \
+		     ptr++)						\
+			if (!ptr->in_use) {} else
+
+/* Hash table for finding clients by address. */
+static struct client **client_hash = NULL;
+/* Number of buckets in @client_hash (power of 2). */
+static unsigned int client_hash_size = 0;
+
+/* Clients ordered from the least recently seen to the most recently seen. */
+static struct client *lru_head = NULL;
+static struct client *lru_tail = NULL;
+
+/* Min-heap of clients holding a partial line, ordered by @stamp . */
+static struct client **timer_heap = NULL;
+/* Number of clients in @timer_heap . */
+static int timer_count = 0;
+/* Allocated elements in @timer_heap . */
+static int timer_capacity = 0;
+
+/* Smallest buffer size class. */
+#define BUFFER_MIN_SHIFT 12
+/* Number of buffer size classes (4KB to 2MB). */
+#define BUFFER_CLASSES 10
+
+/* Released buffers per size class, linked through their first bytes. */
+static void *buffer_pool[BUFFER_CLASSES] = { };
 
 /* Current clients. */
 static int num_clients = 0;
@@ -33,372 +155,6059 @@ static int max_clients = 1024;
 static int wbuf_size = 65536;
 /* Max seconds to wait for new line. */
 static int wait_timeout = 10;
+/* Max seconds to keep an idle client. */
+static int idle_timeout = 3600;
+/* Evict clients until this percentage of @max_clients once above @high_pct . */
+static int low_pct = 75;
+/* Start evicting clients when above this percentage of @max_clients . */
+static int high_pct = 90;
+/* Max clients examined for eviction per a loop. */
+#define EVICT_BATCH 64
+/* Max bytes for line buffers. */
+static unsigned long long mem_budget = 256 * 1048576;
+/* Bytes mapped for line buffers, including released ones in the pool. */
+static unsigned long long mem_used = 0;
 /* Try to release unused memory? */
 static _Bool try_drop_memory_usage = 0;
+/* Max milliseconds to keep receiving after SIGTERM/SIGINT. */
+#define SHUTDOWN_DRAIN_MSEC 1000
+/* Max live tail subscribers. */
+#define MAX_SUBSCRIBERS 64
+/* Write log files? False if only relaying. */
+static _Bool log_files = 1;
+/* Formats of log files. */
+enum log_format {
+	FORMAT_TEXT, /* "$stamp $addr $text" lines in "$date.log". */
+	FORMAT_JSON, /* NDJSON records in "$date.log". */
+	FORMAT_BIN, /* Blocks of records in "$date.bin". */
+};
+/* Format to write log files in. */
+static enum log_format log_format = FORMAT_TEXT;
+/* Bytes of a log file's token filter, 0 if disabled. */
+static int bloom_bytes = 16384;
+/* Max lines per second per a client, 0 if unlimited. */
+static unsigned int rate_limit = 0;
+/* Max lines per a client at once under @rate_limit . */
+static unsigned int rate_burst = 0;
+/* Collapse repeated lines? */
+static _Bool dedup_lines = 0;
+/* Max seconds a line is collapsed as a repeat of the last line written. */
+#define REPEAT_INTERVAL 30
+/* Lines at this netconsole level or more severe are urgent, -1 if none. */
+static int urgent_level = 1;
+/* Seconds lines of a client stay urgent after an urgent line. */
+#define URGENT_INTERVAL 10
+/* File urgent lines are mirrored to, -1 if none. */
+static int incidents_fd = -1;
+/* Queue datagrams per client and serve them in turn under overload? */
+static _Bool fair_queueing = 1;
+/* True while receiving faster than processing. */
+static _Bool overloaded = 0;
+/* Max datagrams received by one recvmmsg(). */
+#define RECV_BATCH 32
+/* Max batches received under overload per round of serve_queues(). */
+#define READ_AHEAD 32
+/* Bytes a client may process per round of serve_queues(). */
+#define FAIR_QUANTUM 8192
+/* Clients with queued datagrams, in the order they are served. */
+static struct client *active_head = NULL;
+static struct client *active_tail = NULL;
+/* Bytes queued over all clients. */
+static unsigned long long queued_bytes = 0;
+
+/* Statistics. */
+static unsigned long long evicted_idle = 0;
+static unsigned long long evicted_pressure = 0;
+static unsigned long long forced_flushes = 0;
+static unsigned long long dropped_bytes = 0;
+static unsigned long long rules_dropped = 0;
+static unsigned long long rules_routed = 0;
+static unsigned long long lines_repeated = 0;
+static unsigned long long lines_suppressed = 0;
+static unsigned long long lines_urgent = 0;
 
 /**
- * switch_logfile - Close yesterday's log file and open today's log file.
+ * buffer_class - Find the size class which can hold given bytes.
  *
- * @tm: Pointer to "struct tm" holding current time.
+ * @size: Bytes needed.
  *
- * Returns nothing.
+ * Returns index of the size class, BUFFER_CLASSES if too large.
  */
-static void switch_logfile(struct client* client, struct tm *tm)
+static int buffer_class(const int size)
 {
-    /* Name of today's log file. */
-    static char filename[128] = { };
+	int class = 0;
+	while (class < BUFFER_CLASSES && (1 << (BUFFER_MIN_SHIFT + class)) < size)
+		class++;
+	return class;
+}
 
-    mkdir(client->addr_str,0755);
+/**
+ * get_buffer - Allocate a line buffer from the pool.
+ *
+ * @ptr:  Pointer to "struct client".
+ * @size: Bytes needed.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * The data in @ptr->buffer is preserved and the old buffer is released.
+ */
+static int get_buffer(struct client *ptr, int size)
+{
+	char *buf;
+	int class;
+	/*
+	 * A line longer than 16KB is likely to grow until @wbuf_size .
+	 * Jump to the largest class it can need rather than copying it
+	 * at every class on the way.
+	 */
+	if (size > ptr->avail && size > 16384 && size < wbuf_size + 65536 &&
+	    mem_used + (wbuf_size + 65536) * 2 <= mem_budget)
+		size = wbuf_size + 65536;
+	class = buffer_class(size);
+	if (class >= BUFFER_CLASSES)
+		return -1;
+	buf = buffer_pool[class];
+	if (buf) {
+		buffer_pool[class] = *(void **) buf;
+	} else {
+		const int bytes = 1 << (BUFFER_MIN_SHIFT + class);
+		if (mem_used + bytes > mem_budget)
+			return -1;
+		buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED)
+			return -1;
+		mem_used += bytes;
+	}
+	if (ptr->avail)
+		memcpy(buf, ptr->buffer, ptr->avail);
+	if (ptr->buffer) {
+		const int old = buffer_class(ptr->size);
+		*(void **) ptr->buffer = buffer_pool[old];
+		buffer_pool[old] = ptr->buffer;
+	}
+	ptr->buffer = buf;
+	ptr->size = 1 << (BUFFER_MIN_SHIFT + class);
+	return 0;
+}
 
-	FILE *fp = client->log_fp;
-	snprintf(filename, sizeof(filename) - 1, "%s/%04u-%02u-%02u.log",
-		 client->addr_str, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
-	client->log_fp = fopen(filename, "a");
-	if (!fp)
+/**
+ * put_buffer - Return an empty line buffer to the pool.
+ *
+ * @ptr: Pointer to "struct client".
+ *
+ * Returns nothing.
+ */
+static void put_buffer(struct client *ptr)
+{
+	const int class = buffer_class(ptr->size);
+	if (!ptr->buffer)
 		return;
-	/* If open() failed, continue using old one. */
-	if (client->log_fp)
-		fclose(fp);
-	else
-		client->log_fp = fp;
-	try_drop_memory_usage = 1;
+	*(void **) ptr->buffer = buffer_pool[class];
+	buffer_pool[class] = ptr->buffer;
+	ptr->buffer = NULL;
+	ptr->size = 0;
 }
 
 /**
- * write_logfile - Write to today's log file.
- *
- * @ptr:    Pointer to "struct client".
- * @forced: True if the partial line should be written.
+ * drain_buffer_pool - Return all released line buffers to the OS.
  *
  * Returns nothing.
  */
-static void write_logfile(struct client *ptr, const _Bool forced)
+static void drain_buffer_pool(void)
 {
-	static time_t last_time = 0;
-	static char stamp[24] = { };
-	char *buffer = ptr->buffer;
-	int avail = ptr->avail;
-	const time_t now_time = ptr->stamp;
-	if (last_time != now_time) {
-		struct tm *tm = localtime(&now_time);
-		if (!tm)
-			tm = &ptr->last_tm;
-		snprintf(stamp, sizeof(stamp) - 1, "%04u-%02u-%02u "
-			 "%02u:%02u:%02u ", tm->tm_year + 1900, tm->tm_mon + 1,
-			 tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
-		/*
-		 * Switch log file if the day has changed. We can't use
-		 * (last_time / 86400 != now_time / 86400) in order to allow
-		 * switching at 00:00:00 of the local time.
-		 */
-		if (tm->tm_mday != ptr->last_tm.tm_mday ||
-		    tm->tm_mon != ptr->last_tm.tm_mon ||
-		    tm->tm_year != ptr->last_tm.tm_year) {
-			ptr->last_tm = *tm;
-			switch_logfile(ptr,tm);
+	int class;
+	for (class = 0; class < BUFFER_CLASSES; class++)
+		while (buffer_pool[class]) {
+			void *buf = buffer_pool[class];
+			buffer_pool[class] = *(void **) buf;
+			munmap(buf, 1 << (BUFFER_MIN_SHIFT + class));
+			mem_used -= 1 << (BUFFER_MIN_SHIFT + class);
 		}
-		last_time = now_time;
+}
+
+/**
+ * timer_swap - Swap two elements of @timer_heap .
+ *
+ * @i: Index of one element.
+ * @j: Index of the other element.
+ *
+ * Returns nothing.
+ */
+static void timer_swap(const int i, const int j)
+{
+	struct client *tmp = timer_heap[i];
+	timer_heap[i] = timer_heap[j];
+	timer_heap[j] = tmp;
+	timer_heap[i]->timer_index = i + 1;
+	timer_heap[j]->timer_index = j + 1;
+}
+
+/**
+ * timer_sift - Restore heap order around an element.
+ *
+ * @i: Index of the element whose key changed.
+ *
+ * Returns nothing.
+ */
+static void timer_sift(int i)
+{
+	while (i && timer_heap[i]->stamp < timer_heap[(i - 1) / 2]->stamp) {
+		timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
-	/* Write the completed lines. */
 	while (1) {
-		char *cp = memchr(buffer, '\n', avail);
-		const int len = cp - buffer + 1;
-		if (!cp)
+		const int left = i * 2 + 1;
+		int min = i;
+		if (left < timer_count &&
+		    timer_heap[left]->stamp < timer_heap[min]->stamp)
+			min = left;
+		if (left + 1 < timer_count &&
+		    timer_heap[left + 1]->stamp < timer_heap[min]->stamp)
+			min = left + 1;
+		if (min == i)
 			break;
-		fprintf(ptr->log_fp, "%s%s ", stamp, ptr->addr_str);
-		fwrite(buffer, 1, len, ptr->log_fp);
-		avail -= len;
-		buffer += len;
-	}
-	/* Write the incomplete line if forced. */
-	if (forced && avail) {
-		fprintf(ptr->log_fp, "%s%s ", stamp, ptr->addr_str);
-		fwrite(buffer, 1, avail, ptr->log_fp);
-		fprintf(ptr->log_fp, "\n");
-		avail = 0;
+		timer_swap(i, min);
+		i = min;
 	}
-	/* Discard the written data. */
-	if (ptr->buffer != buffer)
-		memmove(ptr->buffer, buffer, avail);
-	ptr->avail = avail;
 }
 
 /**
- * drop_memory_usage - Try to reduce memory usage.
+ * timer_add - Start waiting for the rest of a partial line.
+ *
+ * @ptr: Pointer to "struct client" whose @stamp is set.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int timer_add(struct client *ptr)
+{
+	if (ptr->timer_index)
+		return 0;
+	if (timer_count == timer_capacity) {
+		const int capacity = timer_capacity ? timer_capacity * 2 : 64;
+		struct client **heap = realloc(timer_heap,
+					       sizeof(*heap) * capacity);
+		if (!heap)
+			return -1;
+		timer_heap = heap;
+		timer_capacity = capacity;
+	}
+	timer_heap[timer_count++] = ptr;
+	ptr->timer_index = timer_count;
+	timer_sift(timer_count - 1);
+	return 0;
+}
+
+/**
+ * timer_del - Stop waiting for the rest of a partial line.
+ *
+ * @ptr: Pointer to "struct client".
  *
  * Returns nothing.
  */
-static void drop_memory_usage(void)
+static void timer_del(struct client *ptr)
 {
-	struct client *ptr;
-	int i = 0;
-	if (!try_drop_memory_usage)
+	const int i = ptr->timer_index - 1;
+	if (i < 0)
 		return;
-	try_drop_memory_usage = 0;
-	while (i < num_clients) {
-		ptr = &clients[i];
-		if (ptr->avail) {
-			char *tmp = realloc(ptr->buffer, round_up(ptr->avail));
-			if (tmp)
-				ptr->buffer = tmp;
-			i++;
-			continue;
-		}
-		free(ptr->buffer);
-		num_clients--;
-		memmove(ptr, ptr + 1, (num_clients - i) * sizeof(*ptr));
-	}
-	if (num_clients) {
-		ptr = realloc(clients, round_up(sizeof(*ptr) * num_clients));
-		if (ptr)
-			clients = ptr;
-	} else {
-		free(clients);
-		clients = NULL;
+	ptr->timer_index = 0;
+	if (i != --timer_count) {
+		timer_heap[i] = timer_heap[timer_count];
+		timer_heap[i]->timer_index = i + 1;
+		timer_sift(i);
 	}
 }
 
 /**
- * flush_all_and_abort - Clean up upon out of memory.
+ * timer_wait - Calculate how long poll() may sleep.
  *
- * This function does not return.
+ * Returns milliseconds until the oldest partial line times out, -1 if no
+ * partial line is pending.
  */
-static void flush_all_and_abort(void)
+static int timer_wait(void)
 {
-	int i;
-	for (i = 0; i < num_clients; i++)
-		if (clients[i].avail) {
-			write_logfile(&clients[i], 1);
-			free(clients[i].buffer);
-	        fprintf(clients[i].log_fp, "[aborted due to memory allocation failure]\n");
-	        fflush(clients[i].log_fp);
-		}
-	exit(1);
+	struct timespec ts;
+	long long msec;
+	if (!timer_count)
+		return -1;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	msec = (timer_heap[0]->stamp + wait_timeout - ts.tv_sec) * 1000ll -
+		ts.tv_nsec / 1000000;
+	if (msec < 0)
+		return 0;
+	return msec > 1000000 ? 1000000 : msec;
 }
 
 /**
- * find_client - Find the structure for given address.
+ * lru_del - Remove a client from the LRU list.
  *
- * @addr: Pointer to "struct sockaddr_in".
+ * @ptr: Pointer to "struct client".
  *
- * Returns "struct client" for @addr on success, NULL otherwise.
+ * Returns nothing.
  */
-static struct client *find_client(struct sockaddr_in *addr)
+static void lru_del(struct client *ptr)
+{
+	if (ptr->lru_prev)
+		ptr->lru_prev->lru_next = ptr->lru_next;
+	else
+		lru_head = ptr->lru_next;
+	if (ptr->lru_next)
+		ptr->lru_next->lru_prev = ptr->lru_prev;
+	else
+		lru_tail = ptr->lru_prev;
+	ptr->lru_prev = NULL;
+	ptr->lru_next = NULL;
+}
+
+/**
+ * lru_add_tail - Make a client the most recently seen one.
+ *
+ * @ptr: Pointer to "struct client" not in the LRU list.
+ *
+ * Returns nothing.
+ */
+static void lru_add_tail(struct client *ptr)
+{
+	ptr->lru_prev = lru_tail;
+	ptr->lru_next = NULL;
+	if (lru_tail)
+		lru_tail->lru_next = ptr;
+	else
+		lru_head = ptr;
+	lru_tail = ptr;
+}
+
+/**
+ * buffer_pool_bytes - Count bytes of released line buffers.
+ *
+ * Returns bytes held by @buffer_pool .
+ */
+static unsigned long long buffer_pool_bytes(void)
+{
+	unsigned long long bytes = 0;
+	int class;
+	for (class = 0; class < BUFFER_CLASSES; class++) {
+		void *buf;
+		for (buf = buffer_pool[class]; buf; buf = *(void **) buf)
+			bytes += 1 << (BUFFER_MIN_SHIFT + class);
+	}
+	return bytes;
+}
+
+/**
+ * alloc_client - Allocate a "struct client" from slabs.
+ *
+ * Returns zero-cleared "struct client" on success, NULL otherwise.
+ */
+static struct client *alloc_client(void)
 {
+	struct client_slab *slab;
 	struct client *ptr;
-	int i;
-	for (i = 0; i < num_clients; i++)
-		if (!memcmp(&clients[i].addr, addr, sizeof(*addr)))
-			return &clients[i];
-	if (i >= max_clients) {
-		try_drop_memory_usage = 1;
-		drop_memory_usage();
-		if (i >= max_clients)
+	for (slab = slabs; slab; slab = slab->next)
+		if (slab->used < CLIENTS_PER_SLAB)
+			break;
+	if (!slab) {
+		slab = mmap(NULL, sizeof(*slab), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED)
 			return NULL;
+		slab->next = slabs;
+		slabs = slab;
 	}
-	ptr = realloc(clients, round_up(sizeof(*ptr) * (num_clients + 1)));
-	if (!ptr)
-		return NULL;
-	clients = ptr;
-	ptr = &clients[num_clients++];
+	for (ptr = slab->objs; ptr->in_use; ptr++);
 	memset(ptr, 0, sizeof(*ptr));
-	ptr->addr = *addr;
-	snprintf(ptr->addr_str, sizeof(ptr->addr_str) - 1, "%s:%u",
-		 inet_ntoa(addr->sin_addr), htons(addr->sin_port));
+	ptr->slab = slab;
+	ptr->in_use = 1;
+	slab->used++;
 	return ptr;
 }
 
 /**
- * do_main - The main loop.
+ * free_client - Release a "struct client" to its slab.
  *
- * @fd: Receiver socket's file descriptor.
+ * @ptr: Pointer to "struct client".
+ *
+ * Returns nothing.
+ *
+ * The caller must have removed @ptr from @client_hash .
+ */
+static void free_client(struct client *ptr)
+{
+	lru_del(ptr);
+	timer_del(ptr);
+	put_buffer(ptr);
+	free(ptr->sampled);
+	ptr->in_use = 0;
+	ptr->slab->used--;
+	num_clients--;
+}
+
+/**
+ * release_slabs - Return slabs with no clients in use to the OS.
  *
  * Returns nothing.
  */
-static void do_main(const int fd)
+static void release_slabs(void)
 {
-	static char buf[65536];
-	struct sockaddr_in addr;
-	while (1) {
-		struct pollfd pfd = { fd, POLLIN, 0 };
-		socklen_t size = sizeof(addr);
-		int i;
-		time_t now;
-		/* Don't wait forever if checking for timeout. */
-		for (i = 0; i < num_clients; i++)
-			if (clients[i].avail)
-				break;
-		/* Flush log file and wait for data. */
-		// fflush(log_fp);
-		poll(&pfd, 1, i < num_clients ? 1000 : -1);
-		now = time(NULL);
-		/* Check for timeout. */
-		for (i = 0; i < num_clients; i++)
-			if (clients[i].avail &&
-			    now - clients[i].stamp >= wait_timeout)
-				write_logfile(&clients[i], 1);
-		/* Don't receive forever in order to check for timeout. */
-		while (now == time(NULL)) {
-			struct client *ptr;
-			char *tmp;
-			int len = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT,
-					   (struct sockaddr *) &addr, &size);
-			if (len <= 0 || size != sizeof(addr))
-				break;
-			ptr = find_client(&addr);
-			if (!ptr)
-				continue;
-			/* Save current time if receiving the first byte. */
-			if (!ptr->avail)
-				ptr->stamp = now;
-			/* Append data to the line. */
-			tmp = realloc(ptr->buffer, round_up(ptr->avail + len));
-			if (!tmp)
-				flush_all_and_abort();
-			memmove(tmp + ptr->avail, buf, len);
-			ptr->avail += len;
-			ptr->buffer = tmp;
-			/* Write if at least one line completed. */
-			if (memchr(buf, '\n', len))
-				write_logfile(ptr, 0);
-			/* Write if the line is too long. */
-			if (ptr->avail >= wbuf_size)
-				write_logfile(ptr, 1);
+	struct client_slab **prev = &slabs;
+	while (*prev) {
+		struct client_slab *slab = *prev;
+		if (slab->used) {
+			prev = &slab->next;
+			continue;
 		}
-		drop_memory_usage();
+		*prev = slab->next;
+		munmap(slab, sizeof(*slab));
 	}
 }
 
 /**
- * usage - Print usage and exit.
+ * client_hash_bucket - Find the hash bucket for given address.
  *
- * @name: Program's name.
+ * @addr: Pointer to "struct sockaddr_in".
  *
- * This function does not return.
+ * Returns pointer to the head of the bucket.
  */
-static void usage(const char *name)
+static struct client **client_hash_bucket(const struct sockaddr_in *addr)
 {
-	fprintf(stderr, "Simple UDP logger\n\n"
-		"Usage:\n  %s [ip=$listen_ip] [port=$listen_port] "
-		"[dir=$log_dir] [timeout=$seconds_waiting_for_newline] "
-		"[clients=$max_clients] [wbuf=$write_buffer_size] "
-		"[rbuf=$receive_buffer_size]\n\n"
-		"The value of $seconds_waiting_for_newline should be between "
-		"5 and 600.\nThe value of $max_clients should be between 10 "
-		"and 65536.\nThe value of $write_buffer_size should be "
-		"between 1024 and 1048576.\nThe value of $receive_buffer_size "
-		"should be 65536 and 1073741824 (though actual size might be "
-		"adjusted by the kernel).\n", name);
-	exit (1);
+	const unsigned int hash = (addr->sin_addr.s_addr * 2654435761u) ^
+		(addr->sin_port * 40503u);
+	return &client_hash[(hash ^ (hash >> 16)) & (client_hash_size - 1)];
 }
 
+/* Bytes of records collected before writing a block. */
+#define BIN_BLOCK_SIZE 4096
+
 /**
- * do_init - Initialization function.
+ * bin_write - Write one block to a binary log file.
  *
- * @argc: Number of arguments.
- * @argv: Arguments.
+ * @log:     Pointer to "struct logfile".
+ * @head:    Beginning of records.
+ * @len:     Length of @head .
+ * @text:    Rest of records, NULL if none.
+ * @len2:    Length of @text .
+ * @records: Number of lines in the records.
+ * @time:    Time the first line's delta is relative to.
  *
- * Returns the listener socket's file descriptor.
+ * Returns nothing.
  */
-static int do_init(int argc, char *argv[])
+static void bin_write(struct logfile *log, const void *head, const int len,
+		      const char *text, const int len2,
+		      const unsigned int records, const time_t time)
 {
-	struct sockaddr_in addr = { };
-	char pwd[4096];
-	/* Max receive buffer size. */
-	int rbuf_size = 8 * 1048576;
-	socklen_t size;
-	int fd;
-	int i;
-	/* Directory to save logs. */
-	const char *log_dir = ".";
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(6666);
-	for (i = 1; i < argc; i++) {
-		char *arg = argv[i];
-		if (!strncmp(arg, "ip=", 3))
-			addr.sin_addr.s_addr = inet_addr(arg + 3);
-		else if (!strncmp(arg, "port=", 5))
-			addr.sin_port = htons(atoi(arg + 5));
-		else if (!strncmp(arg, "dir=", 4))
-			log_dir = arg + 4;
-		else if (!strncmp(arg, "timeout=", 8))
-			wait_timeout = atoi(arg + 8);
-		else if (!strncmp(arg, "clients=", 8))
-			max_clients = atoi(arg + 8);
-		else if (!strncmp(arg, "wbuf=", 5))
-			wbuf_size = atoi(arg + 5);
-		else if (!strncmp(arg, "rbuf=", 5))
-			rbuf_size = atoi(arg + 5);
-		else
-			usage(argv[0]);
-	}
-	/* Sanity check. */
-	if (max_clients < 10)
-		max_clients = 10;
-	if (max_clients > 65536)
-		max_clients = 65536;
-	if (wait_timeout < 5)
-		wait_timeout = 5;
-	if (wait_timeout > 600)
-		wait_timeout = 600;
-	if (wbuf_size < 1024)
-		wbuf_size = 1024;
-	if (wbuf_size > 1048576)
-		wbuf_size = 1048576;
-	if (rbuf_size < 65536)
-		rbuf_size = 65536;
-	if (rbuf_size > 1024 * 1048576)
-		rbuf_size = 1024 * 1048576;
-	/* Create the listener socket and configure it. */
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-#ifdef SO_RCVBUFFORCE
-	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rbuf_size,
-		       sizeof(rbuf_size))) {
-#endif
-		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rbuf_size,
-			       sizeof(rbuf_size))) {
-			fprintf(stderr, "Can't set receive buffer size.\n");
-			exit(1);
-		}
-#ifdef SO_RCVBUFFORCE
+	struct binlog_block block = { BINLOG_MAGIC };
+	block.len = len + len2;
+	block.crc = crc32(0, head, len);
+	if (len2)
+		block.crc = crc32(block.crc, (const Bytef *) text, len2);
+	block.records = records;
+	block.time = time;
+	log->size += fwrite(&block, 1, sizeof(block), log->fp);
+	log->size += fwrite(head, 1, len, log->fp);
+	if (len2)
+		log->size += fwrite(text, 1, len2, log->fp);
+}
+
+/**
+ * bin_end_block - Write the block being built to a binary log file.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ */
+static void bin_end_block(struct logfile *log)
+{
+	if (log->block_len && log->fp)
+		bin_write(log, log->block, log->block_len, NULL, 0,
+			  log->block_records, log->block_time);
+	log->block_len = 0;
+}
+
+/**
+ * bin_flush - Write the block being built and release its buffer.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ *
+ * Called when the log file is flushed, so that idle clients don't keep
+ * a block allocated.
+ */
+static void bin_flush(struct logfile *log)
+{
+	bin_end_block(log);
+	free(log->block);
+	log->block = NULL;
+}
+
+/**
+ * bin_append - Append a line to a binary log file.
+ *
+ * @log:    Pointer to "struct logfile".
+ * @sender: Sender's name, which stays valid while the log file is open.
+ * @time:   Time the line was received.
+ * @text:   Text of the line without the newline.
+ * @len:    Length of @text .
+ *
+ * Returns nothing.
+ *
+ * Lines are collected into blocks of about BIN_BLOCK_SIZE bytes, as much as
+ * stdio buffers for text. A line too long for a block, or which comes when
+ * a block can't be allocated, gets its own.
+ */
+static void bin_append(struct logfile *log, const char *sender,
+		       const time_t time, const char *text, const int len)
+{
+	unsigned char head[64 + 40];
+	int head_len = 0;
+	int sender_len;
+	if (log->block_len && (log->block_len + len + 40 > BIN_BLOCK_SIZE ||
+			       sender != log->block_sender))
+		bin_end_block(log);
+	if (!log->block_len) {
+		sender_len = strlen(sender);
+		if (sender_len > 64)
+			sender_len = 64;
+		head[0] = 1;
+		head[1] = sender_len;
+		memcpy(head + 2, sender, sender_len);
+		head_len = 2 + sender_len;
+		log->block_sender = sender;
+		log->block_time = time;
+		log->block_last = time;
+		log->block_records = 0;
 	}
-#endif
-	size = sizeof(rbuf_size);
-	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rbuf_size, &size)) {
-		fprintf(stderr, "Can't get receive buffer size.\n");
-		exit(1);
+	head[head_len++] = 0;
+	head_len += binlog_put_varint(head + head_len,
+				      binlog_zigzag(time - log->block_last));
+	head_len += binlog_put_varint(head + head_len, len);
+	log->block_last = time;
+	if (!log->block && head_len + len <= BIN_BLOCK_SIZE)
+		log->block = malloc(BIN_BLOCK_SIZE);
+	/* No block is being built if there is no memory for one. */
+	if (head_len + len > BIN_BLOCK_SIZE || !log->block) {
+		bin_write(log, head, head_len, text, len, 1, time);
+		return;
 	}
-	size = sizeof(addr);
-	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
-	    getsockname(fd, (struct sockaddr *) &addr, &size) ||
-	    size != sizeof(addr)) {
-		fprintf(stderr, "Can't bind to %s:%u .\n",
-			inet_ntoa(addr.sin_addr), htons(addr.sin_port));
-		exit(1);
+	memcpy(log->block + log->block_len, head, head_len);
+	memcpy(log->block + log->block_len + head_len, text, len);
+	log->block_len += head_len + len;
+	log->block_records++;
+}
+
+/**
+ * flush_logfile - Pass a log file and its index to the kernel.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ */
+static void flush_logfile(struct logfile *log)
+{
+	bin_flush(log);
+	if (log->fp)
+		fflush(log->fp);
+	if (log->idx_fp)
+		fflush(log->idx_fp);
+}
+
+/**
+ * bloom_path - Build the name of a log file's token filter.
+ *
+ * @log: Pointer to "struct logfile".
+ * @buf: Buffer to store the name, relative to @log->dir_fd .
+ *
+ * Returns nothing.
+ */
+static void bloom_path(const struct logfile *log, char *buf)
+{
+	const char *name = strrchr(log->path, '/') + 1;
+	const int len = strlen(name) - 4;
+	memcpy(buf, name, len);
+	strcpy(buf + len, ".bloom");
+}
+
+static void bloom_add(struct logfile *log, const char *data, const int len);
+
+/**
+ * bloom_open - Start building a log file's token filter.
+ *
+ * @log: Pointer to "struct logfile" which was just opened.
+ *
+ * Returns nothing.
+ *
+ * A filter saved when the log file was closed earlier is taken over and
+ * removed, for it becomes stale once lines are appended. If the log file
+ * has lines the filter doesn't cover, no filter is built, for it would miss
+ * tokens.
+ */
+static void bloom_open(struct logfile *log)
+{
+	char path[sizeof(log->path) + 8];
+	struct bloom_header header;
+	int fd;
+	log->bloom = NULL;
+	bloom_path(log, path);
+	fd = openat(log->dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		unlinkat(log->dir_fd, path, 0);
+		if (bloom_bytes &&
+		    read(fd, &header, sizeof(header)) == sizeof(header) &&
+		    !memcmp(header.magic, BLOOM_MAGIC, sizeof(header.magic)) &&
+		    header.bits == bloom_bytes * 8 &&
+		    header.hashes == BLOOM_HASHES &&
+		    header.size == log->size) {
+			log->bloom = malloc(bloom_bytes);
+			if (log->bloom &&
+			    read(fd, log->bloom, bloom_bytes) != bloom_bytes) {
+				free(log->bloom);
+				log->bloom = NULL;
+			}
+		}
+		close(fd);
+		return;
 	}
-	/* Open the initial log file. */
-	memset(pwd, 0, sizeof(pwd));
-	if (chdir(log_dir) || !getcwd(pwd, sizeof(pwd) - 1)) {
-		fprintf(stderr, "Can't change directory to %s .\n", log_dir);
-		exit(1);
+	if (!bloom_bytes || log->size)
+		return;
+	log->bloom = calloc(1, bloom_bytes);
+	/*
+	 * Lines are added without the "stamp addr " prefix. Its tokens are
+	 * the date and the address, which are in the path. Tokens of the
+	 * time are too short to be added.
+	 */
+	if (log->bloom)
+		bloom_add(log, log->path, strlen(log->path));
+}
+
+/**
+ * bloom_write - Write a token filter file.
+ *
+ * @dir_fd: Descriptor of the directory to write to.
+ * @path:   Name of the filter file.
+ * @bloom:  The filter.
+ * @bytes:  Length of @bloom .
+ * @size:   Bytes of the log file @bloom covers.
+ *
+ * Returns nothing.
+ */
+static void bloom_write(const int dir_fd, const char *path,
+			const unsigned char *bloom, const int bytes,
+			const unsigned long long size)
+{
+	char tmp[256];
+	struct bloom_header header = { BLOOM_MAGIC };
+	int fd;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	header.bits = bytes * 8;
+	header.hashes = BLOOM_HASHES;
+	header.size = size;
+	fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644);
+	if (fd == -1)
+		return;
+	/* Readers see either no filter or a complete one. */
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+	    write(fd, bloom, bytes) != bytes) {
+		close(fd);
+		unlinkat(dir_fd, tmp, 0);
+	} else if (close(fd)) {
+		unlinkat(dir_fd, tmp, 0);
 	} else {
-		const time_t now = time(NULL);
-		struct tm *tm = localtime(&now);
-		printf("Started at %04u-%02u-%02u %02u:%02u:%02u at %s\n",
-		       tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-		       tm->tm_hour, tm->tm_min, tm->tm_sec, pwd);
+		renameat(dir_fd, tmp, dir_fd, path);
+	}
+}
+
+/**
+ * bloom_save - Write a log file's token filter and stop building it.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ */
+static void bloom_save(struct logfile *log)
+{
+	char path[sizeof(log->path) + 8];
+	if (!log->bloom)
+		return;
+	bloom_path(log, path);
+	bloom_write(log->dir_fd, path, log->bloom, bloom_bytes, log->size);
+	free(log->bloom);
+	log->bloom = NULL;
+}
+
+/**
+ * bloom_drop - Stop building a log file's token filter without saving it.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ *
+ * The log file is left without a filter, which makes queries scan it.
+ */
+static void bloom_drop(struct logfile *log)
+{
+	free(log->bloom);
+	log->bloom = NULL;
+}
+
+/**
+ * close_logfile - Close a log file and its indexes.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ */
+static void close_logfile(struct logfile *log)
+{
+	bin_flush(log);
+	bloom_save(log);
+	if (log->fp)
+		fclose(log->fp);
+	if (log->idx_fp)
+		fclose(log->idx_fp);
+	log->fp = NULL;
+	log->idx_fp = NULL;
+}
+
+/**
+ * sync_logfile - Write a log file to the disk and close it.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ */
+static void sync_logfile(struct logfile *log)
+{
+	if (!log->fp)
+		return;
+	bin_flush(log);
+	fflush(log->fp);
+	fsync(fileno(log->fp));
+	close_logfile(log);
+}
+
+/* Log file handed to the closer thread. */
+struct close_job {
+	struct close_job *next; /* Next job in @close_jobs . */
+	FILE *fp; /* Handle for the log file. */
+	FILE *idx_fp; /* Handle for its time index, NULL if none. */
+	unsigned char *bloom; /* Its token filter, NULL if none. */
+	int bloom_bytes; /* Length of @bloom . */
+	unsigned long long size; /* Bytes of the log file @bloom covers. */
+	int dir_fd; /* Duplicate of its directory's descriptor, -1 if none. */
+	char bloom_path[136]; /* Name of the filter file. */
+};
+
+/* Jobs of the closer thread and their count, under @close_lock . */
+static pthread_mutex_t close_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t close_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t close_done = PTHREAD_COND_INITIALIZER;
+static struct close_job *close_jobs = NULL;
+static struct close_job **close_jobs_tail = &close_jobs;
+static int close_pending = 0;
+/* Latest day of log files handed to the closer thread, 0 if none. */
+static time_t closing_day = 0;
+/* Has the closer thread been started? */
+static _Bool closer_started = 0;
+
+/**
+ * closer_main - Close log files handed over by close_later().
+ *
+ * @unused: Unused.
+ *
+ * Returns NULL.
+ */
+static void *closer_main(void *unused)
+{
+	pthread_mutex_lock(&close_lock);
+	while (1) {
+		struct close_job *job = close_jobs;
+		if (!job) {
+			pthread_cond_wait(&close_wake, &close_lock);
+			continue;
+		}
+		close_jobs = job->next;
+		if (!close_jobs)
+			close_jobs_tail = &close_jobs;
+		pthread_mutex_unlock(&close_lock);
+		if (job->bloom) {
+			bloom_write(job->dir_fd, job->bloom_path, job->bloom,
+				    job->bloom_bytes, job->size);
+			free(job->bloom);
+			close(job->dir_fd);
+		}
+		fclose(job->fp);
+		if (job->idx_fp)
+			fclose(job->idx_fp);
+		free(job);
+		pthread_mutex_lock(&close_lock);
+		if (!--close_pending)
+			pthread_cond_broadcast(&close_done);
+	}
+	return NULL;
+}
+
+/**
+ * wait_closer - Wait for the closer thread to close all log files.
+ *
+ * Returns nothing.
+ */
+static void wait_closer(void)
+{
+	pthread_mutex_lock(&close_lock);
+	while (close_pending)
+		pthread_cond_wait(&close_done, &close_lock);
+	pthread_mutex_unlock(&close_lock);
+	closing_day = 0;
+}
+
+/**
+ * close_later - Close a log file and its indexes in the background.
+ *
+ * @log: Pointer to "struct logfile".
+ *
+ * Returns nothing.
+ *
+ * At midnight, every client's log file is closed upon its first line, and
+ * flushing stdio buffers, saving filters and closing descriptors of all of
+ * them would stall receiving. The closer thread does it instead, and the
+ * log file is closed at once if the thread can't be used.
+ */
+static void close_later(struct logfile *log)
+{
+	struct close_job *job;
+	if (!closer_started) {
+		pthread_t thread;
+		sigset_t all;
+		sigset_t old;
+		/* Signals are for the main thread's signalfd. */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		if (!pthread_create(&thread, NULL, closer_main, NULL)) {
+			pthread_detach(thread);
+			closer_started = 1;
+		}
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+	job = closer_started ? malloc(sizeof(*job)) : NULL;
+	if (!job) {
+		close_logfile(log);
+		return;
+	}
+	bin_flush(log);
+	job->dir_fd = -1;
+	job->bloom = log->bloom;
+	if (job->bloom) {
+		job->dir_fd = fcntl(log->dir_fd, F_DUPFD_CLOEXEC, 0);
+		if (job->dir_fd == -1) {
+			free(job);
+			close_logfile(log);
+			return;
+		}
+		bloom_path(log, job->bloom_path);
+		job->bloom_bytes = bloom_bytes;
+		job->size = log->size;
+	}
+	job->fp = log->fp;
+	job->idx_fp = log->idx_fp;
+	job->next = NULL;
+	log->bloom = NULL;
+	log->fp = NULL;
+	log->idx_fp = NULL;
+	pthread_mutex_lock(&close_lock);
+	*close_jobs_tail = job;
+	close_jobs_tail = &job->next;
+	close_pending++;
+	pthread_cond_signal(&close_wake);
+	pthread_mutex_unlock(&close_lock);
+	if (log->day > closing_day)
+		closing_day = log->day;
+}
+
+/**
+ * open_dir - Open a log directory, creating it if needed.
+ *
+ * @dir: Pointer to "struct logdir".
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * The descriptor is kept, so that log files are opened by openat() without
+ * looking up the path or calling mkdir() again. A directory removed
+ * meanwhile, say by a cleanup job, is created again. Filters of log files
+ * removed with it are dropped, for they must not land in the new one.
+ */
+static int open_dir(struct logdir *dir)
+{
+	struct stat buf;
+	if (dir->fd != -1) {
+		if (!fstat(dir->fd, &buf) && buf.st_nlink)
+			return 0;
+		bloom_drop(&dir->log);
+		bloom_drop(&dir->next);
+		close_logfile(&dir->next);
+		close(dir->fd);
+	}
+	dir->fd = open(dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir->fd == -1) {
+		mkdir(dir->name, 0755);
+		dir->fd = open(dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	return dir->fd == -1 ? -1 : 0;
+}
+
+/**
+ * fopen_at - Open a file in a directory for appending.
+ *
+ * @dir_fd: Descriptor of the directory.
+ * @name:   Name of the file.
+ *
+ * Returns "FILE *" on success, NULL otherwise.
+ */
+static FILE *fopen_at(const int dir_fd, const char *name)
+{
+	FILE *fp;
+	const int fd = openat(dir_fd, name, O_WRONLY | O_APPEND | O_CREAT |
+			      O_CLOEXEC, 0666);
+	if (fd == -1)
+		return NULL;
+	fp = fdopen(fd, "a");
+	if (!fp)
+		close(fd);
+	return fp;
+}
+
+/**
+ * index_logfile - Record where lines stamped with given time start.
+ *
+ * @log:   Pointer to "struct logfile".
+ * @stamp: Time of the lines about to be written.
+ *
+ * Returns nothing.
+ *
+ * One record per second which has lines, in ascending order of time.
+ */
+static void index_logfile(struct logfile *log, const time_t stamp)
+{
+	struct index_record rec;
+	if (!log->idx_fp || stamp <= log->indexed)
+		return;
+	rec.time = stamp;
+	rec.offset = log->size;
+	fwrite(&rec, sizeof(rec), 1, log->idx_fp);
+	log->indexed = stamp;
+}
+
+/**
+ * open_logfile - Open a day's log file and its indexes.
+ *
+ * @dir:   Pointer to "struct logdir" whose descriptor is open.
+ * @log:   Pointer to "struct logfile" to store the log file, overwritten.
+ * @route: Name of the route @log is for, NULL for the client's log file.
+ * @tm:    Pointer to "struct tm" holding the date.
+ * @day:   Start of the date.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int open_logfile(struct logdir *dir, struct logfile *log,
+			const char *route, const struct tm *tm,
+			const time_t day)
+{
+	struct stat buf;
+	/* Name of the log file in @dir . */
+	char *name = log->path + strlen(dir->name) + 1;
+	/* Don't race with the closer thread on the same files. */
+	if (day <= closing_day)
+		wait_closer();
+	memset(log, 0, sizeof(*log));
+	log->tm = *tm;
+	log->day = day;
+	log->binary = log_format == FORMAT_BIN;
+	log->dir_fd = dir->fd;
+	snprintf(log->path, sizeof(log->path) - 1,
+		 "%s/%04u-%02u-%02u%s%s.%s", dir->name,
+		 tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+		 route ? "." : "", route ? route : "",
+		 log->binary ? "bin" : "log");
+	log->fp = fopen_at(dir->fd, name);
+	if (!log->fp)
+		return -1;
+	log->size = fstat(fileno(log->fp), &buf) ? 0 : buf.st_size;
+	/*
+	 * The indexes are optional. Lines are found by scanning instead.
+	 * Binary log files have times in block headers instead, and routes
+	 * are not searched by udplogger-query .
+	 */
+	if (!log->binary && !route) {
+		bloom_open(log);
+		strcpy(name + strlen(name) - 4, ".idx");
+		log->idx_fp = fopen_at(dir->fd, name);
+		strcpy(name + strlen(name) - 4, ".log");
+	}
+	return 0;
+}
+
+/**
+ * switch_logfile - Close yesterday's log file and open today's log file.
+ *
+ * @client: Pointer to "struct client".
+ * @log:    Pointer to "struct logfile" of @client to switch.
+ * @route:  Name of the route @log is for, NULL for the client's log file.
+ * @tm:     Pointer to "struct tm" holding current time.
+ * @day:    Start of @tm 's date.
+ *
+ * Returns nothing.
+ *
+ * If open() fails, the old log file is used until the next day.
+ */
+static void switch_logfile(struct client *client, struct logfile *log,
+			   const char *route, const struct tm *tm,
+			   const time_t day)
+{
+	struct logdir *dir = client->dir;
+	struct logfile old;
+	if (open_dir(dir)) {
+		log->tm = *tm;
+		log->day = day;
+		return;
+	}
+	old = *log;
+	/* Opened ahead for another day or format? */
+	if (!route && dir->next.fp && (dir->next.day != day ||
+	    dir->next.binary != (log_format == FORMAT_BIN)))
+		close_logfile(&dir->next);
+	if (!route && dir->next.fp) {
+		/* Opened ahead by preopen_logfiles(). */
+		*log = dir->next;
+		memset(&dir->next, 0, sizeof(dir->next));
+	} else if (open_logfile(dir, log, route, tm, day)) {
+		*log = old;
+		log->tm = *tm;
+		log->day = day;
+		return;
+	}
+	if (old.fp)
+		close_later(&old);
+}
+
+/* Seconds before midnight to start opening the next day's log files. */
+#define PREOPEN_AHEAD 60
+/* Max log files opened ahead per a call of preopen_logfiles(). */
+#define PREOPEN_BATCH 16
+/* Start of today and of tomorrow in local time, 0 if not known yet. */
+static time_t today = 0;
+static time_t tomorrow = 0;
+/* Tomorrow's log files have all been opened if equal to @tomorrow . */
+static time_t preopened = 0;
+
+/**
+ * day_start - Find when a day starts in local time.
+ *
+ * @tm:   Pointer to "struct tm" holding a date.
+ * @days: Days to add to the date.
+ *
+ * Returns the time.
+ */
+static time_t day_start(const struct tm *tm, const int days)
+{
+	struct tm t = { };
+	t.tm_year = tm->tm_year;
+	t.tm_mon = tm->tm_mon;
+	t.tm_mday = tm->tm_mday + days;
+	t.tm_isdst = -1;
+	return mktime(&t);
+}
+
+/**
+ * scan_newlines_generic - Find newlines using memchr().
+ *
+ * @buf:   Data to scan.
+ * @len:   Length of @buf .
+ * @base:  Offset of @buf in the client's buffer.
+ * @lines: Array to store @base + offset of each newline.
+ *
+ * Returns number of newlines found.
+ */
+static int scan_newlines_generic(const char *buf, const int len, const int base,
+				 int *lines)
+{
+	const char *cp = buf;
+	const char *end = buf + len;
+	int num = 0;
+	while ((cp = memchr(cp, '\n', end - cp)) != NULL) {
+		lines[num++] = base + (cp - buf);
+		cp++;
+	}
+	return num;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/**
+ * scan_newlines_sse2 - Find newlines 16 bytes at a time.
+ *
+ * See scan_newlines_generic() for parameters and return value.
+ */
+__attribute__((target("sse2")))
+static int scan_newlines_sse2(const char *buf, const int len, const int base,
+			      int *lines)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	int num = 0;
+	int i;
+	/* Skip 64 bytes at a time while there is no newline. */
+	for (i = 0; i + 64 <= len; i += 64) {
+		const __m128i *p = (const __m128i *) (buf + i);
+		const __m128i c0 = _mm_cmpeq_epi8(_mm_loadu_si128(p), nl);
+		const __m128i c1 = _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl);
+		const __m128i c2 = _mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl);
+		const __m128i c3 = _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl);
+		unsigned long long mask;
+		if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(c0, c1),
+						    _mm_or_si128(c2, c3))))
+			continue;
+		mask = (unsigned long long) _mm_movemask_epi8(c0) |
+			(unsigned long long) _mm_movemask_epi8(c1) << 16 |
+			(unsigned long long) _mm_movemask_epi8(c2) << 32 |
+			(unsigned long long) _mm_movemask_epi8(c3) << 48;
+		while (mask) {
+			lines[num++] = base + i + __builtin_ctzll(mask);
+			mask &= mask - 1;
+		}
+	}
+	for (; i + 16 <= len; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		while (mask) {
+			lines[num++] = base + i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return num + scan_newlines_generic(buf + i, len - i, base + i,
+					   lines + num);
+}
+
+/**
+ * scan_newlines_avx2 - Find newlines 32 bytes at a time.
+ *
+ * See scan_newlines_generic() for parameters and return value.
+ */
+__attribute__((target("avx2")))
+static int scan_newlines_avx2(const char *buf, const int len, const int base,
+			      int *lines)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	int num = 0;
+	int i;
+	/* Skip 128 bytes at a time while there is no newline. */
+	for (i = 0; i + 128 <= len; i += 128) {
+		const __m256i *p = (const __m256i *) (buf + i);
+		const __m256i c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(p), nl);
+		const __m256i c1 =
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), nl);
+		const __m256i c2 =
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 2), nl);
+		const __m256i c3 =
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 3), nl);
+		unsigned long long mask;
+		if (_mm256_testz_si256(_mm256_or_si256(c0, c1),
+				       _mm256_or_si256(c0, c1)) &&
+		    _mm256_testz_si256(_mm256_or_si256(c2, c3),
+				       _mm256_or_si256(c2, c3)))
+			continue;
+		mask = (unsigned int) _mm256_movemask_epi8(c0) |
+			(unsigned long long) (unsigned int)
+			_mm256_movemask_epi8(c1) << 32;
+		while (mask) {
+			lines[num++] = base + i + __builtin_ctzll(mask);
+			mask &= mask - 1;
+		}
+		mask = (unsigned int) _mm256_movemask_epi8(c2) |
+			(unsigned long long) (unsigned int)
+			_mm256_movemask_epi8(c3) << 32;
+		while (mask) {
+			lines[num++] = base + i + 64 + __builtin_ctzll(mask);
+			mask &= mask - 1;
+		}
+	}
+	for (; i + 32 <= len; i += 32) {
+		const __m256i v =
+			_mm256_loadu_si256((const __m256i *) (buf + i));
+		unsigned int mask =
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		while (mask) {
+			lines[num++] = base + i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return num + scan_newlines_generic(buf + i, len - i, base + i,
+					   lines + num);
+}
+#endif
+
+static int scan_newlines_init(const char *buf, const int len, const int base,
+			      int *lines);
+
+/* Newline scanner chosen for this CPU. */
+static int (*scan_newlines)(const char *buf, const int len, const int base,
+			    int *lines) = scan_newlines_init;
+
+/**
+ * scan_newlines_init - Choose the newline scanner upon the first call.
+ *
+ * See scan_newlines_generic() for parameters and return value.
+ */
+static int scan_newlines_init(const char *buf, const int len, const int base,
+			      int *lines)
+{
+	scan_newlines = scan_newlines_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan_newlines = scan_newlines_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan_newlines = scan_newlines_sse2;
+#endif
+	return scan_newlines(buf, len, base, lines);
+}
+
+/**
+ * token_mask_generic - Find token characters in 64 bytes.
+ *
+ * @buf: Pointer to 64 bytes.
+ *
+ * Returns a mask with bit n set if @buf[n] is a token character.
+ */
+static unsigned long long token_mask_generic(const char *buf)
+{
+	unsigned long long mask = 0;
+	int i;
+	for (i = 0; i < 64; i++)
+		mask |= (unsigned long long) bloom_token_char(buf[i]) << i;
+	return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * token_mask_sse2 - Find token characters 16 bytes at a time.
+ *
+ * See token_mask_generic() for parameters and return value.
+ */
+__attribute__((target("sse2")))
+static unsigned long long token_mask_sse2(const char *buf)
+{
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i before_a = _mm_set1_epi8('a' - 1);
+	const __m128i after_z = _mm_set1_epi8('z' + 1);
+	const __m128i before_0 = _mm_set1_epi8('0' - 1);
+	const __m128i after_9 = _mm_set1_epi8('9' + 1);
+	const __m128i under = _mm_set1_epi8('_');
+	unsigned long long mask = 0;
+	int i;
+	for (i = 0; i < 64; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		const __m128i l = _mm_or_si128(v, lower);
+		/* Bytes >= 0x80 are negative. */
+		__m128i t = _mm_cmplt_epi8(v, _mm_setzero_si128());
+		t = _mm_or_si128(t, _mm_and_si128(_mm_cmpgt_epi8(l, before_a),
+						  _mm_cmplt_epi8(l, after_z)));
+		t = _mm_or_si128(t, _mm_and_si128(_mm_cmpgt_epi8(v, before_0),
+						  _mm_cmplt_epi8(v, after_9)));
+		t = _mm_or_si128(t, _mm_cmpeq_epi8(v, under));
+		mask |= (unsigned long long) _mm_movemask_epi8(t) << i;
+	}
+	return mask;
+}
+#endif
+
+static unsigned long long token_mask_init(const char *buf);
+
+/* Token character finder chosen for this CPU. */
+static unsigned long long (*token_mask)(const char *buf) = token_mask_init;
+
+/**
+ * token_mask_init - Choose the token character finder upon the first call.
+ *
+ * See token_mask_generic() for parameters and return value.
+ */
+static unsigned long long token_mask_init(const char *buf)
+{
+	token_mask = token_mask_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		token_mask = token_mask_sse2;
+#endif
+	return token_mask(buf);
+}
+
+/**
+ * bloom_set - Add one token to a log file's token filter.
+ *
+ * @log:   Pointer to "struct logfile".
+ * @token: Token.
+ * @len:   Length of @token .
+ *
+ * Returns nothing.
+ */
+static inline void bloom_set(struct logfile *log, const char *token,
+			     const int len)
+{
+	const uint32_t bits = bloom_bytes * 8;
+	const uint64_t hash = bloom_hash(token, len);
+	uint32_t i;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		const uint32_t bit = bloom_bit(hash, i, bits);
+		log->bloom[bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+/**
+ * bloom_add - Add tokens in written lines to a log file's token filter.
+ *
+ * @log:  Pointer to "struct logfile".
+ * @data: Text of lines, separated by newlines.
+ * @len:  Length of @data .
+ *
+ * Returns nothing.
+ *
+ * Token characters are found 64 bytes at a time, and runs of them are
+ * walked with bit operations on the mask rather than byte by byte.
+ */
+static void bloom_add(struct logfile *log, const char *data, const int len)
+{
+	int start = -1; /* Start of the current token, -1 if none. */
+	int base;
+	for (base = 0; base < len; base += 64) {
+		unsigned long long mask;
+		int pos = 0;
+		if (base + 64 <= len) {
+			mask = token_mask(data + base);
+		} else {
+			/* NUL bytes after the end are not token characters. */
+			char tail[64] = { };
+			memcpy(tail, data + base, len - base);
+			mask = token_mask(tail);
+		}
+		while (pos < 64) {
+			const unsigned long long rest = start == -1 ?
+				mask >> pos : ~mask >> pos;
+			if (!rest)
+				break;
+			pos += __builtin_ctzll(rest);
+			if (start == -1) {
+				start = base + pos;
+				continue;
+			}
+			if (base + pos - start >= BLOOM_MIN_TOKEN)
+				bloom_set(log, data + start,
+					  base + pos - start);
+			start = -1;
+		}
+	}
+	if (start != -1 && len - start >= BLOOM_MIN_TOKEN)
+		bloom_set(log, data + start, len - start);
+}
+
+/* Output being built by write_logfile(). */
+static char out_buf[65536];
+/* Valid bytes in @out_buf . */
+static int out_len = 0;
+
+/**
+ * out_flush - Pass the built output to stdio.
+ *
+ * @log: Log file to write to.
+ *
+ * Returns nothing.
+ */
+static void out_flush(struct logfile *log)
+{
+	if (out_len)
+		log->size += fwrite(out_buf, 1, out_len, log->fp);
+	out_len = 0;
+}
+
+/**
+ * out_append - Append to the output being built.
+ *
+ * @log:  Log file to write to.
+ * @data: Data to append.
+ * @len:  Length of @data .
+ *
+ * Returns nothing.
+ */
+static inline void out_append(struct logfile *log, const char *data,
+			      const int len)
+{
+	/* Don't copy long lines twice. */
+	if (len >= sizeof(out_buf) / 4) {
+		out_flush(log);
+		log->size += fwrite(data, 1, len, log->fp);
+		return;
+	}
+	if (out_len + len > sizeof(out_buf))
+		out_flush(log);
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+}
+
+/*
+ * How each byte is written in a JSON string: 0 as is, 1 as "\u00XX",
+ * 2 as a two byte escape like "\t", and 3 to 5 as the lead byte of a UTF-8
+ * sequence of that many bytes minus 1. Invalid bytes are written as 1, which
+ * keeps their value.
+ */
+static const unsigned char json_class[256] = {
+	[0x00 ... 0x1f] = 1, ['\b'] = 2, ['\t'] = 2, ['\n'] = 2, ['\f'] = 2,
+	['\r'] = 2, ['"'] = 2, ['\\'] = 2, [0x7f] = 1, [0x80 ... 0xc1] = 1,
+	[0xc2 ... 0xdf] = 3, [0xe0 ... 0xef] = 4, [0xf0 ... 0xf4] = 5,
+	[0xf5 ... 0xff] = 1,
+};
+
+/**
+ * json_plain8 - Check whether 8 bytes need no escaping.
+ *
+ * @cp: Pointer to 8 bytes.
+ *
+ * Returns true if all of them are printable ASCII other than '"' and '\\'.
+ */
+static inline _Bool json_plain8(const char *cp)
+{
+	const unsigned long long ones = 0x0101010101010101ull;
+	const unsigned long long highs = 0x8080808080808080ull;
+	unsigned long long w;
+	unsigned long long q;
+	unsigned long long b;
+	unsigned long long d;
+	memcpy(&w, cp, 8);
+	/* Bytes below 0x20 or equal to '"', '\\' or 0x7f become zero. */
+	q = w ^ (ones * '"');
+	b = w ^ (ones * '\\');
+	d = w ^ (ones * 0x7f);
+	return !((w | ((w - ones * 0x20) & ~w) | ((q - ones) & ~q) |
+		  ((b - ones) & ~b) | ((d - ones) & ~d)) & highs);
+}
+
+/**
+ * json_string - Write text as the contents of a JSON string.
+ *
+ * @dst: Buffer with at least 6 * @len bytes of room.
+ * @src: Text.
+ * @len: Length of @src .
+ *
+ * Returns the number of bytes written.
+ *
+ * Runs of plain ASCII are copied 8 bytes at a time. Valid UTF-8 is copied
+ * as is, and other bytes are written as "\u00XX".
+ */
+static int json_string(char *dst, const char *src, const int len)
+{
+	static const char hex[16] = "0123456789abcdef";
+	const unsigned char *cp = (const unsigned char *) src;
+	const unsigned char *end = cp + len;
+	char *out = dst;
+	while (cp < end) {
+		unsigned char c;
+		int n;
+		if (end - cp >= 8 && json_plain8((const char *) cp)) {
+			do {
+				memcpy(out, cp, 8);
+				out += 8;
+				cp += 8;
+			} while (end - cp >= 8 &&
+				 json_plain8((const char *) cp));
+			continue;
+		}
+		c = *cp;
+		switch (json_class[c]) {
+		case 0:
+			*out++ = c;
+			cp++;
+			continue;
+		case 2:
+			*out++ = '\\';
+			*out++ = c == '\b' ? 'b' : c == '\t' ? 't' :
+				c == '\n' ? 'n' : c == '\f' ? 'f' :
+				c == '\r' ? 'r' : c;
+			cp++;
+			continue;
+		case 1:
+			goto escape;
+		}
+		/* Check continuation bytes and ranges excluded by RFC 3629. */
+		n = json_class[c] - 1;
+		if (end - cp < n || (cp[1] & 0xc0) != 0x80 ||
+		    (c == 0xe0 && cp[1] < 0xa0) ||
+		    (c == 0xed && cp[1] > 0x9f) ||
+		    (c == 0xf0 && cp[1] < 0x90) ||
+		    (c == 0xf4 && cp[1] > 0x8f) ||
+		    (n > 2 && (cp[2] & 0xc0) != 0x80) ||
+		    (n > 3 && (cp[3] & 0xc0) != 0x80))
+			goto escape;
+		memcpy(out, cp, n);
+		out += n;
+		cp += n;
+		continue;
+escape:
+		memcpy(out, "\\u00", 4);
+		out[4] = hex[c >> 4];
+		out[5] = hex[c & 15];
+		out += 6;
+		cp++;
+	}
+	return out - dst;
+}
+
+/**
+ * json_number - Write a number in decimal.
+ *
+ * @dst: Buffer with at least 20 bytes of room.
+ * @num: Number.
+ *
+ * Returns the number of bytes written.
+ */
+static int json_number(char *dst, unsigned long long num)
+{
+	char buf[20];
+	int i = sizeof(buf);
+	do {
+		buf[--i] = '0' + num % 10;
+		num /= 10;
+	} while (num);
+	memcpy(dst, buf + i, sizeof(buf) - i);
+	return sizeof(buf) - i;
+}
+
+/**
+ * parse_extended - Parse the header of an extended netconsole message.
+ *
+ * @text:  Text of a line.
+ * @len:   Length of @text .
+ * @field: Array to store level, sequence number and timestamp in usec.
+ *
+ * Returns the length of the header including ';', 0 if @text has none.
+ *
+ * Extended netconsole prefixes messages with "$prio,$seq,$usec,$flags;"
+ * where $flags may be followed by more ",$name=$value" fields.
+ */
+static int parse_extended(const char *text, const int len,
+			  unsigned long long *field)
+{
+	int i = 0;
+	int f;
+	for (f = 0; f < 3; f++) {
+		const int start = i;
+		field[f] = 0;
+		while (i < len && text[i] >= '0' && text[i] <= '9' &&
+		       i - start < 19)
+			field[f] = field[f] * 10 + text[i++] - '0';
+		if (i == start || i == len || text[i++] != ',')
+			return 0;
+	}
+	/* Syslog priority holds the facility above the level. */
+	field[0] &= 7;
+	while (i < len && text[i] != ';') {
+		if (text[i] == ' ' || text[i] == '\t')
+			return 0;
+		i++;
+	}
+	return i < len ? i + 1 : 0;
+}
+
+/**
+ * json_head - Build the beginning of records shared by lines of a client.
+ *
+ * @buf:   Buffer with at least 64 bytes of room.
+ * @stamp: "YYYY-MM-DD HH:MM:SS" of the lines.
+ * @addr:  Sender's "ip:port", which needs no escaping.
+ *
+ * Returns the number of bytes written.
+ *
+ * "time" comes first so that the stamp is at a fixed offset, which lets
+ * udplogger-query handle text lines and records alike.
+ */
+static int json_head(char *buf, const char *stamp, const char *addr)
+{
+	const int len = strlen(addr);
+	memcpy(buf, JSON_STAMP_PREFIX, sizeof(JSON_STAMP_PREFIX) - 1);
+	buf += sizeof(JSON_STAMP_PREFIX) - 1;
+	memcpy(buf, stamp, 19);
+	memcpy(buf + 19, "\",\"sender\":\"", 12);
+	memcpy(buf + 31, addr, len);
+	return sizeof(JSON_STAMP_PREFIX) - 1 + 31 + len;
+}
+
+/* Buffer for JSON records too large for @out_buf . */
+static char *json_buf = NULL;
+static int json_size = 0;
+
+/**
+ * out_json - Append one line as an NDJSON record.
+ *
+ * @log:      Log file to write to.
+ * @head:     Beginning of the record, from json_head().
+ * @head_len: Length of @head .
+ * @text:     Text of the line without the newline.
+ * @len:      Length of @text .
+ *
+ * Returns nothing.
+ *
+ * The record's tokens are added to the log file's token filter as written.
+ */
+static void out_json(struct logfile *log, const char *head,
+		     const int head_len, const char *text, int len)
+{
+	unsigned long long field[3];
+	const int header = parse_extended(text, len, field);
+	const int need = head_len + 128 + 6 * len;
+	char *dst;
+	int pos;
+	if (out_len + need > sizeof(out_buf))
+		out_flush(log);
+	if (need <= sizeof(out_buf)) {
+		dst = out_buf + out_len;
+	} else {
+		if (need > json_size) {
+			char *buf = realloc(json_buf, need);
+			if (!buf)
+				return;
+			json_buf = buf;
+			json_size = need;
+		}
+		dst = json_buf;
+	}
+	memcpy(dst, head, head_len);
+	pos = head_len;
+	if (header) {
+		memcpy(dst + pos, "\",\"level\":", 10);
+		pos += 10;
+		pos += json_number(dst + pos, field[0]);
+		memcpy(dst + pos, ",\"seq\":", 7);
+		pos += 7;
+		pos += json_number(dst + pos, field[1]);
+		memcpy(dst + pos, ",\"usec\":", 8);
+		pos += 8;
+		pos += json_number(dst + pos, field[2]);
+		memcpy(dst + pos, ",\"msg\":\"", 8);
+		pos += 8;
+		text += header;
+		len -= header;
+	} else {
+		memcpy(dst + pos, "\",\"msg\":\"", 9);
+		pos += 9;
+	}
+	pos += json_string(dst + pos, text, len);
+	memcpy(dst + pos, "\"}\n", 3);
+	pos += 3;
+	if (log->bloom)
+		bloom_add(log, dst, pos);
+	if (dst == json_buf)
+		log->size += fwrite(dst, 1, pos, log->fp);
+	else
+		out_len += pos;
+}
+
+/* Live tail subscriber. */
+struct subscriber {
+	int fd; /* Connected socket, -1 if unused. */
+	_Bool ready; /* True once the filter is received. */
+	in_addr_t net; /* Sender's network to deliver, in network byte order. */
+	in_addr_t mask; /* Netmask for @net, in network byte order. */
+	unsigned short port; /* Sender's port in network byte order, 0 if any. */
+	int req_len; /* Valid bytes in @req . */
+	char req[64]; /* Filter being received. */
+};
+
+/* Directory udplogger was started in, for resolving relative paths. */
+static int start_dir_fd = -1;
+/* Listener socket for live tail subscribers, -1 if disabled. */
+static int tail_fd = -1;
+/* Path of @tail_fd . */
+static char tail_path[sizeof(((struct sockaddr_un *) 0)->sun_path)] = { };
+/* Live tail subscribers. */
+static struct subscriber subscribers[MAX_SUBSCRIBERS];
+/* Number of subscribers which are ready. */
+static int num_subscribers = 0;
+/* Number of subscribers dropped for being slow. */
+static unsigned long long tail_dropped = 0;
+
+/**
+ * tail_close - Disconnect a subscriber.
+ *
+ * @sub: Pointer to "struct subscriber".
+ *
+ * Returns nothing.
+ */
+static void tail_close(struct subscriber *sub)
+{
+	if (sub->fd == -1)
+		return;
+	close(sub->fd);
+	if (sub->ready)
+		num_subscribers--;
+	sub->fd = -1;
+	sub->ready = 0;
+}
+
+/**
+ * tail_accept - Accept new subscribers.
+ *
+ * Returns nothing.
+ */
+static void tail_accept(void)
+{
+	int fd;
+	while ((fd = accept(tail_fd, NULL, NULL)) != -1) {
+		int i;
+		for (i = 0; i < MAX_SUBSCRIBERS; i++)
+			if (subscribers[i].fd == -1)
+				break;
+		if (i == MAX_SUBSCRIBERS ||
+		    fcntl(fd, F_SETFL, O_NONBLOCK) ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+			close(fd);
+			continue;
+		}
+		memset(&subscribers[i], 0, sizeof(subscribers[i]));
+		subscribers[i].fd = fd;
+	}
+}
+
+/**
+ * tail_parse_filter - Parse a subscriber's filter.
+ *
+ * @sub: Pointer to "struct subscriber" whose @req holds the filter.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * The filter is "all", "$ip", "$ip:$port" or "$ip/$prefix_len".
+ */
+static int tail_parse_filter(struct subscriber *sub)
+{
+	char *cp = sub->req;
+	char *sep;
+	struct in_addr in;
+	int bits = 32;
+	sub->net = 0;
+	sub->mask = 0;
+	sub->port = 0;
+	if (!*cp || !strcmp(cp, "all"))
+		return 0;
+	sep = strpbrk(cp, ":/");
+	if (sep) {
+		const int value = atoi(sep + 1);
+		if (*sep == ':') {
+			if (value <= 0 || value > 65535)
+				return -1;
+			sub->port = htons(value);
+		} else {
+			if (value < 0 || value > 32)
+				return -1;
+			bits = value;
+		}
+		*sep = '\0';
+	}
+	if (!inet_aton(cp, &in))
+		return -1;
+	sub->mask = bits ? htonl(0xFFFFFFFFu << (32 - bits)) : 0;
+	sub->net = in.s_addr & sub->mask;
+	return 0;
+}
+
+/**
+ * tail_read - Receive a subscriber's filter or notice disconnection.
+ *
+ * @sub: Pointer to "struct subscriber".
+ *
+ * Returns nothing.
+ *
+ * A subscriber sends one line holding the filter, and nothing after that.
+ */
+static void tail_read(struct subscriber *sub)
+{
+	char buf[64];
+	char *cp;
+	int len;
+	if (sub->ready) {
+		while ((len = read(sub->fd, buf, sizeof(buf))) > 0);
+		if (!len)
+			tail_close(sub);
+		return;
+	}
+	len = read(sub->fd, sub->req + sub->req_len,
+		   sizeof(sub->req) - 1 - sub->req_len);
+	if (len <= 0) {
+		if (!len)
+			tail_close(sub);
+		return;
+	}
+	sub->req_len += len;
+	sub->req[sub->req_len] = '\0';
+	cp = strchr(sub->req, '\n');
+	if (!cp) {
+		if (sub->req_len == sizeof(sub->req) - 1)
+			tail_close(sub);
+		return;
+	}
+	*cp = '\0';
+	if (cp > sub->req && cp[-1] == '\r')
+		cp[-1] = '\0';
+	if (tail_parse_filter(sub)) {
+		tail_close(sub);
+		return;
+	}
+	sub->ready = 1;
+	num_subscribers++;
+}
+
+/**
+ * tail_send - Send lines to subscribers.
+ *
+ * @targets: Indexes of subscribers in @subscribers .
+ * @num:     Number of elements in @targets .
+ * @iov:     Lines to send.
+ * @iovcnt:  Number of elements in @iov .
+ * @len:     Total bytes in @iov .
+ *
+ * Returns nothing.
+ *
+ * A subscriber which can't take all of them at once is disconnected rather
+ * than waited for, for receiving must not stall.
+ */
+static void tail_send(const int *targets, const int num, struct iovec *iov,
+		      const int iovcnt, const size_t len)
+{
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+	int i;
+	for (i = 0; i < num; i++) {
+		struct subscriber *sub = &subscribers[targets[i]];
+		if (sub->fd == -1)
+			continue;
+		if (sendmsg(sub->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+		    len) {
+			tail_dropped++;
+			tail_close(sub);
+		}
+	}
+}
+
+/* Max lines per sendmsg() to subscribers. */
+#define TAIL_BATCH 256
+
+/**
+ * tail_publish - Deliver written lines to matching subscribers.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @pos:        Offset of the first line in @ptr->buffer .
+ * @lines:      Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines:  Number of elements in @lines .
+ * @forced:     True if the partial line was written.
+ *
+ * Returns nothing.
+ *
+ * Lines are sent directly from @ptr->buffer without copying.
+ */
+static void tail_publish(struct client *ptr, char *prefix,
+			 const int prefix_len, int pos, const int *lines,
+			 const int num_lines, const _Bool forced)
+{
+	static char newline[] = "\n";
+	struct iovec iov[TAIL_BATCH * 2 + 1];
+	int targets[MAX_SUBSCRIBERS];
+	int num = 0;
+	size_t len = 0;
+	int iovcnt = 0;
+	int i;
+	for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+		const struct subscriber *sub = &subscribers[i];
+		if (sub->ready &&
+		    (ptr->addr.sin_addr.s_addr & sub->mask) == sub->net &&
+		    (!sub->port || sub->port == ptr->addr.sin_port))
+			targets[num++] = i;
+	}
+	if (!num)
+		return;
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] + 1 : ptr->avail;
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		iov[iovcnt].iov_base = prefix;
+		iov[iovcnt++].iov_len = prefix_len;
+		iov[iovcnt].iov_base = ptr->buffer + pos;
+		iov[iovcnt++].iov_len = end - pos;
+		len += prefix_len + end - pos;
+		if (i == num_lines) {
+			iov[iovcnt].iov_base = newline;
+			iov[iovcnt++].iov_len = 1;
+			len++;
+		}
+		pos = end;
+		if (iovcnt >= TAIL_BATCH * 2) {
+			tail_send(targets, num, iov, iovcnt, len);
+			iovcnt = 0;
+			len = 0;
+		}
+	}
+	if (iovcnt)
+		tail_send(targets, num, iov, iovcnt, len);
+}
+
+/* Bytes of lines waiting to be relayed in memory. */
+#define RELAY_BUF_SIZE (4 * 1048576)
+/* Max bytes of lines sent upstream at once. */
+#define RELAY_CHUNK 65536
+/* Max seconds between attempts to connect upstream. */
+#define RELAY_RETRY_MAX 30
+/* Magic at the beginning of the spool file. */
+#define SPOOL_MAGIC "udplogger-sp-v1"
+/* Max bytes sent from the spool before its read offset is saved. */
+#define SPOOL_MARK_BYTES 1048576
+
+/* Header of the spool file, followed by lines. */
+struct spool_header {
+	char magic[16]; /* SPOOL_MAGIC . */
+	long long read; /* Offset of the next byte to send. */
+};
+
+/* Offset of the first line in the spool file. */
+#define SPOOL_DATA ((off_t) sizeof(struct spool_header))
+
+/* Upstream collector's address, with @relay_addr_len == 0 if disabled. */
+static struct sockaddr_storage relay_addr;
+static socklen_t relay_addr_len = 0;
+/* Connection to upstream, -1 if not connected. */
+static int relay_fd = -1;
+/* True while connect() is in progress. */
+static _Bool relay_connecting = 0;
+/* Compress the stream to upstream? */
+static _Bool relay_compress = 0;
+/* State of compressing the stream for the current connection. */
+static z_stream relay_zs;
+static _Bool relay_zs_ready = 0;
+/* Lines waiting to be relayed, valid from @relay_head to @relay_len . */
+static char *relay_buf = NULL;
+static int relay_head = 0;
+static int relay_len = 0;
+/* Chunk being sent, unless sent directly from @relay_buf . */
+static char relay_wire[RELAY_CHUNK + RELAY_CHUNK / 64 + 64];
+/* Spooled lines being compressed into @relay_wire . */
+static char relay_spooled[RELAY_CHUNK];
+/* Bytes of the chunk being sent and bytes already sent. */
+static int relay_wire_len = 0;
+static int relay_wire_sent = 0;
+/* Bytes of lines in the chunk being sent. */
+static int relay_inflight = 0;
+/* True if the chunk being sent came from @spool_fd . */
+static _Bool relay_inflight_spool = 0;
+/* When to try connecting upstream next, and how long to wait after that. */
+static time_t relay_retry_at = 0;
+static int relay_retry_wait = 1;
+/* File keeping lines while upstream is unreachable, -1 if none. */
+static int spool_fd = -1;
+/* Path of @spool_fd . */
+static char spool_path[4096] = { };
+/* Offsets in @spool_fd of the next byte to send and of the end. */
+static off_t spool_read = 0;
+static off_t spool_size = 0;
+/* Read offset in the header of @spool_fd, and when it was written. */
+static off_t spool_marked = 0;
+static time_t spool_marked_at = 0;
+/* Offset in @spool_fd from which bytes take disk space. */
+static off_t spool_punched = 0;
+/* Max bytes in @spool_fd . */
+static unsigned long long spool_max = 1073741824;
+/* Bytes of lines sent and dropped. */
+static unsigned long long relay_sent = 0;
+static unsigned long long relay_dropped = 0;
+
+/**
+ * spool_punch - Free disk space of lines sent from the spool.
+ *
+ * Returns nothing.
+ *
+ * Only lines before the saved read offset are freed, so that the spool
+ * never resends holes. Nothing is freed if the file system can't punch
+ * holes; spool_compact() does then.
+ */
+static void spool_punch(void)
+{
+	if (spool_punched < spool_marked &&
+	    !fallocate(spool_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       spool_punched, spool_marked - spool_punched))
+		spool_punched = spool_marked;
+}
+
+/**
+ * spool_mark - Save the read offset in the spool's header.
+ *
+ * Returns nothing.
+ *
+ * Lines sent after the offset was last saved are sent again if udplogger
+ * is killed, at most SPOOL_MARK_BYTES or a second's worth.
+ */
+static void spool_mark(void)
+{
+	struct spool_header header = { SPOOL_MAGIC, spool_read };
+	if (spool_fd == -1 || spool_marked == spool_read)
+		return;
+	if (pwrite(spool_fd, &header, sizeof(header), 0) != sizeof(header))
+		return;
+	spool_marked = spool_read;
+	spool_punch();
+}
+
+/**
+ * spool_open - Take over the spool file left by a previous run.
+ *
+ * Returns 0 on success, -1 if @spool_fd is not a spool file.
+ *
+ * An empty file gets a header. Lines before the saved read offset were
+ * sent already.
+ */
+static int spool_open(void)
+{
+	struct spool_header header;
+	spool_size = lseek(spool_fd, 0, SEEK_END);
+	if (!spool_size) {
+		spool_read = spool_size = spool_punched = SPOOL_DATA;
+		spool_marked = 0;
+		spool_mark();
+		return spool_marked == SPOOL_DATA ? 0 : -1;
+	}
+	if (spool_size < SPOOL_DATA ||
+	    pread(spool_fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    strncmp(header.magic, SPOOL_MAGIC, sizeof(header.magic)))
+		return -1;
+	/* The file may have been truncated after the header was saved. */
+	spool_read = header.read < SPOOL_DATA ? SPOOL_DATA :
+		header.read > spool_size ? spool_size : header.read;
+	spool_marked = spool_read;
+	spool_punched = SPOOL_DATA;
+	spool_punch();
+	return 0;
+}
+
+/**
+ * spool_compact - Move unsent lines to a new spool file.
+ *
+ * Returns nothing.
+ *
+ * Used where holes can't be punched, so that sent lines don't take the
+ * space of new ones. The new file replaces the spool by rename(), so the
+ * spool is whole whenever udplogger is killed.
+ */
+static void spool_compact(void)
+{
+	struct spool_header header = { SPOOL_MAGIC, SPOOL_DATA };
+	char path[sizeof(spool_path) + 8];
+	off_t pos = spool_read;
+	int fd;
+	snprintf(path, sizeof(path), "%s.new", spool_path);
+	/* A relative spool= is relative to the directory started in. */
+	fd = openat(start_dir_fd, path, O_RDWR | O_CREAT | O_TRUNC |
+		    O_CLOEXEC, 0600);
+	if (fd == -1)
+		return;
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		goto out;
+	/* @relay_spooled is free once the chunk being sent is compressed. */
+	while (pos < spool_size) {
+		const int len = spool_size - pos < sizeof(relay_spooled) ?
+			spool_size - pos : sizeof(relay_spooled);
+		if (pread(spool_fd, relay_spooled, len, pos) != len ||
+		    pwrite(fd, relay_spooled, len,
+			   pos - spool_read + SPOOL_DATA) != len)
+			goto out;
+		pos += len;
+	}
+	if (fsync(fd) || renameat(start_dir_fd, path, start_dir_fd, spool_path))
+		goto out;
+	close(spool_fd);
+	spool_fd = fd;
+	/* The chunk being sent, if any, starts at the new @spool_read . */
+	spool_size -= spool_read - SPOOL_DATA;
+	spool_read = spool_marked = spool_punched = SPOOL_DATA;
+	return;
+out:
+	close(fd);
+	unlinkat(start_dir_fd, path, 0);
+}
+
+/**
+ * relay_spill - Move lines waiting in memory to the spool.
+ *
+ * Returns nothing.
+ *
+ * Lines which don't fit in the spool, or all of them if there is no spool,
+ * are dropped. Lines in the chunk being sent stay in memory. Lines sent
+ * from the spool don't count for @spool_max .
+ */
+static void relay_spill(void)
+{
+	const int keep = relay_inflight_spool ? 0 : relay_inflight;
+	const int bytes = relay_len - relay_head - keep;
+	if (bytes <= 0)
+		return;
+	if (spool_fd != -1 && spool_size - spool_punched + bytes > spool_max) {
+		spool_mark();
+		if (spool_size - spool_punched + bytes > spool_max &&
+		    spool_size - spool_read + bytes <= spool_max)
+			spool_compact();
+	}
+	if (spool_fd == -1 || spool_size - spool_punched + bytes > spool_max ||
+	    pwrite(spool_fd, relay_buf + relay_head + keep, bytes,
+		   spool_size) != bytes)
+		relay_dropped += bytes;
+	else
+		spool_size += bytes;
+	relay_len = relay_head + keep;
+}
+
+static void relay_send(void);
+
+/**
+ * relay_line - Queue one line for upstream.
+ *
+ * @prefix:     "stamp addr " of the line.
+ * @prefix_len: Length of @prefix .
+ * @data:       The line.
+ * @len:        Length of @data .
+ * @newline:    True if a newline should be appended to @data .
+ *
+ * Returns nothing.
+ */
+static void relay_line(const char *prefix, const int prefix_len,
+		       const char *data, const int len, const _Bool newline)
+{
+	const int bytes = prefix_len + len + newline;
+	if (relay_len + bytes > RELAY_BUF_SIZE && relay_head) {
+		/* relay_send() locates the chunk from @relay_head . */
+		memmove(relay_buf, relay_buf + relay_head,
+			relay_len - relay_head);
+		relay_len -= relay_head;
+		relay_head = 0;
+	}
+	if (relay_len + bytes > RELAY_BUF_SIZE && spool_fd != -1)
+		relay_spill();
+	/* Without the spool, the oldest lines are kept. */
+	if (relay_len + bytes > RELAY_BUF_SIZE) {
+		relay_dropped += bytes;
+		return;
+	}
+	memcpy(relay_buf + relay_len, prefix, prefix_len);
+	memcpy(relay_buf + relay_len + prefix_len, data, len);
+	relay_len += bytes;
+	if (newline)
+		relay_buf[relay_len - 1] = '\n';
+	/* Send in full chunks without waiting for the main loop. */
+	if (relay_len - relay_head >= RELAY_CHUNK &&
+	    relay_wire_sent == relay_wire_len)
+		relay_send();
+}
+
+/**
+ * relay_publish - Queue written lines for upstream.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @pos:        Offset of the first line in @ptr->buffer .
+ * @lines:      Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines:  Number of elements in @lines .
+ * @forced:     True if the partial line was written.
+ *
+ * Returns nothing.
+ */
+static void relay_publish(struct client *ptr, const char *prefix,
+			  const int prefix_len, int pos, const int *lines,
+			  const int num_lines, const _Bool forced)
+{
+	int i;
+	for (i = 0; i < num_lines; i++) {
+		const int end = lines[i] + 1;
+		relay_line(prefix, prefix_len, ptr->buffer + pos, end - pos, 0);
+		pos = end;
+	}
+	if (forced && pos < ptr->avail)
+		relay_line(prefix, prefix_len, ptr->buffer + pos,
+			   ptr->avail - pos, 1);
+}
+
+/**
+ * relay_fill - Prepare the next chunk to send upstream.
+ *
+ * Returns 0 if a chunk was prepared, -1 if nothing is waiting.
+ *
+ * Spooled lines are older than lines in memory, so they go first.
+ */
+static int relay_fill(void)
+{
+	const char *src;
+	int len;
+	if (spool_read < spool_size) {
+		len = spool_size - spool_read < RELAY_CHUNK ?
+			spool_size - spool_read : RELAY_CHUNK;
+		src = relay_compress ? relay_spooled : relay_wire;
+		if (pread(spool_fd, (char *) src, len, spool_read) != len)
+			return -1;
+		relay_inflight_spool = 1;
+	} else if (relay_len > relay_head) {
+		len = relay_len - relay_head < RELAY_CHUNK ?
+			relay_len - relay_head : RELAY_CHUNK;
+		src = relay_buf + relay_head;
+		relay_inflight_spool = 0;
+	} else {
+		return -1;
+	}
+	relay_inflight = len;
+	relay_wire_sent = 0;
+	if (!relay_compress) {
+		relay_wire_len = len;
+		return 0;
+	}
+	relay_zs.next_in = (Bytef *) src;
+	relay_zs.avail_in = len;
+	relay_zs.next_out = (Bytef *) relay_wire;
+	relay_zs.avail_out = sizeof(relay_wire);
+	deflate(&relay_zs, Z_SYNC_FLUSH);
+	relay_wire_len = sizeof(relay_wire) - relay_zs.avail_out;
+	return 0;
+}
+
+/**
+ * relay_complete - Forget the chunk which was sent upstream.
+ *
+ * Returns nothing.
+ */
+static void relay_complete(void)
+{
+	relay_sent += relay_inflight;
+	if (relay_inflight_spool) {
+		spool_read += relay_inflight;
+		if (spool_read == spool_size &&
+		    !ftruncate(spool_fd, SPOOL_DATA)) {
+			spool_read = spool_size = spool_punched = SPOOL_DATA;
+			spool_mark();
+		} else if (spool_read - spool_marked >= SPOOL_MARK_BYTES) {
+			spool_mark();
+		}
+	} else {
+		relay_head += relay_inflight;
+		if (relay_head == relay_len)
+			relay_head = relay_len = 0;
+	}
+	relay_inflight = 0;
+	relay_wire_len = relay_wire_sent = 0;
+}
+
+/**
+ * relay_disconnect - Close the connection to upstream.
+ *
+ * Returns nothing.
+ *
+ * Lines in the chunk being sent are kept, and sent again over the next
+ * connection, for upstream might not have received them.
+ */
+static void relay_disconnect(void)
+{
+	if (relay_fd == -1)
+		return;
+	close(relay_fd);
+	relay_fd = -1;
+	relay_connecting = 0;
+	relay_inflight = 0;
+	relay_wire_len = relay_wire_sent = 0;
+	relay_retry_at = time(NULL) + relay_retry_wait;
+	if (relay_retry_wait < RELAY_RETRY_MAX)
+		relay_retry_wait *= 2;
+}
+
+/**
+ * relay_send - Send waiting lines upstream without blocking.
+ *
+ * Returns nothing.
+ */
+static void relay_send(void)
+{
+	while (relay_fd != -1 && !relay_connecting) {
+		const char *wire;
+		int len;
+		if (relay_wire_sent == relay_wire_len) {
+			if (relay_inflight)
+				relay_complete();
+			if (relay_fill())
+				return;
+		}
+		wire = relay_compress || relay_inflight_spool ? relay_wire :
+			relay_buf + relay_head;
+		len = send(relay_fd, wire + relay_wire_sent,
+			   relay_wire_len - relay_wire_sent,
+			   MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (len > 0)
+			relay_wire_sent += len;
+		else if (len == -1 && errno == EAGAIN)
+			return;
+		else
+			relay_disconnect();
+	}
+}
+
+/**
+ * relay_connect - Start connecting upstream.
+ *
+ * Returns nothing.
+ */
+static void relay_connect(void)
+{
+	relay_fd = socket(relay_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+			  SOCK_CLOEXEC, 0);
+	if (relay_fd == -1) {
+		relay_retry_at = time(NULL) + RELAY_RETRY_MAX;
+		return;
+	}
+	relay_connecting = 1;
+	if (connect(relay_fd, (struct sockaddr *) &relay_addr,
+		    relay_addr_len) && errno != EINPROGRESS) {
+		relay_disconnect();
+		return;
+	}
+	/* A new connection starts a new compressed stream. */
+	if (relay_compress) {
+		if (relay_zs_ready)
+			deflateReset(&relay_zs);
+		else
+			relay_zs_ready = deflateInit(&relay_zs, 6) == Z_OK;
+		if (!relay_zs_ready)
+			relay_disconnect();
+	}
+}
+
+/**
+ * relay_events - Handle events on the connection to upstream.
+ *
+ * @revents: Events reported by poll().
+ *
+ * Returns nothing.
+ */
+static void relay_events(const short revents)
+{
+	char buf[256];
+	if (relay_connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+		int error = -1;
+		socklen_t size = sizeof(error);
+		if (getsockopt(relay_fd, SOL_SOCKET, SO_ERROR, &error, &size) ||
+		    error) {
+			relay_disconnect();
+			return;
+		}
+		relay_connecting = 0;
+		relay_retry_wait = 1;
+	}
+	/* Upstream doesn't talk. Reading tells that it closed. */
+	if (revents & (POLLIN | POLLERR | POLLHUP)) {
+		int len;
+		while ((len = recv(relay_fd, buf, sizeof(buf), MSG_DONTWAIT))
+		       > 0);
+		if (!len || errno != EAGAIN) {
+			relay_disconnect();
+			return;
+		}
+	}
+	relay_send();
+}
+
+/**
+ * relay_flush - Send lines upstream or spool them.
+ *
+ * @now: Current time.
+ *
+ * Returns nothing.
+ */
+static void relay_flush(const time_t now)
+{
+	if (!relay_addr_len)
+		return;
+	if (relay_fd == -1 && now >= relay_retry_at)
+		relay_connect();
+	if (relay_fd == -1 || relay_connecting) {
+		/* Without the spool, keep lines in memory as long as they fit. */
+		if (spool_fd != -1)
+			relay_spill();
+	} else
+		relay_send();
+	if (spool_marked != spool_read && spool_marked_at != now) {
+		spool_marked_at = now;
+		spool_mark();
+	}
+}
+
+/**
+ * relay_wait - Calculate how long poll() may sleep for reconnecting.
+ *
+ * @now: Current time.
+ *
+ * Returns milliseconds until the next attempt, -1 if not waiting.
+ */
+static int relay_wait(const time_t now)
+{
+	if (!relay_addr_len || relay_fd != -1)
+		return -1;
+	return relay_retry_at > now ? (relay_retry_at - now) * 1000 : 0;
+}
+
+/**
+ * relay_save - Keep unsent lines in the spool before exiting.
+ *
+ * Returns nothing.
+ */
+static void relay_save(void)
+{
+	if (!relay_addr_len)
+		return;
+	relay_send();
+	/* The chunk being sent might be received in part. */
+	relay_inflight = 0;
+	if (spool_fd != -1) {
+		relay_spill();
+		spool_mark();
+		fsync(spool_fd);
+	} else if (relay_len > relay_head) {
+		fprintf(stderr, "Lost %d bytes not relayed.\n",
+			relay_len - relay_head);
+	}
+}
+
+/* Max rules in a rules file. */
+#define MAX_RULES 256
+/* Max text= patterns in all rules, one bit each. */
+#define MAX_PATTERNS 64
+/* Max states of the automaton finding text= patterns. */
+#define MAX_STATES 4096
+/* Max routes. */
+#define MAX_ROUTES 32
+/* Destination of lines discarded by rules. */
+#define DEST_DROPPED 255
+/* What apply_rules() found. */
+#define RULES_DROPPED 1
+#define RULES_ROUTED 2
+#define LIMITS_TOLD 4
+#define URGENT_FOUND 8
+
+/* What to do with lines matching a rule. */
+enum rule_action {
+	RULE_KEEP, /* Write them to the log file. */
+	RULE_DROP, /* Discard them. */
+	RULE_SAMPLE, /* Keep one of every @sample lines. */
+	RULE_ROUTE, /* Write them to the route's log file instead. */
+};
+
+/* One rule, matching lines which meet all of its conditions. */
+struct rule {
+	enum rule_action action; /* What to do with matching lines. */
+	unsigned int sample; /* Lines per kept line for RULE_SAMPLE. */
+	int slot; /* Index in @sampled of "struct client" for RULE_SAMPLE. */
+	int route; /* Index in @names of "struct rules" for RULE_ROUTE. */
+	int min_level; /* Lowest netconsole level to match, -1 for any. */
+	int max_level; /* Highest netconsole level to match. */
+	in_addr_t net; /* Sender's network to match. */
+	in_addr_t mask; /* Netmask of @net, 0 for any. */
+	unsigned long long texts; /* Patterns any of which must appear. */
+	_Bool has_regex; /* Does @regex have to match? */
+	regex_t regex; /* Regular expression to match. */
+};
+
+/* Rules compiled from a rules file. */
+struct rules {
+	struct rule rule[MAX_RULES]; /* Rules, the first matching one wins. */
+	int num_rules; /* Number of elements in @rule . */
+	unsigned short (*delta)[256]; /* Next state by state and byte. */
+	unsigned long long *found; /* Patterns ending at each state. */
+	char names[MAX_ROUTES][16]; /* Names of routes. */
+	int num_routes; /* Number of elements in @names . */
+	int num_samples; /* Number of RULE_SAMPLE rules. */
+};
+
+/* Rules in effect, NULL if none. */
+static struct rules *rules = NULL;
+/*
+ * Where each line being written goes: 0 for the log file, 1 + index of a
+ * route or DEST_DROPPED.
+ */
+static unsigned char line_dest[65536 + 1];
+/* Offsets of newlines of lines left by the rules. */
+static int rule_lines[65536];
+/* Repeats and lines over rate= to tell before each line being written. */
+static unsigned int line_repeated[65536 + 1];
+static unsigned int line_suppressed[65536 + 1];
+/* Is each line being written urgent? */
+static _Bool line_urgent[65536 + 1];
+
+/**
+ * rules_word - Cut the next word of a rule.
+ *
+ * @cp: Pointer to the position in the line, advanced past the word.
+ *
+ * Returns the word, NULL at the end of the line.
+ *
+ * Parts of a word may be double-quoted to include spaces, with \" and \\
+ * standing for '"' and '\'. Other backslashes are kept for regex= .
+ */
+static char *rules_word(char **cp)
+{
+	char *src = *cp + strspn(*cp, " \t");
+	char *dst = src;
+	char *word = src;
+	_Bool quoted = 0;
+	if (!*src)
+		return NULL;
+	while (*src && (quoted || (*src != ' ' && *src != '\t'))) {
+		if (*src == '"') {
+			quoted = !quoted;
+			src++;
+		} else if (quoted && *src == '\\' &&
+			   (src[1] == '"' || src[1] == '\\')) {
+			*dst++ = src[1];
+			src += 2;
+		} else {
+			*dst++ = *src++;
+		}
+	}
+	if (*src)
+		src++;
+	*dst = '\0';
+	*cp = src;
+	return word;
+}
+
+/**
+ * rules_parse - Parse one rule.
+ *
+ * @r:        Pointer to "struct rules" to add to.
+ * @line:     The rule, which is modified.
+ * @patterns: Array of text= patterns found so far.
+ * @num:      Pointer to the number of elements in @patterns .
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int rules_parse(struct rules *r, char *line, char **patterns,
+		       int *num)
+{
+	struct rule *rule = &r->rule[r->num_rules];
+	char *word = rules_word(&line);
+	if (r->num_rules == MAX_RULES)
+		return -1;
+	/* Counted even if broken, for free_rules() to release it. */
+	r->num_rules++;
+	rule->min_level = -1;
+	if (!strcmp(word, "keep")) {
+		rule->action = RULE_KEEP;
+	} else if (!strcmp(word, "drop")) {
+		rule->action = RULE_DROP;
+	} else if (!strncmp(word, "sample=", 7)) {
+		char *cp;
+		const long sample = strtol(word + 7, &cp, 10);
+		rule->action = RULE_SAMPLE;
+		if (*cp || cp == word + 7 || sample < 1 || sample > UINT_MAX)
+			return -1;
+		rule->sample = sample;
+		rule->slot = r->num_samples++;
+	} else if (!strncmp(word, "route=", 6)) {
+		const char *name = word + 6;
+		const int len = strlen(name);
+		rule->action = RULE_ROUTE;
+		if (!len || len >= sizeof(r->names[0]) ||
+		    strspn(name, "abcdefghijklmnopqrstuvwxyz"
+			   "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != len)
+			return -1;
+		for (rule->route = 0; rule->route < r->num_routes;
+		     rule->route++)
+			if (!strcmp(r->names[rule->route], name))
+				break;
+		if (rule->route == r->num_routes) {
+			if (r->num_routes == MAX_ROUTES)
+				return -1;
+			strcpy(r->names[r->num_routes++], name);
+		}
+	} else {
+		return -1;
+	}
+	while ((word = rules_word(&line)) != NULL) {
+		if (!strncmp(word, "level=", 6)) {
+			char *cp;
+			rule->min_level = strtol(word + 6, &cp, 10);
+			rule->max_level = *cp == '-' ?
+				strtol(cp + 1, &cp, 10) : rule->min_level;
+			if (*cp || cp == word + 6 || rule->min_level < 0 ||
+			    rule->max_level > 7 ||
+			    rule->min_level > rule->max_level)
+				return -1;
+		} else if (!strncmp(word, "from=", 5)) {
+			char *cp = strchr(word + 5, '/');
+			int bits = 32;
+			if (cp) {
+				*cp++ = '\0';
+				bits = atoi(cp);
+				if (bits < 0 || bits > 32)
+					return -1;
+			}
+			if (!inet_aton(word + 5, (struct in_addr *) &rule->net))
+				return -1;
+			rule->mask = bits ? htonl(~0u << (32 - bits)) : 0;
+			rule->net &= rule->mask;
+		} else if (!strncmp(word, "text=", 5)) {
+			int i;
+			if (!word[5])
+				return -1;
+			/* The same pattern in many rules is found once. */
+			for (i = 0; i < *num; i++)
+				if (!strcmp(patterns[i], word + 5))
+					break;
+			if (i == *num) {
+				if (i == MAX_PATTERNS)
+					return -1;
+				patterns[i] = strdup(word + 5);
+				if (!patterns[i])
+					return -1;
+				(*num)++;
+			}
+			rule->texts |= 1ull << i;
+		} else if (!strncmp(word, "regex=", 6) && !rule->has_regex) {
+			if (regcomp(&rule->regex, word + 6,
+				    REG_EXTENDED | REG_NOSUB))
+				return -1;
+			rule->has_regex = 1;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * rules_build - Build the automaton finding text= patterns.
+ *
+ * @r:        Pointer to "struct rules".
+ * @patterns: Patterns, the bit of each being its index.
+ * @num:      Number of elements in @patterns .
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * This is an Aho-Corasick automaton with its failure links resolved into
+ * a table of next states, so a line is scanned once for all patterns with
+ * one lookup per byte.
+ */
+static int rules_build(struct rules *r, char **patterns, const int num)
+{
+	int (*next)[256] = NULL;
+	int *fail = NULL;
+	int *queue = NULL;
+	int states = 1;
+	int head = 0;
+	int tail = 0;
+	int ret = -1;
+	int i;
+	int c;
+	for (i = 0; i < num; i++)
+		states += strlen(patterns[i]);
+	if (!num)
+		return 0;
+	if (states > MAX_STATES)
+		return -1;
+	next = calloc(states, sizeof(*next));
+	fail = calloc(states, sizeof(*fail));
+	queue = calloc(states, sizeof(*queue));
+	r->found = calloc(states, sizeof(*r->found));
+	r->delta = calloc(states, sizeof(*r->delta));
+	if (!next || !fail || !queue || !r->found || !r->delta)
+		goto out;
+	/* A trie of the patterns. State 0 is the root. */
+	states = 1;
+	for (i = 0; i < num; i++) {
+		const unsigned char *cp = (unsigned char *) patterns[i];
+		int s = 0;
+		for (; *cp; cp++) {
+			if (!next[s][*cp])
+				next[s][*cp] = states++;
+			s = next[s][*cp];
+		}
+		r->found[s] |= 1ull << i;
+	}
+	/* Resolve failure links in breadth-first order. */
+	for (c = 0; c < 256; c++) {
+		r->delta[0][c] = next[0][c];
+		if (next[0][c])
+			queue[tail++] = next[0][c];
+	}
+	while (head < tail) {
+		const int s = queue[head++];
+		r->found[s] |= r->found[fail[s]];
+		for (c = 0; c < 256; c++) {
+			const int t = next[s][c];
+			if (t) {
+				fail[t] = r->delta[fail[s]][c];
+				r->delta[s][c] = t;
+				queue[tail++] = t;
+			} else {
+				r->delta[s][c] = r->delta[fail[s]][c];
+			}
+		}
+	}
+	ret = 0;
+out:
+	free(next);
+	free(fail);
+	free(queue);
+	return ret;
+}
+
+/**
+ * free_rules - Release compiled rules.
+ *
+ * @r: Pointer to "struct rules", may be NULL.
+ *
+ * Returns nothing.
+ */
+static void free_rules(struct rules *r)
+{
+	int i;
+	if (!r)
+		return;
+	for (i = 0; i < r->num_rules; i++)
+		if (r->rule[i].has_regex)
+			regfree(&r->rule[i].regex);
+	free(r->delta);
+	free(r->found);
+	free(r);
+}
+
+/**
+ * load_rules - Read and compile a rules file.
+ *
+ * @path: Path to the rules file.
+ *
+ * Returns pointer to "struct rules" on success, NULL otherwise.
+ *
+ * Each line holds one rule, "$action [$condition ...]". Empty lines and
+ * lines starting with '#' are ignored.
+ */
+static struct rules *load_rules(const char *path)
+{
+	char *patterns[MAX_PATTERNS];
+	struct rules *r = calloc(1, sizeof(*r));
+	char line[4200];
+	int num = 0;
+	int lineno = 0;
+	int ret = 0;
+	FILE *fp = fopen(path, "r");
+	if (!fp || !r) {
+		fprintf(stderr, "Can't open %s .\n", path);
+		goto out;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		char *cp = line + strspn(line, " \t");
+		cp[strcspn(cp, "\r\n")] = '\0';
+		lineno++;
+		if (!*cp || *cp == '#')
+			continue;
+		if (rules_parse(r, cp, patterns, &num)) {
+			fprintf(stderr, "Bad rule at %s:%d\n", path, lineno);
+			ret = -1;
+		}
+	}
+	if (!ret && rules_build(r, patterns, num)) {
+		fprintf(stderr, "Too many text= in %s .\n", path);
+		ret = -1;
+	}
+out:
+	if (fp)
+		fclose(fp);
+	while (num)
+		free(patterns[--num]);
+	if (!fp || ret) {
+		free_rules(r);
+		return NULL;
+	}
+	return r;
+}
+
+/**
+ * rules_scan - Find text= patterns in a line.
+ *
+ * @r:    Pointer to "struct rules".
+ * @text: Text to scan.
+ * @len:  Length of @text .
+ *
+ * Returns the patterns found, one bit each.
+ */
+static unsigned long long rules_scan(const struct rules *r, const char *text,
+				     const int len)
+{
+	const unsigned char *cp = (const unsigned char *) text;
+	const unsigned char *end = cp + len;
+	unsigned long long found = 0;
+	unsigned int s = 0;
+	while (cp < end) {
+		s = r->delta[s][*cp++];
+		found |= r->found[s];
+		/* Bytes starting no pattern are skipped without each lookup. */
+		while (!s && cp < end && !r->delta[0][*cp])
+			cp++;
+	}
+	return found;
+}
+
+/**
+ * rules_dest - Decide where a line goes.
+ *
+ * @ptr:  Pointer to "struct client" the line came from.
+ * @text: Text of the line without the newline.
+ * @len:  Length of @text .
+ *
+ * Returns 0 for the log file, 1 + index of a route or DEST_DROPPED.
+ *
+ * Conditions are checked from the cheapest, and text= patterns are found
+ * at most once per line. They and regex= see the message without the
+ * extended netconsole header, whose level is what level= matches. Lines
+ * without the header don't match level= .
+ */
+static int rules_dest(struct client *ptr, const char *text, int len)
+{
+	unsigned long long field[3];
+	unsigned long long found = 0;
+	_Bool scanned = 0;
+	const int header = parse_extended(text, len, field);
+	const int level = header ? field[0] : -1;
+	int i;
+	text += header;
+	len -= header;
+	for (i = 0; i < rules->num_rules; i++) {
+		struct rule *rule = &rules->rule[i];
+		if ((ptr->addr.sin_addr.s_addr & rule->mask) != rule->net)
+			continue;
+		if (rule->min_level != -1 && (level < rule->min_level ||
+					      level > rule->max_level))
+			continue;
+		if (rule->texts) {
+			if (!scanned) {
+				found = rules_scan(rules, text, len);
+				scanned = 1;
+			}
+			if (!(found & rule->texts))
+				continue;
+		}
+		if (rule->has_regex) {
+			regmatch_t match = { 0, len };
+			if (regexec(&rule->regex, text, 1, &match,
+				    REG_STARTEND))
+				continue;
+		}
+		switch (rule->action) {
+		case RULE_KEEP:
+			return 0;
+		case RULE_DROP:
+			return DEST_DROPPED;
+		case RULE_SAMPLE:
+			/* Senders are sampled apart, lest one decide for all. */
+			if (!ptr->sampled)
+				ptr->sampled = calloc(rules->num_samples,
+						      sizeof(*ptr->sampled));
+			if (!ptr->sampled)
+				return 0;
+			return ptr->sampled[rule->slot]++ % rule->sample ?
+				DEST_DROPPED : 0;
+		case RULE_ROUTE:
+			return 1 + rule->route;
+		}
+	}
+	return 0;
+}
+
+/**
+ * apply_rules - Decide where lines being written go.
+ *
+ * @ptr:       Pointer to "struct client".
+ * @lines:     Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines: Number of elements in @lines .
+ * @forced:    True if the partial line is being written.
+ *
+ * Returns RULES_DROPPED and/or RULES_ROUTED if any line is dropped or
+ * routed, 0 otherwise. Destinations are stored in @line_dest .
+ */
+static int apply_rules(struct client *ptr, const int *lines,
+		       const int num_lines, const _Bool forced)
+{
+	int found = 0;
+	int pos = 0;
+	int i;
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] : ptr->avail;
+		int dest;
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		dest = rules_dest(ptr, ptr->buffer + pos, end - pos);
+		line_dest[i] = dest;
+		if (dest == DEST_DROPPED) {
+			rules_dropped++;
+			found |= RULES_DROPPED;
+		} else if (dest) {
+			found |= RULES_ROUTED;
+		}
+		pos = end + 1;
+	}
+	return found;
+}
+
+/**
+ * remove_lines - Remove lines from a client's buffer.
+ *
+ * @ptr:       Pointer to "struct client".
+ * @lines:     Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines: Number of elements in @lines .
+ * @forced:    True if the partial line is being written.
+ * @min_dest:  Lines whose @line_dest is this or above are removed.
+ *
+ * Returns the number of lines left, whose newlines are in @rule_lines and
+ * whose destinations and markers are in @line_dest, @line_repeated and
+ * @line_suppressed . @lines may be @rule_lines .
+ *
+ * The partial line, if not being written, stays after the lines left.
+ */
+static int remove_lines(struct client *ptr, const int *lines,
+			const int num_lines, const _Bool forced,
+			const int min_dest)
+{
+	int kept = 0;
+	int out = 0;
+	int pos = 0;
+	int i;
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] + 1 : ptr->avail;
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		if (line_dest[i] >= min_dest) {
+			pos = end;
+			continue;
+		}
+		if (out != pos)
+			memmove(ptr->buffer + out, ptr->buffer + pos,
+				end - pos);
+		line_dest[kept] = line_dest[i];
+		line_repeated[kept] = line_repeated[i];
+		line_suppressed[kept] = line_suppressed[i];
+		line_urgent[kept] = line_urgent[i];
+		out += end - pos;
+		if (i < num_lines)
+			rule_lines[kept++] = out - 1;
+		pos = end;
+	}
+	if (out != pos)
+		memmove(ptr->buffer + out, ptr->buffer + pos,
+			ptr->avail - pos);
+	ptr->avail -= pos - out;
+	return kept;
+}
+
+/**
+ * route_line - Write a line to a route's log file.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @route:      Index of the route.
+ * @prefix:     "stamp addr " of the line.
+ * @prefix_len: Length of @prefix .
+ * @head:       Beginning of the record for format=json .
+ * @head_len:   Length of @head .
+ * @text:       Text of the line without the newline.
+ * @len:        Length of @text .
+ *
+ * Returns 0 on success, -1 if the route's log file can't be opened.
+ *
+ * Routes' log files are "$addr/$date.$route.log" (or ".bin") in the same
+ * format as the client's log file, and are opened upon the first line.
+ */
+static int route_line(struct client *ptr, const int route,
+		      const char *prefix, const int prefix_len,
+		      const char *head, const int head_len,
+		      const char *text, const int len)
+{
+	struct logdir *dir = ptr->dir;
+	struct logfile *log;
+	if (!dir->routes) {
+		dir->routes = calloc(rules->num_routes, sizeof(*dir->routes));
+		if (!dir->routes)
+			return -1;
+	}
+	log = &dir->routes[route];
+	if (log->day != dir->log.day || !log->fp ||
+	    log->binary != dir->log.binary) {
+		switch_logfile(ptr, log, rules->names[route], &dir->log.tm,
+			       dir->log.day);
+		if (!log->fp) {
+			log->day = 0;
+			return -1;
+		}
+	}
+	if (log->binary) {
+		bin_append(log, ptr->addr_str, ptr->stamp, text, len);
+		return 0;
+	}
+	if (log_format == FORMAT_JSON) {
+		out_json(log, head, head_len, text, len);
+	} else {
+		out_append(log, prefix, prefix_len);
+		out_append(log, text, len);
+		out_append(log, "\n", 1);
+	}
+	out_flush(log);
+	return 0;
+}
+
+/**
+ * route_lines - Write routed lines to routes' log files.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @head:       Beginning of records for format=json .
+ * @head_len:   Length of @head .
+ * @lines:      Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines:  Number of elements in @lines .
+ * @forced:     True if the partial line is being written.
+ *
+ * Returns nothing.
+ *
+ * Lines which couldn't be written are left to the client's log file.
+ */
+static void route_lines(struct client *ptr, const char *prefix,
+			const int prefix_len, const char *head,
+			const int head_len, const int *lines,
+			const int num_lines, const _Bool forced)
+{
+	int pos = 0;
+	int i;
+	/* Output being built belongs to the client's log file. */
+	out_flush(&ptr->dir->log);
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] : ptr->avail;
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		if (line_dest[i] && line_dest[i] != DEST_DROPPED) {
+			if (route_line(ptr, line_dest[i] - 1, prefix,
+				       prefix_len, head, head_len,
+				       ptr->buffer + pos, end - pos))
+				line_dest[i] = 0;
+			else
+				rules_routed++;
+		}
+		pos = end + 1;
+	}
+}
+
+/**
+ * close_routes - Close routes' log files in a directory.
+ *
+ * @dir: Pointer to "struct logdir".
+ *
+ * Returns nothing.
+ */
+static void close_routes(struct logdir *dir)
+{
+	int i;
+	if (!dir->routes)
+		return;
+	for (i = 0; i < rules->num_routes; i++)
+		close_logfile(&dir->routes[i]);
+	free(dir->routes);
+	dir->routes = NULL;
+}
+
+/**
+ * publish_lines - Deliver lines to live tail subscribers and upstream.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @pos:        Offset of the first line in @ptr->buffer .
+ * @lines:      Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines:  Number of elements in @lines .
+ * @forced:     True if the partial line is being written.
+ *
+ * Returns nothing.
+ */
+static void publish_lines(struct client *ptr, char *prefix,
+			  const int prefix_len, const int pos,
+			  const int *lines, const int num_lines,
+			  const _Bool forced)
+{
+	if (num_subscribers)
+		tail_publish(ptr, prefix, prefix_len, pos, lines, num_lines,
+			     forced);
+	if (relay_addr_len)
+		relay_publish(ptr, prefix, prefix_len, pos, lines, num_lines,
+			      forced);
+}
+
+/* Max length of markers of panics and oopses. */
+#define URGENT_MARKER_MAX 32
+
+/**
+ * has_urgent_marker - Look for a marker of a panic or an oops in a line.
+ *
+ * @text: Text of the line.
+ * @len:  Length of @text .
+ *
+ * Returns true if found, false otherwise.
+ *
+ * All markers end with ':', so only lines with one are scanned, from where
+ * the longest marker could start.
+ */
+static _Bool has_urgent_marker(const char *text, const int len)
+{
+	static char *markers[] = {
+		"Kernel panic - not syncing:", "BUG:", "Oops:",
+		"general protection fault:"
+	};
+	static struct rules *r = NULL;
+	static _Bool built = 0;
+	const char *colon = memchr(text, ':', len);
+	const char *start;
+	if (!colon)
+		return 0;
+	if (!built) {
+		built = 1;
+		r = calloc(1, sizeof(*r));
+		if (r && rules_build(r, markers, sizeof(markers) /
+				     sizeof(markers[0]))) {
+			free_rules(r);
+			r = NULL;
+		}
+	}
+	if (!r)
+		return 0;
+	start = colon - text < URGENT_MARKER_MAX ? text :
+		colon - URGENT_MARKER_MAX;
+	return rules_scan(r, start, text + len - start) != 0;
+}
+
+/**
+ * find_urgent - Find lines to write through the priority lane.
+ *
+ * @ptr:       Pointer to "struct client".
+ * @lines:     Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines: Number of elements in @lines .
+ * @forced:    True if the partial line is being written.
+ *
+ * Returns URGENT_FOUND if any line is urgent, 0 otherwise. Urgent lines are
+ * marked in @line_urgent .
+ *
+ * A line is urgent if its extended netconsole level is @urgent_level or
+ * more severe, or if it has no level and holds a marker of a panic or an
+ * oops. Lines following one for URGENT_INTERVAL seconds are urgent too, so
+ * that the backtrace gets the same treatment.
+ */
+static int find_urgent(struct client *ptr, const int *lines,
+		       const int num_lines, const _Bool forced)
+{
+	const time_t now = ptr->stamp;
+	int found = 0;
+	int pos = 0;
+	int i;
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] : ptr->avail;
+		const char *text = ptr->buffer + pos;
+		unsigned long long field[3];
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		line_urgent[i] = now < ptr->urgent_until;
+		if (!line_urgent[i] &&
+		    (parse_extended(text, end - pos, field) ?
+		     field[0] <= urgent_level :
+		     has_urgent_marker(text, end - pos))) {
+			line_urgent[i] = 1;
+			ptr->urgent_until = now + URGENT_INTERVAL;
+		}
+		if (line_urgent[i]) {
+			lines_urgent++;
+			found = URGENT_FOUND;
+		}
+		pos = end + 1;
+	}
+	return found;
+}
+
+/**
+ * mirror_incidents - Write urgent lines to the incidents file.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @lines:      Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines:  Number of elements in @lines .
+ * @forced:     True if the partial line is being written.
+ *
+ * Returns nothing.
+ *
+ * Lines are written in the text format whatever format= is, and reach the
+ * disk before returning.
+ */
+static void mirror_incidents(struct client *ptr, char *prefix,
+			     const int prefix_len, const int *lines,
+			     const int num_lines, const _Bool forced)
+{
+	struct iovec iov[3];
+	int pos = 0;
+	int i;
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = prefix_len;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] : ptr->avail;
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		if (line_urgent[i]) {
+			iov[1].iov_base = ptr->buffer + pos;
+			iov[1].iov_len = end - pos;
+			if (writev(incidents_fd, iov, 3) == -1)
+				break;
+		}
+		pos = end + 1;
+	}
+	fdatasync(incidents_fd);
+}
+
+/**
+ * sync_urgent - Make a client's urgent lines reach the disk and upstream.
+ *
+ * @ptr: Pointer to "struct client".
+ *
+ * Returns nothing.
+ */
+static void sync_urgent(struct client *ptr)
+{
+	struct logdir *dir = ptr->dir;
+	int i;
+	if (dir->log.fp) {
+		flush_logfile(&dir->log);
+		fdatasync(fileno(dir->log.fp));
+	}
+	for (i = 0; dir->routes && i < rules->num_routes; i++)
+		if (dir->routes[i].fp) {
+			flush_logfile(&dir->routes[i]);
+			fdatasync(fileno(dir->routes[i].fp));
+		}
+	relay_flush(ptr->stamp);
+}
+
+/**
+ * apply_limits - Leave out repeated lines and lines over the rate limit.
+ *
+ * @ptr:       Pointer to "struct client".
+ * @lines:     Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines: Number of elements in @lines .
+ * @forced:    True if the partial line is being written.
+ *
+ * Returns RULES_DROPPED if any line is left out, and LIMITS_TOLD if any line
+ * is to be preceded by markers. Destinations of lines are updated in
+ * @line_dest and markers are stored in @line_repeated and @line_suppressed .
+ *
+ * Only lines going to the log file are limited, so routed lines are never
+ * lost, and urgent lines aren't limited either. A line is a repeat if it
+ * has the same hash as the last line written, ignoring the extended
+ * netconsole header, whose sequence number differs.
+ * A repeat is written after all once REPEAT_INTERVAL seconds passed, so that
+ * a loop doesn't go unnoticed until it ends.
+ */
+static int apply_limits(struct client *ptr, const int *lines,
+			const int num_lines, const _Bool forced)
+{
+	const time_t now = ptr->stamp;
+	int found = 0;
+	int pos = 0;
+	int i;
+	if (rate_limit && now > ptr->refilled) {
+		const unsigned long long tokens = ptr->tokens +
+			(unsigned long long) (now - ptr->refilled) * rate_limit;
+		ptr->tokens = tokens < rate_burst ? tokens : rate_burst;
+		ptr->refilled = now;
+	}
+	for (i = 0; i <= num_lines; i++) {
+		const int end = i < num_lines ? lines[i] : ptr->avail;
+		unsigned long long hash = 0;
+		_Bool urgent;
+		if (i == num_lines && (!forced || pos == end))
+			break;
+		line_repeated[i] = 0;
+		line_suppressed[i] = 0;
+		if (!rules)
+			line_dest[i] = 0;
+		if (line_dest[i])
+			goto next;
+		urgent = urgent_level >= 0 && line_urgent[i];
+		if (dedup_lines) {
+			unsigned long long field[3];
+			const char *text = ptr->buffer + pos;
+			const int header = parse_extended(text, end - pos,
+							  field);
+			hash = bloom_hash(text + header, end - pos - header);
+			if (!urgent && hash == ptr->last_hash &&
+			    now - ptr->last_written < REPEAT_INTERVAL) {
+				ptr->repeated++;
+				lines_repeated++;
+				line_dest[i] = DEST_DROPPED;
+				found |= RULES_DROPPED;
+				goto next;
+			}
+		}
+		if (rate_limit && !urgent) {
+			if (!ptr->tokens) {
+				ptr->suppressed++;
+				lines_suppressed++;
+				line_dest[i] = DEST_DROPPED;
+				found |= RULES_DROPPED;
+				goto next;
+			}
+			ptr->tokens--;
+		}
+		if (ptr->repeated || ptr->suppressed) {
+			line_repeated[i] = ptr->repeated;
+			line_suppressed[i] = ptr->suppressed;
+			ptr->repeated = 0;
+			ptr->suppressed = 0;
+			found |= LIMITS_TOLD;
+		}
+		ptr->last_hash = hash;
+		ptr->last_written = now;
+next:
+		pos = end + 1;
+	}
+	return found;
+}
+
+/**
+ * write_marker - Write a line telling that something is missing.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @head:       Beginning of records for format=json .
+ * @head_len:   Length of @head .
+ * @msg:        The line, ending with a newline.
+ * @len:        Length of @msg .
+ *
+ * Returns nothing.
+ */
+static void write_marker(struct client *ptr, const char *prefix,
+			 const int prefix_len, const char *head,
+			 const int head_len, const char *msg, const int len)
+{
+	if (log_files && log_format == FORMAT_BIN) {
+		bin_append(&ptr->dir->log, ptr->addr_str, ptr->stamp, msg,
+			   len - 1);
+	} else if (log_files && log_format == FORMAT_JSON) {
+		index_logfile(&ptr->dir->log, ptr->stamp);
+		out_json(&ptr->dir->log, head, head_len, msg, len - 1);
+	} else if (log_files) {
+		index_logfile(&ptr->dir->log, ptr->stamp);
+		out_append(&ptr->dir->log, prefix, prefix_len);
+		out_append(&ptr->dir->log, msg, len);
+		if (ptr->dir->log.bloom)
+			bloom_add(&ptr->dir->log, msg, len);
+	}
+	if (relay_addr_len)
+		relay_line(prefix, prefix_len, msg, len, 0);
+}
+
+/**
+ * write_lines - Write lines to the log file and deliver them.
+ *
+ * @ptr:        Pointer to "struct client".
+ * @prefix:     "stamp addr " of the lines.
+ * @prefix_len: Length of @prefix .
+ * @head:       Beginning of records for format=json .
+ * @head_len:   Length of @head .
+ * @pos:        Offset of the first line in @ptr->buffer .
+ * @lines:      Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines:  Number of elements in @lines .
+ * @forced:     True if the partial line should be written.
+ * @repeated:   Repeats of the last line left out before the lines.
+ * @suppressed: Lines over the rate limit left out before the lines.
+ * @published:  True if the lines were already delivered.
+ *
+ * Returns the offset following the lines written.
+ */
+static int write_lines(struct client *ptr, char *prefix,
+		       const int prefix_len, const char *head,
+		       const int head_len, int pos, const int *lines,
+		       const int num_lines, const _Bool forced,
+		       const unsigned int repeated,
+		       const unsigned int suppressed, const _Bool published)
+{
+	const time_t now_time = ptr->stamp;
+	const int start = pos;
+	char msg[80];
+	int i;
+	/* Tell that something is missing before the lines. */
+	if (ptr->dropped) {
+		i = snprintf(msg, sizeof(msg), "[dropped %u bytes due to "
+			     "memory pressure]\n", ptr->dropped);
+		write_marker(ptr, prefix, prefix_len, head, head_len, msg, i);
+		ptr->dropped = 0;
+	}
+	if (repeated) {
+		i = snprintf(msg, sizeof(msg), "[last message repeated %u "
+			     "times]\n", repeated);
+		write_marker(ptr, prefix, prefix_len, head, head_len, msg, i);
+	}
+	if (suppressed) {
+		i = snprintf(msg, sizeof(msg), "[suppressed %u lines over "
+			     "rate limit]\n", suppressed);
+		write_marker(ptr, prefix, prefix_len, head, head_len, msg, i);
+	}
+	if (log_files && log_format == FORMAT_BIN) {
+		for (i = 0; i < num_lines; i++) {
+			bin_append(&ptr->dir->log, ptr->addr_str, now_time,
+				   ptr->buffer + pos, lines[i] - pos);
+			pos = lines[i] + 1;
+		}
+		if (forced && pos < ptr->avail) {
+			bin_append(&ptr->dir->log, ptr->addr_str, now_time,
+				   ptr->buffer + pos, ptr->avail - pos);
+			pos = ptr->avail;
+		}
+	} else if (log_files && log_format == FORMAT_JSON) {
+		index_logfile(&ptr->dir->log, now_time);
+		for (i = 0; i < num_lines; i++) {
+			out_json(&ptr->dir->log, head, head_len,
+				 ptr->buffer + pos, lines[i] - pos);
+			pos = lines[i] + 1;
+		}
+		if (forced && pos < ptr->avail) {
+			out_json(&ptr->dir->log, head, head_len,
+				 ptr->buffer + pos, ptr->avail - pos);
+			pos = ptr->avail;
+		}
+		out_flush(&ptr->dir->log);
+	} else if (log_files) {
+		index_logfile(&ptr->dir->log, now_time);
+		/* Write the completed lines. */
+		for (i = 0; i < num_lines; i++) {
+			const int end = lines[i] + 1;
+			out_append(&ptr->dir->log, prefix, prefix_len);
+			out_append(&ptr->dir->log, ptr->buffer + pos,
+				   end - pos);
+			pos = end;
+		}
+		/* Write the incomplete line if forced. */
+		if (forced && pos < ptr->avail) {
+			out_append(&ptr->dir->log, prefix, prefix_len);
+			out_append(&ptr->dir->log, ptr->buffer + pos,
+				   ptr->avail - pos);
+			out_append(&ptr->dir->log, "\n", 1);
+			pos = ptr->avail;
+		}
+		out_flush(&ptr->dir->log);
+		if (ptr->dir->log.bloom) {
+			bloom_add(&ptr->dir->log, ptr->buffer + start,
+				  pos - start);
+			/* The address is not in the path of an identity. */
+			if (ptr->dir->identity)
+				bloom_add(&ptr->dir->log, ptr->addr_str,
+					  strlen(ptr->addr_str));
+		}
+	} else {
+		pos = forced ? ptr->avail :
+			num_lines ? lines[num_lines - 1] + 1 : pos;
+	}
+	/* Deliver them to live tail subscribers and upstream. */
+	if (!published)
+		publish_lines(ptr, prefix, prefix_len, start, lines, num_lines,
+			      forced);
+	return pos;
+}
+
+static void rebind_dirs(void);
+
+/**
+ * write_logfile - Write to today's log file.
+ *
+ * @ptr:       Pointer to "struct client".
+ * @lines:     Offsets of newlines in @ptr->buffer, in ascending order.
+ * @num_lines: Number of elements in @lines .
+ * @forced:    True if the partial line should be written.
+ *
+ * Returns nothing.
+ *
+ * @ptr->buffer must not contain newlines other than those in @lines .
+ * If @ptr->buffer is empty, markers for lines left out by rate= and dedup=
+ * which weren't told yet are written.
+ */
+static void write_logfile(struct client *ptr, const int *lines,
+			  int num_lines, const _Bool forced)
+{
+	static time_t last_time = 0;
+	static struct tm last_tm = { };
+	static char stamp[24] = { };
+	char prefix[sizeof(stamp) + sizeof(ptr->addr_str) + 1];
+	char head[64];
+	int prefix_len;
+	int head_len = 0;
+	int found = 0;
+	_Bool published = 0;
+	int pos = 0;
+	int i;
+	const time_t now_time = ptr->stamp;
+	if (last_time != now_time) {
+		struct tm *tm = localtime(&now_time);
+		if (tm)
+			last_tm = *tm;
+		snprintf(stamp, sizeof(stamp) - 1, "%04u-%02u-%02u "
+			 "%02u:%02u:%02u ", last_tm.tm_year + 1900,
+			 last_tm.tm_mon + 1, last_tm.tm_mday, last_tm.tm_hour,
+			 last_tm.tm_min, last_tm.tm_sec);
+		last_time = now_time;
+		/*
+		 * Find the day's boundaries in local time once a day, so
+		 * that midnight is passed at 00:00:00 of the local time.
+		 */
+		if (now_time >= tomorrow || now_time < today) {
+			const _Bool new_day = tomorrow && now_time >= tomorrow;
+			/* Compact once a day, not upon every switch. */
+			if (now_time >= tomorrow)
+				try_drop_memory_usage = 1;
+			today = day_start(&last_tm, 0);
+			tomorrow = day_start(&last_tm, 1);
+			if (new_day)
+				rebind_dirs();
+		}
+	}
+	/*
+	 * Switch log file if the day has changed. This has to be checked
+	 * for each client because @today is shared by all clients.
+	 */
+	if (log_files && (ptr->dir->log.day != today || !ptr->dir->log.fp ||
+			  ptr->dir->log.binary != (log_format == FORMAT_BIN))) {
+		switch_logfile(ptr, &ptr->dir->log, NULL, &last_tm, today);
+		/* Discard the data if we can't open a log file at all. */
+		if (!ptr->dir->log.fp) {
+			ptr->dir->log.day = 0;
+			ptr->avail = 0;
+			put_buffer(ptr);
+			timer_del(ptr);
+			return;
+		}
+	}
+	/* Build "stamp addr " once for all lines. */
+	prefix_len = strlen(stamp);
+	memcpy(prefix, stamp, prefix_len);
+	i = strlen(ptr->addr_str);
+	memcpy(prefix + prefix_len, ptr->addr_str, i);
+	prefix_len += i;
+	prefix[prefix_len++] = ' ';
+	if (log_format == FORMAT_JSON)
+		head_len = json_head(head, stamp, ptr->addr_str);
+	/* Nothing comes after lines left out, so tell them now. */
+	if (!ptr->avail) {
+		pos = write_lines(ptr, prefix, prefix_len, head, head_len, 0,
+				  NULL, 0, 0, ptr->repeated, ptr->suppressed,
+				  0);
+		ptr->repeated = 0;
+		ptr->suppressed = 0;
+		return;
+	}
+	/* Leave dropped lines out, and routed lines to their log files. */
+	if (urgent_level >= 0)
+		found = find_urgent(ptr, lines, num_lines, forced);
+	if (rules)
+		found |= apply_rules(ptr, lines, num_lines, forced);
+	if (rate_limit || dedup_lines)
+		found |= apply_limits(ptr, lines, num_lines, forced);
+	if (found & RULES_DROPPED) {
+		num_lines = remove_lines(ptr, lines, num_lines, forced,
+					 DEST_DROPPED);
+		lines = rule_lines;
+	}
+	if ((found & URGENT_FOUND) && incidents_fd != -1)
+		mirror_incidents(ptr, prefix, prefix_len, lines, num_lines,
+				 forced);
+	/* Routed lines are delivered as usual. */
+	if (found & RULES_ROUTED) {
+		publish_lines(ptr, prefix, prefix_len, 0, lines, num_lines,
+			      forced);
+		published = 1;
+	}
+	if ((found & RULES_ROUTED) && log_files) {
+		route_lines(ptr, prefix, prefix_len, head, head_len, lines,
+			    num_lines, forced);
+		num_lines = remove_lines(ptr, lines, num_lines, forced, 1);
+		lines = rule_lines;
+	}
+	if (!(found & LIMITS_TOLD)) {
+		pos = write_lines(ptr, prefix, prefix_len, head, head_len, 0,
+				  lines, num_lines, forced, 0, 0, published);
+	} else {
+		/* Write markers between the lines they follow. */
+		const int total = num_lines + (forced && ptr->avail >
+					       (num_lines ?
+						lines[num_lines - 1] + 1 : 0));
+		int first = 0;
+		while (first < total) {
+			int last = first + 1;
+			int num;
+			while (last < total && !line_repeated[last] &&
+			       !line_suppressed[last])
+				last++;
+			num = (last < num_lines ? last : num_lines) - first;
+			pos = write_lines(ptr, prefix, prefix_len, head,
+					  head_len, pos, lines + first, num,
+					  forced && last == total,
+					  line_repeated[first],
+					  line_suppressed[first], published);
+			first = last;
+		}
+	}
+	/* Urgent lines don't wait in stdio buffers or the page cache. */
+	if (found & URGENT_FOUND)
+		sync_urgent(ptr);
+	/* Discard the written data. */
+	ptr->avail -= pos;
+	if (!ptr->avail) {
+		put_buffer(ptr);
+		timer_del(ptr);
+	} else if (pos) {
+		memmove(ptr->buffer, ptr->buffer + pos, ptr->avail);
+	}
+}
+
+/**
+ * tell_limits - Write markers for lines left out which weren't told yet.
+ *
+ * @ptr: Pointer to "struct client" without partial line.
+ *
+ * Returns nothing.
+ */
+static void tell_limits(struct client *ptr)
+{
+	if (!ptr->repeated && !ptr->suppressed)
+		return;
+	ptr->stamp = ptr->last_seen;
+	write_logfile(ptr, NULL, 0, 1);
+}
+
+/**
+ * drop_memory_usage - Try to reduce memory usage.
+ *
+ * Returns nothing.
+ *
+ * Memory is returned to the OS in whole slabs and whole buffers rather than
+ * by moving records around.
+ */
+static void drop_memory_usage(void)
+{
+	struct client_slab *slab;
+	struct client *ptr;
+	if (!try_drop_memory_usage)
+		return;
+	try_drop_memory_usage = 0;
+	/* Shrink buffers holding a partial line much shorter than them. */
+	for_each_client(slab, ptr)
+		if (buffer_class(ptr->avail) < buffer_class(ptr->size))
+			get_buffer(ptr, ptr->avail);
+	release_slabs();
+	drain_buffer_pool();
+}
+
+/* One line of the names file. */
+struct name_entry {
+	in_addr_t net; /* Senders' network. */
+	in_addr_t mask; /* Netmask of @net . */
+	char name[IDENTITY_MAX + 1]; /* Identity of the senders. */
+};
+
+/* Identities read from a names file. */
+struct names {
+	struct name_entry *entry; /* Entries, the first matching one wins. */
+	int num; /* Number of elements in @entry . */
+};
+
+/* Identities in effect, NULL if none. */
+static struct names *names = NULL;
+/* Resolve identities by reverse DNS? */
+static _Bool resolve_names = 0;
+/* Number of threads calling getnameinfo(). */
+#define RESOLVER_THREADS 4
+/* Slots of the cache of resolved names (power of 2). */
+#define NAME_CACHE_SIZE 4096
+/* Seconds a resolved name is used before it is resolved again. */
+#define NAME_TTL 3600
+/* Seconds an address without name is used before it is resolved again. */
+#define NAME_RETRY 300
+/* Buckets of @logdir_hash (power of 2). */
+#define LOGDIR_HASH_SIZE 4096
+
+/* A resolved name in @name_cache . */
+struct cached_name {
+	in_addr_t addr; /* Address the name is for. */
+	time_t expires; /* Time to resolve again, 0 if the slot is empty. */
+	_Bool pending; /* Being resolved? */
+	char name[IDENTITY_MAX + 1]; /* The name, "" if there is none. */
+};
+
+/* Result of resolving an address, passed by a pipe. */
+struct resolved_name {
+	in_addr_t addr; /* Address resolved. */
+	char name[IDENTITY_MAX + 1]; /* Its name, "" if none. */
+};
+
+/* Resolved names, indexed by a hash of the address. */
+static struct cached_name name_cache[NAME_CACHE_SIZE];
+/* Pipes passing addresses to resolver threads and names back. */
+static int resolver_pipe[2] = { -1, -1 };
+static int resolved_pipe[2] = { -1, -1 };
+/* Directories with clients, by name. */
+static struct logdir *logdir_hash[LOGDIR_HASH_SIZE];
+
+/**
+ * valid_identity - Check that a name can be used as a directory name.
+ *
+ * @name: Name to check.
+ *
+ * Returns true if valid, false otherwise.
+ *
+ * Letters, digits, '.', '-' and '_' are allowed, but not a leading '.'.
+ */
+static _Bool valid_identity(const char *name)
+{
+	const int len = strlen(name);
+	if (!len || len > IDENTITY_MAX || *name == '.')
+		return 0;
+	return strspn(name, "abcdefghijklmnopqrstuvwxyz"
+		      "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_") == len;
+}
+
+/**
+ * free_names - Release identities read from a names file.
+ *
+ * @n: Pointer to "struct names", may be NULL.
+ *
+ * Returns nothing.
+ */
+static void free_names(struct names *n)
+{
+	if (!n)
+		return;
+	free(n->entry);
+	free(n);
+}
+
+/**
+ * load_names - Read a names file.
+ *
+ * @path: Path to the names file.
+ *
+ * Returns pointer to "struct names" on success, NULL otherwise.
+ *
+ * Each line holds "$ip[/$prefix_len] $name" like /etc/hosts, whose aliases
+ * are ignored, and so are IPv6 addresses. Empty lines and lines starting
+ * with '#' are ignored.
+ */
+static struct names *load_names(const char *path)
+{
+	struct names *n = calloc(1, sizeof(*n));
+	char line[4200];
+	int lineno = 0;
+	int ret = 0;
+	FILE *fp = fopen(path, "r");
+	if (!fp || !n) {
+		fprintf(stderr, "Can't open %s .\n", path);
+		goto out;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct name_entry *entry;
+		char *addr = strtok(line, " \t\r\n");
+		char *name = strtok(NULL, " \t\r\n");
+		char *cp;
+		int bits = 32;
+		lineno++;
+		if (!addr || *addr == '#' || strchr(addr, ':'))
+			continue;
+		if (n->num % 256 == 0) {
+			entry = realloc(n->entry, sizeof(*entry) *
+					(n->num + 256));
+			if (!entry) {
+				ret = -1;
+				break;
+			}
+			n->entry = entry;
+		}
+		entry = &n->entry[n->num];
+		cp = strchr(addr, '/');
+		if (cp) {
+			*cp++ = '\0';
+			bits = atoi(cp);
+		}
+		if (bits < 0 || bits > 32 || !name || !valid_identity(name) ||
+		    !inet_aton(addr, (struct in_addr *) &entry->net)) {
+			fprintf(stderr, "Bad name at %s:%d\n", path, lineno);
+			ret = -1;
+			continue;
+		}
+		entry->mask = bits ? htonl(~0u << (32 - bits)) : 0;
+		entry->net &= entry->mask;
+		strcpy(entry->name, name);
+		n->num++;
+	}
+out:
+	if (fp)
+		fclose(fp);
+	if (!fp || ret) {
+		free_names(n);
+		return NULL;
+	}
+	return n;
+}
+
+/**
+ * resolver_main - Resolve addresses passed by the main thread.
+ *
+ * @unused: Unused.
+ *
+ * Returns NULL.
+ *
+ * getnameinfo() may block for seconds, so it is only called here. Names
+ * are lowercased, and names which can't be used as directory names are
+ * returned as "".
+ */
+static void *resolver_main(void *unused)
+{
+	struct in_addr addr;
+	while (read(resolver_pipe[0], &addr, sizeof(addr)) == sizeof(addr)) {
+		struct sockaddr_in sin = { .sin_family = AF_INET };
+		struct resolved_name result = { addr.s_addr };
+		char host[NI_MAXHOST];
+		char *cp;
+		sin.sin_addr = addr;
+		if (getnameinfo((struct sockaddr *) &sin, sizeof(sin), host,
+				sizeof(host), NULL, 0, NI_NAMEREQD))
+			*host = '\0';
+		for (cp = host; *cp; cp++)
+			if (*cp >= 'A' && *cp <= 'Z')
+				*cp += 'a' - 'A';
+		/* Drop the root's dot. */
+		if (cp > host && cp[-1] == '.')
+			cp[-1] = '\0';
+		if (valid_identity(host))
+			strcpy(result.name, host);
+		if (write(resolved_pipe[1], &result, sizeof(result)) !=
+		    sizeof(result))
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * start_resolver - Start threads resolving names.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * The main thread never waits for them. Addresses are dropped rather than
+ * passed while the pipe is full, and resolved names come back through
+ * another pipe polled by the main loop.
+ */
+static int start_resolver(void)
+{
+	sigset_t all;
+	sigset_t old;
+	int i;
+	if (resolved_pipe[0] != -1)
+		return 0;
+	if (pipe2(resolver_pipe, O_CLOEXEC))
+		return -1;
+	if (pipe2(resolved_pipe, O_CLOEXEC)) {
+		close(resolver_pipe[0]);
+		close(resolver_pipe[1]);
+		resolver_pipe[0] = resolver_pipe[1] = -1;
+		return -1;
+	}
+	fcntl(resolver_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(resolved_pipe[0], F_SETFL, O_NONBLOCK);
+	/* Signals are for the main thread's signalfd. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < RESOLVER_THREADS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, resolver_main, NULL))
+			break;
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* The pipes are kept even if no thread started. */
+	return i ? 0 : -1;
+}
+
+/**
+ * cached_name - Look up the cache of resolved names.
+ *
+ * @addr: Sender's address.
+ * @now:  Current time.
+ *
+ * Returns the name, "" if there is none, NULL if not known yet.
+ *
+ * An address not in the cache or expired is passed to resolver threads,
+ * and an expired name is used until the new one comes.
+ */
+static const char *cached_name(const struct in_addr addr, const time_t now)
+{
+	struct cached_name *slot = &name_cache[(ntohl(addr.s_addr) *
+						 2654435761u) %
+						NAME_CACHE_SIZE];
+	if (slot->expires && slot->addr != addr.s_addr)
+		memset(slot, 0, sizeof(*slot));
+	if (!slot->pending && (!slot->expires || now >= slot->expires) &&
+	    write(resolver_pipe[1], &addr, sizeof(addr)) == sizeof(addr)) {
+		slot->addr = addr.s_addr;
+		slot->pending = 1;
+		/* Stale names stay until resolved again. */
+		if (!slot->expires)
+			slot->expires = now;
+	}
+	return slot->pending && !*slot->name ? NULL : slot->name;
+}
+
+/**
+ * seed_name - Put a name taken over from the predecessor in the cache.
+ *
+ * @addr: Sender's address.
+ * @name: Name of the sender's directory.
+ *
+ * Returns nothing.
+ *
+ * The name is expired, so that it is resolved again upon the next use.
+ */
+static void seed_name(const struct in_addr addr, const char *name)
+{
+	struct cached_name *slot = &name_cache[(ntohl(addr.s_addr) *
+						 2654435761u) %
+						NAME_CACHE_SIZE];
+	if (slot->expires && slot->addr == addr.s_addr)
+		return;
+	memset(slot, 0, sizeof(*slot));
+	slot->addr = addr.s_addr;
+	slot->expires = 1;
+	strcpy(slot->name, name);
+}
+
+/**
+ * find_dir - Find a directory in use.
+ *
+ * @name: Name of the directory.
+ *
+ * Returns pointer to "struct logdir" if found, NULL otherwise.
+ */
+static struct logdir *find_dir(const char *name)
+{
+	struct logdir *dir = logdir_hash[bloom_hash(name, strlen(name)) &
+					 (LOGDIR_HASH_SIZE - 1)];
+	while (dir && strcmp(dir->name, name))
+		dir = dir->hash_next;
+	return dir;
+}
+
+/**
+ * client_identity - Decide the directory of a client's log files.
+ *
+ * @ptr:  Pointer to "struct client".
+ * @name: Buffer with IDENTITY_MAX + 1 bytes to store the name.
+ *
+ * Returns true if @name is an identity, false if it is "ip:port".
+ *
+ * A name from the names file comes first, then a name resolved by reverse
+ * DNS, then "ip" without the port, which changes upon every reboot.
+ *
+ * A day's lines are not split by a resolved name: a sender whose "ip"
+ * directory holds today's log file stays there until the next day, and
+ * a sender keeps its directory while its name is being resolved.
+ */
+static _Bool client_identity(const struct client *ptr, char *name)
+{
+	const in_addr_t addr = ptr->addr.sin_addr.s_addr;
+	int i;
+	for (i = 0; names && i < names->num; i++)
+		if ((addr & names->entry[i].mask) == names->entry[i].net) {
+			strcpy(name, names->entry[i].name);
+			return 1;
+		}
+	strcpy(name, inet_ntoa(ptr->addr.sin_addr));
+	if (resolve_names && resolved_pipe[0] != -1) {
+		const char *cp = cached_name(ptr->addr.sin_addr, time(NULL));
+		const struct logdir *dir = find_dir(name);
+		if (dir && dir->log.fp && dir->log.day == today)
+			return 1;
+		if (!cp && ptr->dir && ptr->dir->identity)
+			cp = ptr->dir->name;
+		if (cp && *cp)
+			strcpy(name, cp);
+		return 1;
+	}
+	if (names)
+		return 1;
+	strcpy(name, ptr->addr_str);
+	return 0;
+}
+
+/**
+ * put_dir - Stop using a directory's log files.
+ *
+ * @dir: Pointer to "struct logdir".
+ *
+ * Returns nothing.
+ *
+ * The log files are closed once no client uses them. Blocks being built
+ * are written, as the client's name they refer to goes away.
+ */
+static void put_dir(struct logdir *dir)
+{
+	struct logdir **prev;
+	int i;
+	if (--dir->refs) {
+		bin_flush(&dir->log);
+		for (i = 0; dir->routes && i < rules->num_routes; i++)
+			bin_flush(&dir->routes[i]);
+		return;
+	}
+	close_logfile(&dir->log);
+	close_logfile(&dir->next);
+	close_routes(dir);
+	if (dir->fd != -1)
+		close(dir->fd);
+	prev = &logdir_hash[bloom_hash(dir->name, strlen(dir->name)) &
+			    (LOGDIR_HASH_SIZE - 1)];
+	while (*prev != dir)
+		prev = &(*prev)->hash_next;
+	*prev = dir->hash_next;
+	free(dir);
+}
+
+/**
+ * use_dir - Attach a client to a directory.
+ *
+ * @ptr:      Pointer to "struct client".
+ * @name:     Name of the directory.
+ * @identity: True if @name is an identity, false if it is "ip:port".
+ *
+ * Returns 0 on success, -1 if out of memory.
+ *
+ * Clients with the same identity share a directory and its log files, so
+ * that a file is written by one stdio stream. Their lines keep "ip:port".
+ */
+static int use_dir(struct client *ptr, const char *name, const _Bool identity)
+{
+	struct logdir **bucket;
+	struct logdir *dir;
+	if (ptr->dir && !strcmp(ptr->dir->name, name))
+		return 0;
+	dir = find_dir(name);
+	if (!dir) {
+		bucket = &logdir_hash[bloom_hash(name, strlen(name)) &
+				      (LOGDIR_HASH_SIZE - 1)];
+		dir = calloc(1, sizeof(*dir));
+		if (!dir)
+			return -1;
+		snprintf(dir->name, sizeof(dir->name), "%s", name);
+		dir->identity = identity;
+		dir->fd = -1;
+		dir->hash_next = *bucket;
+		*bucket = dir;
+	}
+	dir->refs++;
+	if (ptr->dir)
+		put_dir(ptr->dir);
+	ptr->dir = dir;
+	return 0;
+}
+
+/**
+ * bind_dir - Attach a client to the directory of its identity.
+ *
+ * @ptr: Pointer to "struct client".
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int bind_dir(struct client *ptr)
+{
+	char name[IDENTITY_MAX + 1];
+	const _Bool identity = client_identity(ptr, name);
+	return use_dir(ptr, name, identity);
+}
+
+/**
+ * read_resolved - Take names resolved by resolver threads.
+ *
+ * Returns nothing.
+ *
+ * Clients from the address move to the directory of the name, unless
+ * their "ip" directory was written today; they move at midnight then.
+ */
+static void read_resolved(void)
+{
+	struct resolved_name result;
+	const time_t now = time(NULL);
+	while (read(resolved_pipe[0], &result, sizeof(result)) ==
+	       sizeof(result)) {
+		struct cached_name *slot;
+		struct client_slab *cs;
+		struct client *ptr;
+		slot = &name_cache[(ntohl(result.addr) * 2654435761u) %
+				   NAME_CACHE_SIZE];
+		slot->addr = result.addr;
+		slot->pending = 0;
+		slot->expires = now + (*result.name ? NAME_TTL : NAME_RETRY);
+		strcpy(slot->name, result.name);
+		for_each_client(cs, ptr)
+			if (ptr->addr.sin_addr.s_addr == result.addr)
+				bind_dir(ptr);
+	}
+}
+
+/**
+ * rebind_dirs - Move clients to the directories of their names at midnight.
+ *
+ * Returns nothing.
+ *
+ * Senders kept in "ip" directories yesterday move to the names resolved
+ * meanwhile, before today's log files are opened.
+ */
+static void rebind_dirs(void)
+{
+	struct client_slab *slab;
+	struct client *ptr;
+	if (!resolve_names)
+		return;
+	for_each_client(slab, ptr)
+		bind_dir(ptr);
+}
+
+/**
+ * preopen_wait - Calculate how long poll() may sleep for preopen_logfiles().
+ *
+ * @now: Current time.
+ *
+ * Returns milliseconds until log files are to be opened ahead, -1 if there
+ * is none to open.
+ */
+static int preopen_wait(const time_t now)
+{
+	long long msec;
+	if (!tomorrow || preopened == tomorrow || now >= tomorrow)
+		return -1;
+	msec = (tomorrow - PREOPEN_AHEAD - now) * 1000ll;
+	if (msec < 0)
+		return 0;
+	return msec > 1000000 ? 1000000 : msec;
+}
+
+/**
+ * preopen_logfiles - Open tomorrow's log files, a bounded number per call.
+ *
+ * @now: Current time.
+ *
+ * Returns nothing.
+ *
+ * In the last PREOPEN_AHEAD seconds of a day, tomorrow's log files of the
+ * directories written today are opened between batches of datagrams, so
+ * that at midnight clients swap to them instead of creating files. Those of
+ * senders which stay silent are left empty.
+ */
+static void preopen_logfiles(const time_t now)
+{
+	static unsigned int bucket = 0;
+	/* Day the scan at @bucket is for. */
+	static time_t scanning = 0;
+	const struct tm *next;
+	struct tm tm;
+	int budget = PREOPEN_BATCH;
+	if (preopen_wait(now))
+		return;
+	next = localtime(&tomorrow);
+	if (!next)
+		return;
+	tm = *next;
+	/* A scan cut off by midnight starts over for the new day. */
+	if (scanning != tomorrow) {
+		scanning = tomorrow;
+		bucket = 0;
+	}
+	for (; bucket < LOGDIR_HASH_SIZE && budget > 0; bucket++) {
+		struct logdir *dir;
+		for (dir = logdir_hash[bucket]; dir; dir = dir->hash_next) {
+			const struct cached_name *slot;
+			struct in_addr addr;
+			if (!dir->log.fp || dir->log.day != today ||
+			    dir->next.fp)
+				continue;
+			/* Senders named meanwhile leave at midnight. */
+			if (resolve_names && inet_aton(dir->name, &addr)) {
+				slot = &name_cache[(ntohl(addr.s_addr) *
+						    2654435761u) %
+						   NAME_CACHE_SIZE];
+				if (slot->addr == addr.s_addr && *slot->name)
+					continue;
+			}
+			if (open_dir(dir))
+				continue;
+			open_logfile(dir, &dir->next, NULL, &tm, tomorrow);
+			budget--;
+		}
+	}
+	if (bucket == LOGDIR_HASH_SIZE) {
+		bucket = 0;
+		preopened = tomorrow;
+	}
+}
+
+/**
+ * evict_client - Forget an idle client.
+ *
+ * @ptr: Pointer to "struct client" without partial line.
+ *
+ * Returns nothing.
+ */
+static void evict_client(struct client *ptr)
+{
+	struct client **prev = client_hash_bucket(&ptr->addr);
+	while (*prev != ptr)
+		prev = &(*prev)->hash_next;
+	*prev = ptr->hash_next;
+	tell_limits(ptr);
+	put_dir(ptr->dir);
+	free_client(ptr);
+}
+
+/**
+ * evict_clients - Evict idle clients, a bounded number per call.
+ *
+ * @now: Current time.
+ *
+ * Returns nothing.
+ *
+ * Clients idle for @idle_timeout seconds are evicted. Once the number of
+ * clients exceeds @high_pct percent of @max_clients, the least recently seen
+ * clients are evicted until it drops to @low_pct percent, so that the table
+ * is not emptied and refilled by every burst.
+ */
+static void evict_clients(const time_t now)
+{
+	static _Bool shrinking = 0;
+	struct client *ptr = lru_head;
+	int budget = EVICT_BATCH;
+	if (num_clients > max_clients * high_pct / 100)
+		shrinking = 1;
+	while (ptr && budget--) {
+		struct client *next = ptr->lru_next;
+		if (shrinking && num_clients <= max_clients * low_pct / 100) {
+			shrinking = 0;
+			try_drop_memory_usage = 1;
+		}
+		if (!shrinking && now - ptr->last_seen < idle_timeout)
+			break;
+		/*
+		 * Clients with a partial line are flushed by timeout first,
+		 * and queued datagrams are processed first.
+		 */
+		if (!ptr->avail && !ptr->queue_head) {
+			if (shrinking)
+				evicted_pressure++;
+			else
+				evicted_idle++;
+			evict_client(ptr);
+		}
+		ptr = next;
+	}
+}
+
+/**
+ * report_stats - Print counters if they changed, at most once per a minute.
+ *
+ * @now: Current time.
+ *
+ * Returns nothing.
+ */
+static void report_stats(const time_t now)
+{
+	static time_t last_report = 0;
+	static unsigned long long last_sum = 0;
+	const unsigned long long sum = evicted_idle + evicted_pressure +
+		forced_flushes + dropped_bytes + tail_dropped + relay_sent +
+		relay_dropped + rules_dropped + rules_routed + lines_repeated +
+		lines_suppressed + queued_bytes + lines_urgent;
+	if (sum == last_sum || now - last_report < 60)
+		return;
+	last_sum = sum;
+	last_report = now;
+	printf("Stats: clients=%d evicted_idle=%llu evicted_pressure=%llu "
+	       "mem_used=%llu forced_flushes=%llu dropped_bytes=%llu "
+	       "subscribers=%d tail_dropped=%llu relay_sent=%llu "
+	       "relay_backlog=%llu relay_dropped=%llu rules_dropped=%llu "
+	       "rules_routed=%llu repeated=%llu suppressed=%llu queued=%llu "
+	       "urgent=%llu\n",
+	       num_clients, evicted_idle, evicted_pressure, mem_used,
+	       forced_flushes, dropped_bytes, num_subscribers, tail_dropped,
+	       relay_sent, (unsigned long long) (relay_len - relay_head +
+						 spool_size - spool_read),
+	       relay_dropped, rules_dropped, rules_routed, lines_repeated,
+	       lines_suppressed, queued_bytes, lines_urgent);
+	fflush(stdout);
+}
+
+/**
+ * evict_wait - Calculate how long poll() may sleep for idle eviction.
+ *
+ * @now: Current time.
+ *
+ * Returns milliseconds until the least recently seen client becomes idle,
+ * -1 if there is no client.
+ */
+static int evict_wait(const time_t now)
+{
+	long long msec;
+	if (!lru_head)
+		return -1;
+	msec = (lru_head->last_seen + idle_timeout - now) * 1000ll;
+	if (msec < 0)
+		return 0;
+	return msec > 1000000 ? 1000000 : msec;
+}
+
+/**
+ * largest_partial_line - Find the client holding the longest partial line.
+ *
+ * Returns "struct client" on success, NULL if no partial line is pending.
+ */
+static struct client *largest_partial_line(void)
+{
+	struct client *largest = NULL;
+	int i;
+	for (i = 0; i < timer_count; i++)
+		if (!largest || timer_heap[i]->avail > largest->avail)
+			largest = timer_heap[i];
+	return largest;
+}
+
+/**
+ * grow_buffer - Make room for appending to the line within @mem_budget .
+ *
+ * @ptr: Pointer to "struct client".
+ * @len: Bytes to append.
+ *
+ * Returns 0 on success, -1 if the data has to be dropped.
+ *
+ * When the budget is exhausted, released buffers are returned to the OS
+ * first, and then the longest partial lines are force-written, which may
+ * include @ptr's own partial line. Senders holding the most memory are
+ * therefore the first to lose the benefit of line reassembly, and only if
+ * that is not enough their data is dropped.
+ */
+static int grow_buffer(struct client *ptr, const int len)
+{
+	while (ptr->avail + len > ptr->size &&
+	       get_buffer(ptr, ptr->avail + len)) {
+		struct client *victim;
+		if (buffer_pool_bytes()) {
+			drain_buffer_pool();
+			continue;
+		}
+		victim = largest_partial_line();
+		if (!victim)
+			return -1;
+		write_logfile(victim, NULL, 0, 1);
+		forced_flushes++;
+	}
+	return 0;
+}
+
+/**
+ * relieve_memory_pressure - Keep headroom below @mem_budget .
+ *
+ * Returns nothing.
+ *
+ * Once 7/8 of the budget is mapped, the longest partial lines are
+ * force-written, a bounded number per call, so that receive_data() rarely
+ * has to do so while handling a datagram.
+ */
+static void relieve_memory_pressure(void)
+{
+	int budget = 16;
+	if (mem_used <= mem_budget / 8 * 7)
+		return;
+	drain_buffer_pool();
+	while (mem_used > mem_budget / 8 * 7 && budget--) {
+		struct client *victim = largest_partial_line();
+		if (!victim)
+			break;
+		write_logfile(victim, NULL, 0, 1);
+		forced_flushes++;
+		drain_buffer_pool();
+	}
+}
+
+/**
+ * find_client - Find the structure for given address.
+ *
+ * @addr: Pointer to "struct sockaddr_in".
+ *
+ * Returns "struct client" for @addr on success, NULL otherwise.
+ */
+static struct client *find_client(struct sockaddr_in *addr)
+{
+	struct client **bucket;
+	struct client *ptr;
+	if (!client_hash) {
+		client_hash_size = 1;
+		while (client_hash_size < max_clients)
+			client_hash_size <<= 1;
+		client_hash = calloc(client_hash_size, sizeof(*client_hash));
+		if (!client_hash)
+			return NULL;
+	}
+	bucket = client_hash_bucket(addr);
+	for (ptr = *bucket; ptr; ptr = ptr->hash_next)
+		if (ptr->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    ptr->addr.sin_port == addr->sin_port)
+			return ptr;
+	if (num_clients >= max_clients) {
+		/* Make room by evicting the least recently seen idle client. */
+		int budget = EVICT_BATCH;
+		for (ptr = lru_head; ptr && budget--; ptr = ptr->lru_next)
+			if (!ptr->avail && !ptr->queue_head)
+				break;
+		if (!ptr || budget < 0)
+			return NULL;
+		evicted_pressure++;
+		evict_client(ptr);
+	}
+	ptr = alloc_client();
+	if (!ptr)
+		return NULL;
+	num_clients++;
+	ptr->addr = *addr;
+	snprintf(ptr->addr_str, sizeof(ptr->addr_str) - 1, "%s:%u",
+		 inet_ntoa(addr->sin_addr), htons(addr->sin_port));
+	if (bind_dir(ptr)) {
+		free_client(ptr);
+		return NULL;
+	}
+	ptr->hash_next = *bucket;
+	*bucket = ptr;
+	lru_add_tail(ptr);
+	return ptr;
+}
+
+/**
+ * receive_data - Append received data to the line and write completed lines.
+ *
+ * @ptr: Pointer to "struct client".
+ * @buf: Received data.
+ * @len: Length of @buf .
+ * @now: Time of receiving @buf .
+ *
+ * Returns nothing.
+ */
+static void receive_data(struct client *ptr, const char *buf, const int len,
+			 const time_t now)
+{
+	/* Offsets of newlines in the received data. */
+	static int lines[65536];
+	int num_lines;
+	ptr->last_seen = now;
+	if (ptr != lru_tail) {
+		lru_del(ptr);
+		lru_add_tail(ptr);
+	}
+	/* Shed the data rather than exiting if out of memory. */
+	if (grow_buffer(ptr, len))
+		goto drop;
+	/* Save current time if receiving the first byte. */
+	if (!ptr->avail) {
+		ptr->stamp = now;
+		if (timer_add(ptr)) {
+			put_buffer(ptr);
+			goto drop;
+		}
+	}
+	/* Append data to the line. */
+	memcpy(ptr->buffer + ptr->avail, buf, len);
+	/* Find all completed lines in one pass over the new data. */
+	num_lines = scan_newlines(ptr->buffer + ptr->avail, len, ptr->avail,
+				  lines);
+	ptr->avail += len;
+	/* Write if at least one line completed or if the line is too long. */
+	if (num_lines || ptr->avail >= wbuf_size)
+		write_logfile(ptr, lines, num_lines, ptr->avail >= wbuf_size);
+	return;
+drop:
+	ptr->dropped += len;
+	dropped_bytes += len;
+}
+
+/**
+ * enqueue_datagram - Queue a datagram for serve_queues().
+ *
+ * @ptr: Pointer to "struct client".
+ * @buf: Received data.
+ * @len: Length of @buf .
+ * @now: Time of receiving @buf .
+ *
+ * Returns nothing.
+ *
+ * Beyond a quarter of the queues' share of @mem_budget per client or the
+ * share itself (an eighth of @mem_budget) in total, the datagram is
+ * dropped, so that a flooding sender loses its own data rather than the
+ * kernel dropping everyone's.
+ */
+static void enqueue_datagram(struct client *ptr, const char *buf,
+			     const int len, const time_t now)
+{
+	struct queued_datagram *q;
+	if (ptr->queued + len > mem_budget / 32 ||
+	    queued_bytes + len > mem_budget / 8)
+		goto drop;
+	q = malloc(sizeof(*q) + len);
+	if (!q)
+		goto drop;
+	q->next = NULL;
+	q->stamp = now;
+	q->len = len;
+	memcpy(q->data, buf, len);
+	if (ptr->queue_head) {
+		ptr->queue_tail->next = q;
+	} else {
+		ptr->queue_head = q;
+		ptr->deficit = 0;
+		if (active_tail)
+			active_tail->active_next = ptr;
+		else
+			active_head = ptr;
+		active_tail = ptr;
+	}
+	ptr->queue_tail = q;
+	ptr->queued += len;
+	queued_bytes += len;
+	return;
+drop:
+	ptr->dropped += len;
+	dropped_bytes += len;
+}
+
+/**
+ * serve_queues - Process queued datagrams, one round of deficit round robin.
+ *
+ * Returns nothing.
+ *
+ * Each client in @active_head list may process FAIR_QUANTUM more bytes, and
+ * goes to the tail of the list if datagrams remain. A quiet client's
+ * datagram therefore waits for at most one quantum of each other client,
+ * however many datagrams a flooding one has queued.
+ */
+static void serve_queues(void)
+{
+	struct client *last = active_tail;
+	struct client *ptr;
+	struct queued_datagram *q;
+	do {
+		ptr = active_head;
+		active_head = ptr->active_next;
+		if (!active_head)
+			active_tail = NULL;
+		ptr->active_next = NULL;
+		ptr->deficit += FAIR_QUANTUM;
+		while ((q = ptr->queue_head) && q->len <= ptr->deficit) {
+			ptr->queue_head = q->next;
+			ptr->queued -= q->len;
+			queued_bytes -= q->len;
+			ptr->deficit -= q->len;
+			receive_data(ptr, q->data, q->len, q->stamp);
+			free(q);
+		}
+		if (!ptr->queue_head) {
+			ptr->queue_tail = NULL;
+			ptr->deficit = 0;
+			continue;
+		}
+		if (active_tail)
+			active_tail->active_next = ptr;
+		else
+			active_head = ptr;
+		active_tail = ptr;
+	} while (ptr != last);
+}
+
+/**
+ * drain_queues - Process all queued datagrams.
+ *
+ * Returns nothing.
+ */
+static void drain_queues(void)
+{
+	while (active_head)
+		serve_queues();
+}
+
+/**
+ * receive_datagrams - Receive a batch of datagrams and process or queue them.
+ *
+ * @fd:  Receiver socket's file descriptor.
+ * @now: Current time.
+ *
+ * Returns 0 if a datagram was received, -1 otherwise.
+ *
+ * A full batch means that the socket is backlogged. Datagrams are then
+ * queued per client until the queues are empty again, and serve_queues()
+ * processes them in turn instead of in arrival order.
+ */
+static int receive_datagrams(const int fd, const time_t now)
+{
+	static char bufs[RECV_BATCH][65536];
+	static struct sockaddr_in addrs[RECV_BATCH];
+	static struct iovec iovs[RECV_BATCH];
+	static struct mmsghdr msgs[RECV_BATCH];
+	int num;
+	int i;
+	for (i = 0; i < RECV_BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	num = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (num <= 0)
+		return -1;
+	if (num == RECV_BATCH)
+		overloaded = fair_queueing;
+	else if (!active_head)
+		overloaded = 0;
+	for (i = 0; i < num; i++) {
+		const int len = msgs[i].msg_len;
+		struct client *ptr;
+		if (!len || msgs[i].msg_hdr.msg_namelen != sizeof(addrs[i]))
+			continue;
+		ptr = find_client(&addrs[i]);
+		if (!ptr)
+			continue;
+		/* Keep the order of datagrams from the same client. */
+		if (overloaded || ptr->queue_head)
+			enqueue_datagram(ptr, bufs[i], len, now);
+		else
+			receive_data(ptr, bufs[i], len, now);
+	}
+	return 0;
+}
+
+/**
+ * flush_all - Pass everything written so far to the kernel.
+ *
+ * @partial: True if partial lines should be written as well.
+ *
+ * Returns nothing.
+ */
+static void flush_all(const _Bool partial)
+{
+	struct client_slab *slab;
+	struct client *ptr;
+	int i;
+	for_each_client(slab, ptr) {
+		if (partial && ptr->avail)
+			write_logfile(ptr, NULL, 0, 1);
+		if (partial)
+			tell_limits(ptr);
+		flush_logfile(&ptr->dir->log);
+		for (i = 0; ptr->dir->routes && i < rules->num_routes; i++)
+			flush_logfile(&ptr->dir->routes[i]);
+	}
+}
+
+/**
+ * do_shutdown - Write everything and exit.
+ *
+ * @fd: Receiver socket's file descriptor.
+ *
+ * This function does not return.
+ *
+ * Datagrams already queued in the socket are still received for up to
+ * SHUTDOWN_DRAIN_MSEC milliseconds, so that they are not lost together
+ * with the socket.
+ */
+static void do_shutdown(const int fd)
+{
+	struct client_slab *slab;
+	struct client *ptr;
+	struct timespec start;
+	struct timespec now;
+	int i;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (receive_datagrams(fd, time(NULL)))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000 +
+		 (now.tv_nsec - start.tv_nsec) / 1000000 < SHUTDOWN_DRAIN_MSEC);
+	drain_queues();
+	flush_all(1);
+	wait_closer();
+	relay_save();
+	for_each_client(slab, ptr) {
+		sync_logfile(&ptr->dir->log);
+		sync_logfile(&ptr->dir->next);
+		for (i = 0; ptr->dir->routes && i < rules->num_routes; i++)
+			sync_logfile(&ptr->dir->routes[i]);
+		close_routes(ptr->dir);
+	}
+	if (tail_fd != -1 && !fchdir(start_dir_fd))
+		unlink(tail_path);
+	exit(0);
+}
+
+static void do_reload(int *fd);
+static void do_upgrade(const int fd);
+
+/**
+ * handle_signals - Handle signals queued in the signalfd.
+ *
+ * @fd:        Pointer to the receiver socket's file descriptor.
+ * @signal_fd: File descriptor from signalfd().
+ *
+ * Returns nothing.
+ *
+ * Signals are blocked and read from @signal_fd in the main loop, so
+ * receiving and writing are never interrupted in the middle.
+ */
+static void handle_signals(int *fd, const int signal_fd)
+{
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGTERM:
+		case SIGINT:
+			do_shutdown(*fd);
+			break;
+		case SIGUSR1:
+			flush_all(0);
+			break;
+		case SIGHUP:
+			do_reload(fd);
+			break;
+		case SIGUSR2:
+			do_upgrade(*fd);
+			break;
+		}
+	}
+}
+
+/**
+ * do_main - The main loop.
+ *
+ * @fd:        Receiver socket's file descriptor.
+ * @signal_fd: File descriptor from signalfd().
+ *
+ * Returns nothing.
+ */
+static void do_main(int fd, const int signal_fd)
+{
+	while (1) {
+		struct pollfd pfd[5 + MAX_SUBSCRIBERS] = {
+			{ fd, POLLIN, 0 },
+			{ signal_fd, POLLIN, 0 },
+			{ tail_fd, POLLIN, 0 },
+			{ relay_fd, POLLIN, 0 },
+			{ resolved_pipe[0], POLLIN, 0 }
+		};
+		int wait = timer_wait();
+		int idle_wait;
+		int batches = 0;
+		int i;
+		time_t now = time(NULL);
+		/* Negative descriptors of unused subscribers are ignored. */
+		for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+			pfd[5 + i].fd = subscribers[i].fd;
+			pfd[5 + i].events = POLLIN;
+		}
+		if (relay_connecting || relay_wire_sent < relay_wire_len)
+			pfd[3].events |= POLLOUT;
+		/* Wait for data, but not beyond the next timeout. */
+		idle_wait = evict_wait(now);
+		if (wait == -1 || (idle_wait != -1 && idle_wait < wait))
+			wait = idle_wait;
+		idle_wait = relay_wait(now);
+		if (wait == -1 || (idle_wait != -1 && idle_wait < wait))
+			wait = idle_wait;
+		idle_wait = preopen_wait(now);
+		if (wait == -1 || (idle_wait != -1 && idle_wait < wait))
+			wait = idle_wait;
+		/* Queued datagrams are waiting for their turn. */
+		if (active_head)
+			wait = 0;
+		poll(pfd, 5 + MAX_SUBSCRIBERS, wait);
+		for (i = 0; i < MAX_SUBSCRIBERS; i++)
+			if (pfd[5 + i].revents &&
+			    subscribers[i].fd == pfd[5 + i].fd)
+				tail_read(&subscribers[i]);
+		if (pfd[4].revents & POLLIN)
+			read_resolved();
+		if (pfd[3].revents && relay_fd == pfd[3].fd)
+			relay_events(pfd[3].revents);
+		if (pfd[2].revents & POLLIN)
+			tail_accept();
+		if (pfd[1].revents & POLLIN)
+			handle_signals(&fd, signal_fd);
+		now = time(NULL);
+		/* Check for timeout. Writing removes the client from the heap. */
+		while (timer_count &&
+		       now - timer_heap[0]->stamp >= wait_timeout)
+			write_logfile(timer_heap[0], NULL, 0, 1);
+		/*
+		 * Don't receive forever in order to check for timeout. Queues
+		 * are served a round per batch, and drained once the socket
+		 * is.
+		 */
+		while (now == time(NULL)) {
+			const _Bool received = !receive_datagrams(fd, now);
+			/*
+			 * Read ahead under overload, so that datagrams of
+			 * quiet senders leave the socket before the kernel
+			 * drops them behind a flood.
+			 */
+			if (received && overloaded && ++batches < READ_AHEAD)
+				continue;
+			batches = 0;
+			if (active_head)
+				serve_queues();
+			else if (!received)
+				break;
+		}
+		relay_flush(now);
+		evict_clients(now);
+		preopen_logfiles(now);
+		relieve_memory_pressure();
+		drop_memory_usage();
+		report_stats(now);
+	}
+}
+
+/* Options given by the command line and the configuration file. */
+struct options {
+	struct sockaddr_in addr; /* Address to listen on. */
+	char log_dir[4096]; /* Directory to save logs. */
+	char tail_path[sizeof(tail_path)]; /* Socket for live tail, "" if none. */
+	char relay[256]; /* Upstream collector's "host:port", "" if none. */
+	struct sockaddr_storage relay_addr; /* Resolved @relay . */
+	socklen_t relay_addr_len; /* Length of @relay_addr, 0 if none. */
+	int log_files; /* Write log files? */
+	int relay_compress; /* Compress the stream to upstream? */
+	char spool_path[sizeof(spool_path)]; /* Spool file, "" if none. */
+	unsigned long long spool_max; /* Max bytes in the spool file. */
+	int rbuf_size; /* Max receive buffer size. */
+	int wait_timeout; /* Max seconds to wait for new line. */
+	int max_clients; /* Max clients. */
+	int wbuf_size; /* Max write buffer per a client. */
+	int idle_timeout; /* Max seconds to keep an idle client. */
+	int low_pct; /* Low watermark in percent of @max_clients . */
+	int high_pct; /* High watermark in percent of @max_clients . */
+	unsigned long long mem_budget; /* Max bytes for line buffers. */
+	int bloom_bytes; /* Bytes of a log file's token filter, 0 if none. */
+	int log_format; /* Format of log files, FORMAT_* . */
+	char rules_path[4096]; /* Rules file, "" if none. */
+	unsigned int rate_limit; /* Max lines per second per a client. */
+	unsigned int rate_burst; /* Max lines at once under @rate_limit . */
+	int dedup_lines; /* Collapse repeated lines? */
+	int fair_queueing; /* Serve senders in turn under overload? */
+	int urgent_level; /* Most lenient urgent level, -1 for none. */
+	char incidents_path[4096]; /* Mirror of urgent lines, "" if none. */
+	char names_path[4096]; /* Names file, "" if none. */
+	int resolve_names; /* Resolve identities by reverse DNS? */
+};
+
+/* Options in effect, with @log_dir being an absolute path. */
+static struct options current_options;
+/* Arguments, kept for re-reading options upon SIGHUP. */
+static int saved_argc = 0;
+static char **saved_argv = NULL;
+/* Absolute path of the file given by conf= , NULL if none. */
+static char *conf_file = NULL;
+/* Path of the program to execute upon SIGUSR2. */
+static char exec_path[4096] = { };
+
+/* Environment variable passing "$socket_fd:$state_fd" to the successor. */
+#define HANDOFF_ENV "UDPLOGGER_HANDOFF"
+/* Magic at the beginning of the state passed to the successor. */
+#define HANDOFF_MAGIC "udplogger-st-v5"
+
+/* Header of the state passed to the successor. */
+struct handoff_header {
+	char magic[16]; /* HANDOFF_MAGIC . */
+	int num_clients; /* Number of "struct handoff_client" which follow. */
+};
+
+/* Per client state passed to the successor, followed by @avail bytes. */
+struct handoff_client {
+	struct sockaddr_in addr; /* Sender's IPv4 address and port. */
+	time_t stamp; /* Timestamp of receiving the first byte in buffer. */
+	time_t last_seen; /* Timestamp of receiving the latest data. */
+	unsigned int dropped; /* Bytes dropped since the last write. */
+	int avail; /* Bytes of the partial line. */
+	int log_fd; /* File descriptor of today's log file, -1 if none. */
+	int idx_fd; /* File descriptor of its time index, -1 if none. */
+	time_t indexed; /* Latest time recorded in the time index. */
+	int year; /* Date of the log file. */
+	int mon;
+	int mday;
+	int binary; /* Is the log file in the binary format? */
+	unsigned int tokens; /* Lines which may be written under rate= . */
+	time_t refilled; /* Time @tokens was last refilled. */
+	unsigned int suppressed; /* Lines over rate= not told yet. */
+	unsigned long long last_hash; /* Hash of the last line written. */
+	time_t last_written; /* Time the last line was written. */
+	unsigned int repeated; /* Repeats of the last line not told yet. */
+	char dir[IDENTITY_MAX + 1]; /* Name of the directory. */
+};
+
+/**
+ * usage - Print usage and exit.
+ *
+ * @name: Program's name.
+ *
+ * This function does not return.
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "Simple UDP logger\n\n"
+		"Usage:\n  %s [conf=$config_file] [ip=$listen_ip] "
+		"[port=$listen_port] "
+		"[dir=$log_dir] [timeout=$seconds_waiting_for_newline] "
+		"[clients=$max_clients] [wbuf=$write_buffer_size] "
+		"[rbuf=$receive_buffer_size] [idle=$seconds_keeping_idle_client] "
+		"[low=$low_watermark_percent] [high=$high_watermark_percent] "
+		"[mem=$memory_budget] [tail=$unix_socket_path] "
+		"[relay=$host:$port] [files=0|1] [compress=0|1] "
+		"[spool=$spool_file] [spoolmax=$spool_bytes] "
+		"[bloom=$filter_bytes] [format=text|json|bin] "
+		"[rules=$rules_file] [rate=$lines_per_second] "
+		"[burst=$lines] [dedup=0|1] [fair=0|1] [urgent=$level] "
+		"[incidents=$file] [names=$names_file] [resolve=0|1]\n\n"
+		"The value of $seconds_waiting_for_newline should be between "
+		"5 and 600.\nThe value of $max_clients should be between 10 "
+		"and 65536.\nThe value of $write_buffer_size should be "
+		"between 1024 and 1048576.\nThe value of $receive_buffer_size "
+		"should be 65536 and 1073741824 (though actual size might be "
+		"adjusted by the kernel).\nThe value of $seconds_keeping_idle_client "
+		"should be between 60 and 86400.\nOnce clients exceed "
+		"$high_watermark_percent of $max_clients, idle clients are "
+		"evicted until\n$low_watermark_percent of $max_clients "
+		"remain.\nThe value of $memory_budget should be between 4194304 "
+		"and 68719476736. Once line buffers\nreach it, the longest "
+		"partial lines are written out and then received data is "
+		"dropped.\n$config_file holds the same options, one per line. "
+		"Options on the command line\noverride it. Both are read again "
+		"upon SIGHUP.\nUpon SIGUSR2, the program file is executed "
+		"again, taking over the socket, log files\nand partial lines "
+		"without dropping datagrams.\nIf $unix_socket_path is given, "
+		"local clients connecting to it send one line\nof \"all\", "
+		"\"$ip\", \"$ip:$port\" or \"$ip/$prefix_len\" and receive "
+		"matching lines as they\nare written. Clients which can't keep "
+		"up are disconnected.\nIf $host:$port is given, lines are "
+		"also sent to an upstream collector over TCP,\ndeflated if "
+		"compress=1. files=0 stops writing log files. While upstream "
+		"is\nunreachable, lines are kept in $spool_file up to "
+		"$spool_bytes (default 1073741824).\nA filter of "
+		"$filter_bytes (default 16384, 0 to disable) is saved next to "
+		"each log file,\nletting udplogger-query skip files without "
+		"the words searched for.\nformat=json writes each line as "
+		"an NDJSON record with \"time\", \"sender\", \"msg\" and,\n"
+		"for extended netconsole, \"level\", \"seq\" and \"usec\".\n"
+		"format=bin writes $date.bin files of checksummed blocks of "
+		"records instead,\nwhich udplogger-bin2text converts to text."
+		"\n$rules_file holds rules dropping, sampling or routing "
+		"lines to $date.$route.log\nby netconsole level, sender or "
+		"text. See README.md for the syntax.\nrate= limits lines per "
+		"second of each sender, allowing bursts of $lines (default\n"
+		"10 seconds' worth). dedup=1 collapses repeated lines into "
+		"\"last message repeated\"\nmarkers.\nUnder overload, fair=1 "
+		"(default) queues datagrams per sender and processes them\n"
+		"in turn, so that a flooding sender can't delay the others.\n"
+		"Lines at netconsole level $level (default 1, -1 for none) "
+		"or more severe, or\nholding markers like \"Kernel panic\" "
+		"or \"BUG:\", are written to disk at once, and\nalso to "
+		"$file if given.\n$names_file maps \"$ip[/$prefix_len] $name\" "
+		"to the directory of log files,\nlike /etc/hosts. resolve=1 "
+		"names them by reverse DNS, resolved in the\nbackground. "
+		"Either way, unnamed senders are written to $ip instead of "
+		"$ip:$port.\n", name);
+	exit (1);
+}
+
+/**
+ * parse_option - Parse one option.
+ *
+ * @opts: Pointer to "struct options".
+ * @arg:  Option in "name=value" form.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int parse_option(struct options *opts, const char *arg)
+{
+	if (!strncmp(arg, "ip=", 3))
+		opts->addr.sin_addr.s_addr = inet_addr(arg + 3);
+	else if (!strncmp(arg, "port=", 5))
+		opts->addr.sin_port = htons(atoi(arg + 5));
+	else if (!strncmp(arg, "dir=", 4))
+		snprintf(opts->log_dir, sizeof(opts->log_dir), "%s", arg + 4);
+	else if (!strncmp(arg, "tail=", 5))
+		snprintf(opts->tail_path, sizeof(opts->tail_path), "%s",
+			 arg + 5);
+	else if (!strncmp(arg, "relay=", 6))
+		snprintf(opts->relay, sizeof(opts->relay), "%s", arg + 6);
+	else if (!strncmp(arg, "files=", 6))
+		opts->log_files = atoi(arg + 6) != 0;
+	else if (!strncmp(arg, "compress=", 9))
+		opts->relay_compress = atoi(arg + 9) != 0;
+	else if (!strncmp(arg, "spool=", 6))
+		snprintf(opts->spool_path, sizeof(opts->spool_path), "%s",
+			 arg + 6);
+	else if (!strncmp(arg, "spoolmax=", 9))
+		opts->spool_max = strtoull(arg + 9, NULL, 10);
+	else if (!strncmp(arg, "timeout=", 8))
+		opts->wait_timeout = atoi(arg + 8);
+	else if (!strncmp(arg, "clients=", 8))
+		opts->max_clients = atoi(arg + 8);
+	else if (!strncmp(arg, "wbuf=", 5))
+		opts->wbuf_size = atoi(arg + 5);
+	else if (!strncmp(arg, "rbuf=", 5))
+		opts->rbuf_size = atoi(arg + 5);
+	else if (!strncmp(arg, "idle=", 5))
+		opts->idle_timeout = atoi(arg + 5);
+	else if (!strncmp(arg, "low=", 4))
+		opts->low_pct = atoi(arg + 4);
+	else if (!strncmp(arg, "high=", 5))
+		opts->high_pct = atoi(arg + 5);
+	else if (!strncmp(arg, "mem=", 4))
+		opts->mem_budget = strtoull(arg + 4, NULL, 10);
+	else if (!strncmp(arg, "bloom=", 6))
+		opts->bloom_bytes = atoi(arg + 6);
+	else if (!strcmp(arg, "format=text"))
+		opts->log_format = FORMAT_TEXT;
+	else if (!strcmp(arg, "format=json"))
+		opts->log_format = FORMAT_JSON;
+	else if (!strcmp(arg, "format=bin"))
+		opts->log_format = FORMAT_BIN;
+	else if (!strncmp(arg, "rules=", 6))
+		snprintf(opts->rules_path, sizeof(opts->rules_path), "%s",
+			 arg + 6);
+	else if (!strncmp(arg, "rate=", 5))
+		opts->rate_limit = strtoul(arg + 5, NULL, 10);
+	else if (!strncmp(arg, "burst=", 6))
+		opts->rate_burst = strtoul(arg + 6, NULL, 10);
+	else if (!strncmp(arg, "dedup=", 6))
+		opts->dedup_lines = atoi(arg + 6) != 0;
+	else if (!strncmp(arg, "fair=", 5))
+		opts->fair_queueing = atoi(arg + 5) != 0;
+	else if (!strncmp(arg, "urgent=", 7))
+		opts->urgent_level = atoi(arg + 7);
+	else if (!strncmp(arg, "incidents=", 10))
+		snprintf(opts->incidents_path, sizeof(opts->incidents_path),
+			 "%s", arg + 10);
+	else if (!strncmp(arg, "names=", 6))
+		snprintf(opts->names_path, sizeof(opts->names_path), "%s",
+			 arg + 6);
+	else if (!strncmp(arg, "resolve=", 8))
+		opts->resolve_names = atoi(arg + 8) != 0;
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ * read_config - Parse options in the configuration file.
+ *
+ * @opts: Pointer to "struct options".
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * Each line holds one option. Empty lines and lines starting with '#'
+ * are ignored.
+ */
+static int read_config(struct options *opts)
+{
+	char line[4200];
+	int lineno = 0;
+	int ret = 0;
+	FILE *fp;
+	if (!conf_file)
+		return 0;
+	fp = fopen(conf_file, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s .\n", conf_file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		char *cp = line + strspn(line, " \t");
+		int len = strcspn(cp, "\r\n");
+		lineno++;
+		while (len && (cp[len - 1] == ' ' || cp[len - 1] == '\t'))
+			len--;
+		cp[len] = '\0';
+		if (!*cp || *cp == '#')
+			continue;
+		if (parse_option(opts, cp)) {
+			fprintf(stderr, "Unknown option at %s:%d: %s\n",
+				conf_file, lineno, cp);
+			ret = -1;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * resolve_relay - Resolve the upstream collector's address.
+ *
+ * @opts: Pointer to "struct options".
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * This may block, but only while (re)loading options.
+ */
+static int resolve_relay(struct options *opts)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res;
+	char host[sizeof(opts->relay)];
+	char *port;
+	strcpy(host, opts->relay);
+	port = strrchr(host, ':');
+	if (!port) {
+		fprintf(stderr, "Missing port in relay=%s\n", opts->relay);
+		return -1;
+	}
+	*port++ = '\0';
+	if (getaddrinfo(host, port, &hints, &res)) {
+		fprintf(stderr, "Can't resolve %s .\n", opts->relay);
+		return -1;
+	}
+	memcpy(&opts->relay_addr, res->ai_addr, res->ai_addrlen);
+	opts->relay_addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/**
+ * load_options - Read options from the configuration file and arguments.
+ *
+ * @opts: Pointer to "struct options".
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int load_options(struct options *opts)
+{
+	int i;
+	memset(opts, 0, sizeof(*opts));
+	opts->addr.sin_family = AF_INET;
+	opts->addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	opts->addr.sin_port = htons(6666);
+	strcpy(opts->log_dir, ".");
+	opts->rbuf_size = 8 * 1048576;
+	opts->wait_timeout = 10;
+	opts->max_clients = 1024;
+	opts->wbuf_size = 65536;
+	opts->idle_timeout = 3600;
+	opts->low_pct = 75;
+	opts->high_pct = 90;
+	opts->mem_budget = 256 * 1048576;
+	opts->fair_queueing = 1;
+	opts->urgent_level = 1;
+	opts->log_files = 1;
+	opts->spool_max = 1073741824;
+	opts->bloom_bytes = 16384;
+	if (read_config(opts))
+		return -1;
+	for (i = 1; i < saved_argc; i++) {
+		char *arg = saved_argv[i];
+		if (!strncmp(arg, "conf=", 5))
+			continue;
+		if (parse_option(opts, arg)) {
+			fprintf(stderr, "Unknown option: %s\n", arg);
+			return -1;
+		}
+	}
+	/* Sanity check. */
+	if (opts->max_clients < 10)
+		opts->max_clients = 10;
+	if (opts->max_clients > 65536)
+		opts->max_clients = 65536;
+	if (opts->wait_timeout < 5)
+		opts->wait_timeout = 5;
+	if (opts->wait_timeout > 600)
+		opts->wait_timeout = 600;
+	if (opts->wbuf_size < 1024)
+		opts->wbuf_size = 1024;
+	if (opts->wbuf_size > 1048576)
+		opts->wbuf_size = 1048576;
+	if (opts->rbuf_size < 65536)
+		opts->rbuf_size = 65536;
+	if (opts->rbuf_size > 1024 * 1048576)
+		opts->rbuf_size = 1024 * 1048576;
+	if (opts->idle_timeout < 60)
+		opts->idle_timeout = 60;
+	if (opts->idle_timeout > 86400)
+		opts->idle_timeout = 86400;
+	if (opts->high_pct < 10)
+		opts->high_pct = 10;
+	if (opts->high_pct > 100)
+		opts->high_pct = 100;
+	if (opts->low_pct < 0)
+		opts->low_pct = 0;
+	if (opts->low_pct > opts->high_pct)
+		opts->low_pct = opts->high_pct;
+	if (opts->mem_budget < 4 * 1048576)
+		opts->mem_budget = 4 * 1048576;
+	if (opts->mem_budget > 64ull * 1073741824)
+		opts->mem_budget = 64ull * 1073741824;
+	if (opts->spool_max < 1048576)
+		opts->spool_max = 1048576;
+	if (opts->bloom_bytes < 0)
+		opts->bloom_bytes = 0;
+	if (opts->urgent_level < -1)
+		opts->urgent_level = -1;
+	if (opts->urgent_level > 7)
+		opts->urgent_level = 7;
+	if (opts->bloom_bytes > 1048576)
+		opts->bloom_bytes = 1048576;
+	if (opts->bloom_bytes && opts->bloom_bytes < 1024)
+		opts->bloom_bytes = 1024;
+	/* Round down to a power of 2. */
+	while (opts->bloom_bytes & (opts->bloom_bytes - 1))
+		opts->bloom_bytes &= opts->bloom_bytes - 1;
+	if (opts->rate_limit > 1000000)
+		opts->rate_limit = 1000000;
+	if (!opts->rate_burst)
+		opts->rate_burst = opts->rate_limit * 10;
+	if (opts->rate_burst < opts->rate_limit)
+		opts->rate_burst = opts->rate_limit;
+	if (*opts->relay && resolve_relay(opts))
+		return -1;
+	/* Lines must go somewhere. */
+	if (!opts->relay_addr_len)
+		opts->log_files = 1;
+	return 0;
+}
+
+/**
+ * set_rbuf_size - Set the receive buffer size of the listener socket.
+ *
+ * @fd:   Receiver socket's file descriptor.
+ * @opts: Pointer to "struct options". @opts->rbuf_size is updated to the
+ *        size the kernel actually chose.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int set_rbuf_size(const int fd, struct options *opts)
+{
+	socklen_t size = sizeof(opts->rbuf_size);
+#ifdef SO_RCVBUFFORCE
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &opts->rbuf_size,
+		       sizeof(opts->rbuf_size))) {
+#endif
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->rbuf_size,
+			       sizeof(opts->rbuf_size))) {
+			fprintf(stderr, "Can't set receive buffer size.\n");
+			return -1;
+		}
+#ifdef SO_RCVBUFFORCE
+	}
+#endif
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->rbuf_size, &size)) {
+		fprintf(stderr, "Can't get receive buffer size.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * open_socket - Create the listener socket and configure it.
+ *
+ * @opts: Pointer to "struct options". @opts->addr and @opts->rbuf_size are
+ *        updated to what the kernel actually chose.
+ *
+ * Returns the listener socket's file descriptor on success, -1 otherwise.
+ */
+static int open_socket(struct options *opts)
+{
+	socklen_t size = sizeof(opts->addr);
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+	if (set_rbuf_size(fd, opts)) {
+		close(fd);
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *) &opts->addr, sizeof(opts->addr)) ||
+	    getsockname(fd, (struct sockaddr *) &opts->addr, &size) ||
+	    size != sizeof(opts->addr)) {
+		fprintf(stderr, "Can't bind to %s:%u .\n",
+			inet_ntoa(opts->addr.sin_addr),
+			htons(opts->addr.sin_port));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * open_tail - Create the listener socket for live tail subscribers.
+ *
+ * @path: Path to bind to. Relative to the current directory.
+ *
+ * Returns the listener socket's file descriptor on success, -1 otherwise.
+ */
+static int open_tail(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			      SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, 16)) {
+		fprintf(stderr, "Can't listen on %s .\n", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * set_tail - Switch the listener socket for live tail subscribers.
+ *
+ * @opts: Pointer to "struct options". @opts->tail_path is cleared if the
+ *        socket couldn't be created.
+ *
+ * Returns nothing.
+ *
+ * Connected subscribers are kept.
+ */
+static void set_tail(struct options *opts)
+{
+	if (!strcmp(opts->tail_path, tail_path) &&
+	    (tail_fd != -1 || !*tail_path))
+		return;
+	if (tail_fd != -1) {
+		close(tail_fd);
+		unlink(tail_path);
+		tail_fd = -1;
+	}
+	if (*opts->tail_path)
+		tail_fd = open_tail(opts->tail_path);
+	if (tail_fd == -1)
+		*opts->tail_path = '\0';
+	strcpy(tail_path, opts->tail_path);
+}
+
+/**
+ * set_relay - Switch the upstream collector and the spool file.
+ *
+ * @opts: Pointer to "struct options". @opts->spool_path is cleared if the
+ *        spool file couldn't be opened.
+ *
+ * Returns nothing.
+ *
+ * Lines waiting to be relayed are kept and go to the new upstream.
+ */
+static void set_relay(struct options *opts)
+{
+	if (strcmp(opts->spool_path, spool_path) ||
+	    (spool_fd == -1 && *spool_path)) {
+		if (spool_fd != -1) {
+			if (spool_read < spool_size)
+				fprintf(stderr, "Leaving unsent lines in %s .\n",
+					spool_path);
+			spool_mark();
+			close(spool_fd);
+			spool_fd = -1;
+		}
+		spool_read = spool_size = spool_marked = spool_punched = 0;
+		if (*opts->spool_path) {
+			/* Resend what the previous run couldn't send. */
+			spool_fd = open(opts->spool_path, O_RDWR | O_CREAT |
+					O_CLOEXEC, 0600);
+			if (spool_fd == -1) {
+				fprintf(stderr, "Can't open %s .\n",
+					opts->spool_path);
+			} else if (spool_open()) {
+				fprintf(stderr, "%s is not a spool file.\n",
+					opts->spool_path);
+				close(spool_fd);
+				spool_fd = -1;
+			}
+		}
+		if (spool_fd == -1)
+			*opts->spool_path = '\0';
+		strcpy(spool_path, opts->spool_path);
+	}
+	spool_max = opts->spool_max;
+	log_files = opts->log_files;
+	if (opts->relay_addr_len && !relay_buf) {
+		relay_buf = malloc(RELAY_BUF_SIZE);
+		if (!relay_buf) {
+			fprintf(stderr, "Can't allocate relay buffer.\n");
+			opts->relay_addr_len = 0;
+			*opts->relay = '\0';
+			opts->log_files = log_files = 1;
+		}
+	}
+	if (opts->relay_addr_len == relay_addr_len &&
+	    !memcmp(&opts->relay_addr, &relay_addr, relay_addr_len) &&
+	    opts->relay_compress == relay_compress)
+		return;
+	relay_disconnect();
+	relay_retry_at = 0;
+	relay_retry_wait = 1;
+	relay_addr = opts->relay_addr;
+	relay_addr_len = opts->relay_addr_len;
+	relay_compress = opts->relay_compress;
+	if (!relay_addr_len) {
+		relay_spill();
+		relay_head = relay_len = 0;
+	}
+}
+
+/**
+ * set_rules - Switch the rules.
+ *
+ * @opts: Pointer to "struct options". @opts->rules_path is restored to
+ *        the current one if the rules file couldn't be loaded.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * The rules file is read again even if the path is unchanged, for it may
+ * have been edited. Routes' log files are closed as routes may change.
+ */
+static int set_rules(struct options *opts)
+{
+	struct client_slab *slab;
+	struct client *ptr;
+	struct rules *new_rules = NULL;
+	if (*opts->rules_path) {
+		new_rules = load_rules(opts->rules_path);
+		if (!new_rules) {
+			strcpy(opts->rules_path, current_options.rules_path);
+			return -1;
+		}
+	}
+	for_each_client(slab, ptr) {
+		close_routes(ptr->dir);
+		/* Counts are by rule, and rules may have changed. */
+		free(ptr->sampled);
+		ptr->sampled = NULL;
+	}
+	free_rules(rules);
+	rules = new_rules;
+	return 0;
+}
+
+/**
+ * set_names - Switch the names file and start resolving names if asked.
+ *
+ * @opts: Pointer to "struct options". @opts->names_path is restored to
+ *        the current one if the names file couldn't be loaded.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * The names file is read again even if the path is unchanged. Clients move
+ * to the directories of their new identities once options are applied.
+ */
+static int set_names(struct options *opts)
+{
+	struct names *new_names = NULL;
+	if (*opts->names_path) {
+		new_names = load_names(opts->names_path);
+		if (!new_names) {
+			strcpy(opts->names_path, current_options.names_path);
+			return -1;
+		}
+	}
+	if (opts->resolve_names && start_resolver()) {
+		fprintf(stderr, "Can't start resolving names.\n");
+		free_names(new_names);
+		strcpy(opts->names_path, current_options.names_path);
+		opts->resolve_names = current_options.resolve_names;
+		return -1;
+	}
+	free_names(names);
+	names = new_names;
+	return 0;
+}
+
+/**
+ * set_incidents - Open the file urgent lines are mirrored to.
+ *
+ * @opts: Pointer to "struct options". @opts->incidents_path is cleared if
+ *        the file couldn't be opened.
+ *
+ * Returns nothing.
+ *
+ * The file is opened again even if the path is unchanged, so that it can be
+ * rotated.
+ */
+static void set_incidents(struct options *opts)
+{
+	if (incidents_fd != -1)
+		close(incidents_fd);
+	incidents_fd = -1;
+	if (!*opts->incidents_path)
+		return;
+	incidents_fd = open(opts->incidents_path, O_WRONLY | O_CREAT |
+			    O_APPEND | O_CLOEXEC, 0666);
+	if (incidents_fd == -1) {
+		fprintf(stderr, "Can't open %s .\n", opts->incidents_path);
+		*opts->incidents_path = '\0';
+	}
+}
+
+/**
+ * change_log_dir - Change to the directory to save logs.
+ *
+ * @opts: Pointer to "struct options". @opts->log_dir is updated to an
+ *        absolute path.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * A relative path is resolved from the directory udplogger was started in.
+ */
+static int change_log_dir(struct options *opts)
+{
+	char pwd[sizeof(opts->log_dir)];
+	memset(pwd, 0, sizeof(pwd));
+	if (fchdir(start_dir_fd) || chdir(opts->log_dir) ||
+	    !getcwd(pwd, sizeof(pwd) - 1)) {
+		fprintf(stderr, "Can't change directory to %s .\n",
+			opts->log_dir);
+		return -1;
+	}
+	strcpy(opts->log_dir, pwd);
+	return 0;
+}
+
+/**
+ * resize_client_hash - Resize @client_hash for @max_clients .
+ *
+ * Returns nothing.
+ */
+static void resize_client_hash(void)
+{
+	struct client_slab *slab;
+	struct client *ptr;
+	struct client **old = client_hash;
+	unsigned int size = 1;
+	while (size < max_clients)
+		size <<= 1;
+	if (!old || size == client_hash_size)
+		return;
+	client_hash = calloc(size, sizeof(*client_hash));
+	if (!client_hash) {
+		/* Any power of 2 works. Just keep the current one. */
+		client_hash = old;
+		return;
+	}
+	client_hash_size = size;
+	for_each_client(slab, ptr) {
+		struct client **bucket = client_hash_bucket(&ptr->addr);
+		ptr->hash_next = *bucket;
+		*bucket = ptr;
+	}
+	free(old);
+}
+
+/**
+ * apply_options - Make options take effect.
+ *
+ * @opts: Pointer to "struct options".
+ *
+ * Returns nothing.
+ */
+static void apply_options(const struct options *opts)
+{
+	wait_timeout = opts->wait_timeout;
+	max_clients = opts->max_clients;
+	wbuf_size = opts->wbuf_size;
+	idle_timeout = opts->idle_timeout;
+	low_pct = opts->low_pct;
+	high_pct = opts->high_pct;
+	mem_budget = opts->mem_budget;
+	bloom_bytes = opts->bloom_bytes;
+	log_format = opts->log_format;
+	rate_limit = opts->rate_limit;
+	rate_burst = opts->rate_burst;
+	dedup_lines = opts->dedup_lines;
+	fair_queueing = opts->fair_queueing;
+	urgent_level = opts->urgent_level;
+	resolve_names = opts->resolve_names;
+	current_options = *opts;
+	resize_client_hash();
+}
+
+/**
+ * print_options - Print options in effect.
+ *
+ * @opts: Pointer to "struct options".
+ *
+ * Returns nothing.
+ */
+static void print_options(const struct options *opts)
+{
+	printf("Options: ip=%s port=%u dir=%s timeout=%u clients=%u wbuf=%u "
+	       "rbuf=%u idle=%u low=%u high=%u mem=%llu tail=%s relay=%s "
+	       "files=%u compress=%u spool=%s spoolmax=%llu bloom=%u "
+	       "format=%s rules=%s rate=%u burst=%u dedup=%u fair=%u "
+	       "urgent=%d incidents=%s names=%s resolve=%u\n",
+	       inet_ntoa(opts->addr.sin_addr), htons(opts->addr.sin_port),
+	       opts->log_dir, opts->wait_timeout, opts->max_clients,
+	       opts->wbuf_size, opts->rbuf_size, opts->idle_timeout,
+	       opts->low_pct, opts->high_pct, opts->mem_budget,
+	       opts->tail_path, opts->relay, opts->log_files,
+	       opts->relay_compress, opts->spool_path, opts->spool_max,
+	       opts->bloom_bytes, opts->log_format == FORMAT_BIN ? "bin" :
+	       opts->log_format == FORMAT_JSON ? "json" : "text",
+	       opts->rules_path, opts->rate_limit, opts->rate_burst,
+	       opts->dedup_lines, opts->fair_queueing, opts->urgent_level,
+	       opts->incidents_path, opts->names_path, opts->resolve_names);
+	fflush(stdout);
+}
+
+/**
+ * do_reload - Re-read options and apply them without restarting.
+ *
+ * @fd: Pointer to the receiver socket's file descriptor, which is replaced
+ *      if the address to listen on has changed.
+ *
+ * Returns nothing.
+ *
+ * The new socket is bound before the old one is drained and closed, and
+ * partial lines in client buffers are kept, so no datagram is lost.
+ */
+static void do_reload(int *fd)
+{
+	struct options opts;
+	struct client_slab *slab;
+	struct client *ptr;
+	if (load_options(&opts)) {
+		fprintf(stderr, "Keeping the current options.\n");
+		return;
+	}
+	if (opts.addr.sin_addr.s_addr != current_options.addr.sin_addr.s_addr ||
+	    opts.addr.sin_port != current_options.addr.sin_port) {
+		const int new_fd = open_socket(&opts);
+		if (new_fd == -1) {
+			fprintf(stderr, "Keeping the current socket.\n");
+			opts.addr = current_options.addr;
+			opts.rbuf_size = current_options.rbuf_size;
+		} else {
+			while (!receive_datagrams(*fd, time(NULL)));
+			close(*fd);
+			*fd = new_fd;
+		}
+	} else if (opts.rbuf_size != current_options.rbuf_size &&
+		   set_rbuf_size(*fd, &opts)) {
+		opts.rbuf_size = current_options.rbuf_size;
+	}
+	/*
+	 * Relative tail=, spool= and incidents= are relative to the directory
+	 * started in.
+	 */
+	if (!fchdir(start_dir_fd)) {
+		set_tail(&opts);
+		set_relay(&opts);
+		set_incidents(&opts);
+		if (set_rules(&opts))
+			fprintf(stderr, "Keeping the current rules.\n");
+		if (set_names(&opts))
+			fprintf(stderr, "Keeping the current names.\n");
+	}
+	if (change_log_dir(&opts)) {
+		snprintf(opts.log_dir, sizeof(opts.log_dir), "%s",
+			 current_options.log_dir);
+		if (chdir(opts.log_dir))
+			fprintf(stderr, "Can't return to %s .\n", opts.log_dir);
+	} else if (strcmp(opts.log_dir, current_options.log_dir)) {
+		/*
+		 * Reopen log files in the new directory upon next write.
+		 * Filters are saved through the old directories' descriptors.
+		 */
+		for_each_client(slab, ptr) {
+			close_logfile(&ptr->dir->log);
+			close_logfile(&ptr->dir->next);
+			close_routes(ptr->dir);
+			if (ptr->dir->fd != -1)
+				close(ptr->dir->fd);
+			ptr->dir->fd = -1;
+		}
+	}
+	/*
+	 * Filters being built have the old size. Files opened ahead are
+	 * still empty, and get new ones when opened again.
+	 */
+	if (opts.bloom_bytes != bloom_bytes) {
+		for_each_client(slab, ptr) {
+			bloom_drop(&ptr->dir->log);
+			bloom_drop(&ptr->dir->next);
+			close_logfile(&ptr->dir->next);
+		}
+	}
+	apply_options(&opts);
+	/* Identities may have changed. */
+	for_each_client(slab, ptr)
+		bind_dir(ptr);
+	printf("Reloaded. ");
+	print_options(&opts);
+}
+
+/**
+ * save_state - Write clients' state for the successor.
+ *
+ * @fp: Temporary file to write to.
+ *
+ * Returns 0 on success, -1 otherwise.
+ *
+ * Log files are passed by file descriptors, which are made inheritable.
+ * Their offsets come with them because they are shared with the successor.
+ */
+static int save_state(FILE *fp)
+{
+	struct handoff_header header = { HANDOFF_MAGIC, num_clients };
+	struct client_slab *slab;
+	struct client *ptr;
+	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		return -1;
+	for_each_client(slab, ptr) {
+		struct handoff_client rec = {
+			ptr->addr, ptr->stamp, ptr->last_seen, ptr->dropped,
+			ptr->avail, -1, -1, ptr->dir->log.indexed,
+			ptr->dir->log.tm.tm_year, ptr->dir->log.tm.tm_mon,
+			ptr->dir->log.tm.tm_mday, ptr->dir->log.binary,
+			ptr->tokens, ptr->refilled, ptr->suppressed,
+			ptr->last_hash, ptr->last_written, ptr->repeated
+		};
+		strcpy(rec.dir, ptr->dir->name);
+		if (ptr->dir->log.fp) {
+			rec.log_fd = fileno(ptr->dir->log.fp);
+			if (fcntl(rec.log_fd, F_SETFD, 0))
+				return -1;
+		}
+		if (ptr->dir->log.idx_fp) {
+			rec.idx_fd = fileno(ptr->dir->log.idx_fp);
+			if (fcntl(rec.idx_fd, F_SETFD, 0))
+				return -1;
+		}
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+		    fwrite(ptr->buffer, 1, ptr->avail, fp) != ptr->avail)
+			return -1;
+	}
+	return fflush(fp) || fseek(fp, 0, SEEK_SET) ? -1 : 0;
+}
+
+/**
+ * restore_state - Take over clients' state from the predecessor.
+ *
+ * @state_fd: File descriptor written by save_state().
+ *
+ * Returns nothing.
+ */
+static void restore_state(const int state_fd)
+{
+	struct handoff_header header;
+	FILE *fp = fdopen(state_fd, "r");
+	int restored = 0;
+	int i;
+	if (!fp || fread(&header, sizeof(header), 1, fp) != 1 ||
+	    strncmp(header.magic, HANDOFF_MAGIC, sizeof(header.magic))) {
+		fprintf(stderr, "Can't restore state.\n");
+		if (fp)
+			fclose(fp);
+		return;
+	}
+	for (i = 0; i < header.num_clients; i++) {
+		struct handoff_client rec;
+		struct client *ptr;
+		if (fread(&rec, sizeof(rec), 1, fp) != 1)
+			break;
+		ptr = find_client(&rec.addr);
+		if (!ptr || (rec.avail && get_buffer(ptr, rec.avail))) {
+			/* Keep the stream consistent and tell the loss. */
+			fseek(fp, rec.avail, SEEK_CUR);
+			if (rec.log_fd != -1)
+				close(rec.log_fd);
+			if (rec.idx_fd != -1)
+				close(rec.idx_fd);
+			dropped_bytes += rec.avail;
+			continue;
+		}
+		if (fread(ptr->buffer, 1, rec.avail, fp) != rec.avail)
+			break;
+		ptr->avail = rec.avail;
+		ptr->stamp = rec.stamp;
+		ptr->last_seen = rec.last_seen;
+		ptr->dropped = rec.dropped;
+		ptr->tokens = rec.tokens;
+		ptr->refilled = rec.refilled;
+		ptr->suppressed = rec.suppressed;
+		ptr->last_hash = rec.last_hash;
+		ptr->last_written = rec.last_written;
+		ptr->repeated = rec.repeated;
+		/* Clients sharing a directory passed the same descriptors. */
+		rec.dir[IDENTITY_MAX] = '\0';
+		/* A name in use is used until resolved again. */
+		if (resolve_names &&
+		    strcmp(rec.dir, inet_ntoa(rec.addr.sin_addr)) &&
+		    strcmp(rec.dir, ptr->addr_str))
+			seed_name(rec.addr.sin_addr, rec.dir);
+		if (use_dir(ptr, rec.dir, strcmp(rec.dir, ptr->addr_str))) {
+			if (rec.log_fd != -1)
+				close(rec.log_fd);
+			rec.log_fd = -1;
+			if (rec.idx_fd != -1)
+				close(rec.idx_fd);
+			rec.idx_fd = -1;
+		}
+		if (rec.log_fd != -1 && ptr->dir->log.fp) {
+			if (fileno(ptr->dir->log.fp) != rec.log_fd)
+				close(rec.log_fd);
+			rec.log_fd = -1;
+		}
+		if (rec.idx_fd != -1 && ptr->dir->log.idx_fp) {
+			if (fileno(ptr->dir->log.idx_fp) != rec.idx_fd)
+				close(rec.idx_fd);
+			rec.idx_fd = -1;
+		}
+		/* The filter is saved and taken over by the descriptor. */
+		if ((rec.log_fd != -1 || rec.idx_fd != -1) &&
+		    open_dir(ptr->dir)) {
+			if (rec.log_fd != -1)
+				close(rec.log_fd);
+			rec.log_fd = -1;
+			if (rec.idx_fd != -1)
+				close(rec.idx_fd);
+			rec.idx_fd = -1;
+		}
+		if (rec.log_fd != -1) {
+			struct stat buf;
+			fcntl(rec.log_fd, F_SETFD, FD_CLOEXEC);
+			ptr->dir->log.fp = fdopen(rec.log_fd, "a");
+			ptr->dir->log.size = fstat(rec.log_fd, &buf) ? 0 :
+				buf.st_size;
+			ptr->dir->log.tm.tm_year = rec.year;
+			ptr->dir->log.tm.tm_mon = rec.mon;
+			ptr->dir->log.tm.tm_mday = rec.mday;
+			ptr->dir->log.day = day_start(&ptr->dir->log.tm, 0);
+			ptr->dir->log.binary = rec.binary;
+			ptr->dir->log.dir_fd = ptr->dir->fd;
+			snprintf(ptr->dir->log.path, sizeof(ptr->dir->log.path),
+				 "%s/%04u-%02u-%02u.%s", ptr->dir->name,
+				 rec.year + 1900, rec.mon + 1, rec.mday,
+				 rec.binary ? "bin" : "log");
+			if (!rec.binary)
+				bloom_open(&ptr->dir->log);
+		}
+		if (rec.idx_fd != -1) {
+			fcntl(rec.idx_fd, F_SETFD, FD_CLOEXEC);
+			ptr->dir->log.idx_fp = fdopen(rec.idx_fd, "a");
+			ptr->dir->log.indexed = rec.indexed;
+		}
+		if (ptr->avail && timer_add(ptr)) {
+			ptr->dropped += ptr->avail;
+			dropped_bytes += ptr->avail;
+			ptr->avail = 0;
+			put_buffer(ptr);
+		}
+		restored++;
+	}
+	fclose(fp);
+	printf("Restored %d of %d clients.\n", restored, header.num_clients);
+	fflush(stdout);
+}
+
+/**
+ * do_upgrade - Execute the program file again, handing over everything.
+ *
+ * @fd: Receiver socket's file descriptor.
+ *
+ * Returns nothing if the successor couldn't be executed.
+ *
+ * Datagrams arriving meanwhile are queued in the socket, which the
+ * successor inherits. The successor re-reads options as usual, but keeps
+ * listening on the inherited socket.
+ */
+static void do_upgrade(const int fd)
+{
+	char env[32];
+	FILE *fp;
+	struct client_slab *slab;
+	struct client *ptr;
+	drain_queues();
+	flush_all(0);
+	wait_closer();
+	relay_save();
+	/*
+	 * The new process takes them over when it opens the log files.
+	 * Routes' log files and those opened ahead are simply opened again.
+	 */
+	for_each_client(slab, ptr) {
+		bloom_save(&ptr->dir->log);
+		close_logfile(&ptr->dir->next);
+		close_routes(ptr->dir);
+	}
+	fp = tmpfile();
+	if (!fp || save_state(fp)) {
+		fprintf(stderr, "Can't save state.\n");
+		goto out;
+	}
+	snprintf(env, sizeof(env), "%d:%d", fd, fileno(fp));
+	if (fcntl(fd, F_SETFD, 0) || setenv(HANDOFF_ENV, env, 1) ||
+	    fchdir(start_dir_fd))
+		goto out;
+	printf("Executing %s\n", exec_path);
+	fflush(stdout);
+	fflush(stderr);
+	execv(exec_path, saved_argv);
+	fprintf(stderr, "Can't execute %s .\n", exec_path);
+	unsetenv(HANDOFF_ENV);
+	if (chdir(current_options.log_dir))
+		fprintf(stderr, "Can't return to %s .\n",
+			current_options.log_dir);
+out:
+	if (fp)
+		fclose(fp);
+	for_each_client(slab, ptr)
+		if (ptr->dir->log.fp && !ptr->dir->log.binary)
+			bloom_open(&ptr->dir->log);
+}
+
+/**
+ * adopt_socket - Take over the listener socket from the predecessor.
+ *
+ * @opts:     Pointer to "struct options". @opts->addr and @opts->rbuf_size
+ *            are updated to those of the socket.
+ * @state_fd: Pointer to the file descriptor of the state.
+ *
+ * Returns the listener socket's file descriptor, -1 if not handed over.
+ */
+static int adopt_socket(struct options *opts, int *state_fd)
+{
+	const char *env = getenv(HANDOFF_ENV);
+	socklen_t size = sizeof(opts->addr);
+	int fd;
+	if (!env || sscanf(env, "%d:%d", &fd, state_fd) != 2)
+		return -1;
+	unsetenv(HANDOFF_ENV);
+	if (getsockname(fd, (struct sockaddr *) &opts->addr, &size) ||
+	    size != sizeof(opts->addr) || set_rbuf_size(fd, opts)) {
+		fprintf(stderr, "Can't take over the socket.\n");
+		exit(1);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+/**
+ * do_init - Initialization function.
+ *
+ * @argc: Number of arguments.
+ * @argv: Arguments.
+ *
+ * Returns the listener socket's file descriptor.
+ */
+static int do_init(int argc, char *argv[])
+{
+	struct options opts;
+	int state_fd = -1;
+	int fd;
+	int i;
+	saved_argc = argc;
+	saved_argv = argv;
+	for (i = 1; i < argc; i++)
+		if (!strncmp(argv[i], "conf=", 5)) {
+			conf_file = realpath(argv[i] + 5, NULL);
+			if (!conf_file) {
+				fprintf(stderr, "Can't find %s .\n",
+					argv[i] + 5);
+				exit(1);
+			}
+		}
+	if (load_options(&opts))
+		usage(argv[0]);
+	start_dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	/* Remember the path before the file is replaced by a new version. */
+	i = readlink("/proc/self/exe", exec_path, sizeof(exec_path) - 1);
+	if (i > 0) {
+		exec_path[i] = '\0';
+		if (i > 10 && !strcmp(exec_path + i - 10, " (deleted)"))
+			exec_path[i - 10] = '\0';
+	} else {
+		snprintf(exec_path, sizeof(exec_path), "%s", argv[0]);
+	}
+	for (i = 0; i < MAX_SUBSCRIBERS; i++)
+		subscribers[i].fd = -1;
+	fd = adopt_socket(&opts, &state_fd);
+	if (fd == -1)
+		fd = open_socket(&opts);
+	set_tail(&opts);
+	set_relay(&opts);
+	set_incidents(&opts);
+	if (start_dir_fd == -1 || fd == -1 || set_rules(&opts) ||
+	    set_names(&opts) || change_log_dir(&opts))
+		exit(1);
+	{
+		const time_t now = time(NULL);
+		struct tm *tm = localtime(&now);
+		printf("Started at %04u-%02u-%02u %02u:%02u:%02u at %s\n",
+		       tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+		       tm->tm_hour, tm->tm_min, tm->tm_sec, opts.log_dir);
+	}
+	/* Successfully initialized. */
+	apply_options(&opts);
+	print_options(&opts);
+	if (state_fd != -1)
+		restore_state(state_fd);
+	return fd;
+}
+
+/**
+ * init_signals - Route signals handled by the main loop to a signalfd.
+ *
+ * Returns the signalfd's file descriptor.
+ */
+static int init_signals(void)
+{
+	sigset_t mask;
+	int fd;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) ||
+	    (fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "Can't set up signal handling.\n");
+		exit(1);
 	}
-	/* Successfully initialized. */
-	printf("Options: ip=%s port=%u dir=%s timeout=%u clients=%u wbuf=%u "
-	       "rbuf=%u\n", inet_ntoa(addr.sin_addr), htons(addr.sin_port),
-	       pwd, wait_timeout, max_clients, wbuf_size, rbuf_size);
 	return fd;
 }
 
 int main(int argc, char *argv[])
 {
 	const int fd = do_init(argc, argv);
-	do_main(fd);
+	do_main(fd, init_signals());
 	return 0;
 }